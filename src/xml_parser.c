@@ -16,6 +16,9 @@
  * TODO error handling: use 'ereport()' and define numeric error codes.
  */
 
+#include "postgres.h"
+#include "utils/memutils.h"
+
 #include "xml_parser.h"
 #include "xmlnode_util.h"
 
@@ -112,7 +115,8 @@ typedef struct XMLNodeInternalData *XMLNodeInternal;
 static void processToken(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowed);
 static XMLNodeToken processTag(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowed,
 		   XMLNodeHdr * declAttrs, unsigned short *declAttrNum);
-static void checkXMLDeclaration(XMLNodeHdr * declAttrs, unsigned int attCount, XMLDecl decl);
+static void checkXMLDeclaration(XMLNodeHdr * declAttrs, unsigned int attCount, XMLDecl decl,
+					int srcEncoding);
 static char *getEncodingSimplified(const char *original);
 static void readName(XMLParserState state, bool whitespace);
 static unsigned int readComment(XMLParserState state);
@@ -126,6 +130,10 @@ static bool readReference(XMLParserState state, pg_wchar *value);
 static bool isPredefinedEntity(char *refStart, char *value);
 static void readDTD(XMLParserState state);
 static void processDTDNode(XMLParserState state);
+static void addIdAttrDecl(XMLParserState state, unsigned int elName, unsigned int elNameLen,
+			  unsigned int attrName, unsigned int attrNameLen);
+static bool isIdAttr(XMLParserState state, unsigned int elName, unsigned int elNameLen,
+		 unsigned int attrName, unsigned int attrNameLen);
 static void processLiteral(XMLParserState state, bool public);
 static bool readSpecialStringPart(char specStrings[][XNODE_SPEC_STR_MAX_LEN], XNodeSpecString strIndex,
 					  XMLParserState state, char offset);
@@ -136,6 +144,12 @@ static void nextChar(XMLParserState state, bool endAllowed);
 static void ensureSpace(unsigned int size, XMLParserState state);
 static void saveNodeHeader(XMLParserState state, XMLNodeInternal nodeInfo, char flags);
 static void saveContent(XMLParserState state, XMLNodeInternal nodeInfo);
+static bool saveNumValue(XMLParserState state, XMLNodeOffset strOff);
+static void finishTextNode(XMLParserState state);
+static void checkXMLSpace(XMLParserState state, unsigned int attrsFirst, unsigned short attributes);
+static unsigned short stripIgnorableWhitespace(XMLParserState state, unsigned int stackFirst,
+						 XMLNodeOffset contentOut);
+static bool isWhitespaceOnly(char *str);
 static void saveReferences(XMLParserState state, XMLNodeInternal nodeInfo, XMLCompNodeHdr compNode,
 			   unsigned short int children);
 static char *getContentToLog(char *input, unsigned int offset, unsigned int length, unsigned int maxLen);
@@ -145,6 +159,12 @@ static unsigned int dumpAttributes(XMLCompNodeHdr element, char *input,
 static void dumpContentEscaped(XMLNodeKind kind, char **output, char *input, unsigned int inputLen,
 				   unsigned int *outPos);
 static void dumpSpecString(char **output, char *outNew, unsigned int *outPos, unsigned int *incrInput);
+static void dumpNodeIndented(char *input, XMLNodeOffset nodeOff, StringInfo output, unsigned int indent,
+				 unsigned int level, bool preserve);
+static bool getXMLSpace(XMLCompNodeHdr element, bool preserve);
+static bool hasElementOnlyContent(XMLCompNodeHdr node);
+static void appendXMLNodeDump(StringInfo output, char *input, XMLNodeOffset nodeOff);
+static void appendStartTag(StringInfo output, XMLCompNodeHdr element, char *input);
 
 typedef struct PredefinedEntity
 {
@@ -390,7 +410,7 @@ xmlnodeParseNode(XMLParserState state)
 
 		ensureSpace(sizeof(XMLNodeOffset), state);
 		rootOffPtr = (XMLNodeOffset *) (state->tree + state->dstPos);
-		*rootOffPtr = xmlnodePop(&state->stack);
+		XNODE_SET_ROOT_OFFSET(rootOffPtr, xmlnodePop(&state->stack));
 		state->dstPos += sizeof(XMLNodeOffset);
 		SET_VARSIZE(state->result, state->dstPos + VARHDRSZ);
 	}
@@ -437,6 +457,15 @@ initXMLParserState(XMLParserState state, char *inputText, bool attrValue)
 		state->sizeOut = state->sizeIn + (state->sizeIn >> XNODE_OUT_OVERHEAD_BITS);
 		state->sizeOut = (state->sizeOut > XNODE_PARSER_OUTPUT_MIN) ? state->sizeOut
 			: XNODE_PARSER_OUTPUT_MIN;
+
+		/*
+		 * The estimate shouldn't prevent us from parsing documents whose
+		 * binary form does fit into a single value.
+		 */
+		if (state->sizeOut > MaxAllocSize - VARHDRSZ)
+		{
+			state->sizeOut = MaxAllocSize - VARHDRSZ;
+		}
 		elog(DEBUG1, "source xml size: %u, binary xml size (initial estimate): %u", state->sizeIn,
 			 state->sizeOut);
 	}
@@ -448,6 +477,12 @@ initXMLParserState(XMLParserState state, char *inputText, bool attrValue)
 		xmlnodeContainerInit(&state->stack);
 	}
 	state->decl = NULL;
+	state->srcEncoding = -1;
+	state->idAttrs = NULL;
+	state->idAttrCount = 0;
+	state->idAttrsMax = 0;
+	state->stripWhitespace = false;
+	state->preserveSpace = false;
 }
 
 void
@@ -462,6 +497,11 @@ finalizeXMLParserState(XMLParserState state)
 		pfree(state->decl);
 		state->decl = NULL;
 	}
+	if (state->idAttrs != NULL)
+	{
+		pfree(state->idAttrs);
+		state->idAttrs = NULL;
+	}
 }
 
 /*
@@ -613,17 +653,155 @@ readXMLAttValue(XMLParserState state, bool output, bool *refs)
 	return state->attrValue ? state->result : state->tree + pos;
 }
 
-bool
-xmlAttrValueIsNumber(char *value)
+/*
+ * If the string starting at 'strOff' represents a number, write its binary
+ * value to the output and return true.
+ */
+static bool
+saveNumValue(XMLParserState state, XMLNodeOffset strOff)
 {
+	double		numValue;
 	char	   *end;
 
-	strtod(value, &end);
-	while (XNODE_WHITESPACE(end) && *end != '\0')
+	if (!xmlStringIsNumber(state->tree + strOff, &numValue, &end, true))
+	{
+		return false;
+	}
+	ensureSpace(sizeof(double), state);
+	memcpy(state->tree + state->dstPos, &numValue, sizeof(double));
+	state->dstPos += sizeof(double);
+	return true;
+}
+
+/*
+ * To be called when the last part of a text node has been saved.
+ */
+static void
+finishTextNode(XMLParserState state)
+{
+	if (saveNumValue(state, state->textOut + sizeof(XMLNodeHdrData)))
+	{
+		XMLNodeHdr	node = (XMLNodeHdr) (state->tree + state->textOut);
+
+		node->flags |= XNODE_TEXT_NUMBER;
+	}
+}
+
+/*
+ * Set 'state->preserveSpace' according to xml:space attribute of an element,
+ * if the element has one. 'attrsFirst' is stack position of the first
+ * attribute.
+ */
+static void
+checkXMLSpace(XMLParserState state, unsigned int attrsFirst, unsigned short attributes)
+{
+	unsigned short i;
+
+	for (i = 0; i < attributes; i++)
 	{
-		end++;
+		XMLNodeHdr	attr = (XMLNodeHdr) (state->tree + state->stack.content[attrsFirst + i].value.single);
+
+		if (strcmp(XNODE_CONTENT(attr), XNODE_XML_SPACE) == 0)
+		{
+			char	   *value = XNODE_ATTR_VALUE(attr);
+
+			if (strcmp(value, XNODE_XML_SPACE_PRESERVE) == 0)
+			{
+				state->preserveSpace = true;
+			}
+			else if (strcmp(value, XNODE_XML_SPACE_DEFAULT) == 0)
+			{
+				state->preserveSpace = false;
+			}
+			return;
+		}
 	}
-	return (*end == '\0');
+}
+
+/*
+ * Content children of an element have been saved and their offsets are on
+ * the stack, starting at 'stackFirst'. If the content is element-only (the
+ * same rule as hasElementOnlyContent() uses), remove the text nodes (i.e.
+ * white space) from the stack as well as from the output, where subtree of
+ * the first child starts at 'contentOut'. Mixed content is left intact.
+ *
+ * Returns the number of children removed.
+ */
+static unsigned short
+stripIgnorableWhitespace(XMLParserState state, unsigned int stackFirst, XMLNodeOffset contentOut)
+{
+	unsigned int i,
+				kept;
+	bool		markup = false;
+	XMLNodeOffset src,
+				dst;
+
+	for (i = stackFirst; i < state->stack.position; i++)
+	{
+		XMLNodeHdr	child = (XMLNodeHdr) (state->tree + state->stack.content[i].value.single);
+
+		if (child->kind == XMLNODE_CDATA)
+		{
+			return 0;
+		}
+		else if (child->kind == XMLNODE_TEXT)
+		{
+			if (!isWhitespaceOnly(XNODE_TEXT(child)))
+			{
+				return 0;
+			}
+		}
+		else
+		{
+			markup = true;
+		}
+	}
+	if (!markup)
+	{
+		return 0;
+	}
+
+	/*
+	 * The children are moved towards the beginning of the output, so each
+	 * part is moved before it can be overwritten.
+	 */
+	src = dst = contentOut;
+	kept = stackFirst;
+	for (i = stackFirst; i < state->stack.position; i++)
+	{
+		XMLNodeOffset childOff = state->stack.content[i].value.single;
+		XMLNodeHdr	child = (XMLNodeHdr) (state->tree + childOff);
+
+		if (child->kind == XMLNODE_TEXT)
+		{
+			memmove(state->tree + dst, state->tree + src, childOff - src);
+			dst += childOff - src;
+			src = childOff + getXMLNodeSize(child, false);
+		}
+		else
+		{
+			state->stack.content[kept++].value.single = childOff - (src - dst);
+		}
+	}
+	memmove(state->tree + dst, state->tree + src, state->dstPos - src);
+	state->dstPos -= src - dst;
+	i = state->stack.position - kept;
+	state->stack.position = kept;
+	return i;
+}
+
+static bool
+isWhitespaceOnly(char *str)
+{
+	while (*str != '\0')
+	{
+		if (!XNODE_WHITESPACE(str))
+		{
+			return false;
+		}
+		str++;
+	}
+	return true;
 }
 
 /*
@@ -711,6 +889,10 @@ processToken(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowe
 			state->dstPos += nodeInfo->cntLength;
 			*(state->tree + state->dstPos) = 0x00;
 			state->dstPos++;
+			if (*(state->c + state->cWidth) != XNODE_CHAR_AMPERSAND)
+			{
+				finishTextNode(state);
+			}
 			return;
 		}
 		else if (allowed & TOKEN_TEXT)
@@ -753,6 +935,10 @@ processToken(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowe
 				state->dstPos--;
 			}
 			saveContent(state, nodeInfo);
+			if (next != XNODE_CHAR_AMPERSAND)
+			{
+				finishTextNode(state);
+			}
 			return;
 		}
 		else if (allowed & TOKEN_WHITESPACE)
@@ -791,7 +977,7 @@ processToken(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowe
 			processTag(state, nodeInfo, TOKEN_XMLDECL, declAttrs, &declAttNum);
 			nodeInfo->tokenType = TOKEN_XMLDECL;
 			state->decl = palloc(sizeof(XMLDeclData));
-			checkXMLDeclaration(declAttrs, declAttNum, state->decl);
+			checkXMLDeclaration(declAttrs, declAttNum, state->decl, state->srcEncoding);
 			return;
 		}
 		else
@@ -994,6 +1180,7 @@ processToken(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowe
 			element = (XMLCompNodeHdr) (state->tree + nodeInfo->nodeOut);
 			saveNodeHeader(state, nodeInfo, XNODE_EMPTY);
 			element->children = children;
+			element->attributes = attributes;
 			saveReferences(state, nodeInfo, element, children);
 			saveContent(state, nodeInfo);
 			return;
@@ -1008,9 +1195,16 @@ processToken(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowe
 			bool		childrenProcessed = false;
 			bool		match;
 			XMLCompNodeHdr element;
-			XMLNodeHdr	firstText = NULL;
+			XMLNodeOffset firstText = 0;
+			XMLNodeOffset contentOut;
+			bool		preserveSpace = state->preserveSpace;
 
 			state->saveHeader = true;
+			if (state->stripWhitespace)
+			{
+				checkXMLSpace(state, stackPosOrig, attributes);
+			}
+			contentOut = state->dstPos;
 
 			/*
 			 * Process children
@@ -1029,13 +1223,15 @@ processToken(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowe
 									 childTag.tokenType != TOKEN_REFERENCE);
 				if (!state->saveHeader)
 				{
-					if (firstText == NULL)
+					if (childTag.headerSaved)
 					{
-						firstText = (XMLNodeHdr) (state->tree + childTag.nodeOut);
+						firstText = childTag.nodeOut;
 					}
 					if (childTag.tokenType == TOKEN_REFERENCE && childTag.entPredef)
 					{
-						firstText->flags |= XNODE_TEXT_SPEC_CHARS;
+						XMLNodeHdr	textNode = (XMLNodeHdr) (state->tree + firstText);
+
+						textNode->flags |= XNODE_TEXT_SPEC_CHARS;
 					}
 				}
 				if (nlBefore != state->nestLevel)
@@ -1062,6 +1258,13 @@ processToken(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowe
 				}
 			} while (!childrenProcessed);
 
+			/* Only now it's known whether the content is element-only. */
+			if (state->stripWhitespace && !state->preserveSpace && children > attributes)
+			{
+				children -= stripIgnorableWhitespace(state, stackPosOrig + attributes, contentOut);
+			}
+			state->preserveSpace = preserveSpace;
+
 			Assert(childTag.tokenType == TOKEN_ETAG);
 			match = true;
 
@@ -1108,6 +1311,7 @@ processToken(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowe
 			element = (XMLCompNodeHdr) (state->tree + nodeInfo->nodeOut);
 			saveNodeHeader(state, nodeInfo, children == attributes ? XNODE_EMPTY : 0);
 			element->children = children;
+			element->attributes = attributes;
 			if (children > 0)
 			{
 				saveReferences(state, nodeInfo, element, children);
@@ -1270,6 +1474,7 @@ processTag(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowed,
 				unsigned int nameStart,
 							nameLength;
 				XMLNodeHdr	attrNode;
+				XMLNodeOffset attrOff;
 				XNodeListItem *stackItems;
 				unsigned short int i;
 				char	   *attrName,
@@ -1331,7 +1536,8 @@ processTag(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowed,
 					}
 				}
 				ensureSpace(sizeof(XMLNodeHdrData) + nameLength + 1, state);
-				attrNode = (XMLNodeHdr) (state->tree + state->dstPos);
+				attrOff = state->dstPos;
+				attrNode = (XMLNodeHdr) (state->tree + attrOff);
 				attrNode->kind = XMLNODE_ATTRIBUTE;
 				attrNode->flags = 0;
 				state->dstPos += sizeof(XMLNodeHdrData);
@@ -1361,6 +1567,9 @@ processTag(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowed,
 
 				quotMark = *state->c;
 				attrValue = readXMLAttValue(state, true, &refsInValue);
+
+				/* The output array might have been reallocated. */
+				attrNode = (XMLNodeHdr) (state->tree + attrOff);
 				if (refsInValue)
 				{
 					attrNode->flags |= XNODE_ATTR_CONTAINS_REF;
@@ -1369,8 +1578,14 @@ processTag(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowed,
 				{
 					attrNode->flags |= XNODE_ATTR_APOSTROPHE;
 				}
-				if (strlen(attrValue) > 0 && xmlAttrValueIsNumber(attrValue))
+				if (allowed != TOKEN_XMLDECL && isIdAttr(state, nodeInfo->cntSrc, nodeInfo->cntLength,
+														 nameStart, nameLength))
+				{
+					attrNode->flags |= XNODE_ATTR_ID;
+				}
+				if (allowed != TOKEN_XMLDECL && saveNumValue(state, attrValue - state->tree))
 				{
+					attrNode = (XMLNodeHdr) (state->tree + attrOff);
 					attrNode->flags |= XNODE_ATTR_NUMBER;
 				}
 				attributes++;
@@ -1391,7 +1606,7 @@ processTag(XMLParserState state, XMLNodeInternal nodeInfo, XMLNodeToken allowed,
  * http://www.w3.org/TR/xml/#NT-XMLDecl
  */
 static void
-checkXMLDeclaration(XMLNodeHdr * declAttrs, unsigned int attCount, XMLDecl decl)
+checkXMLDeclaration(XMLNodeHdr * declAttrs, unsigned int attCount, XMLDecl decl, int srcEncoding)
 {
 	unsigned int i;
 
@@ -1448,7 +1663,23 @@ checkXMLDeclaration(XMLNodeHdr * declAttrs, unsigned int attCount, XMLDecl decl)
 			{
 				elog(ERROR, "value '%s' not allowed for XML declaration attribute number %u", name, i + 1);
 			}
-			if (encDeclNow)
+			if (encDeclNow && srcEncoding >= 0)
+			{
+				if (pg_char_to_encoding(value) != srcEncoding)
+				{
+					elog(ERROR, "declared encoding '%s' doesn't match encoding of the input '%s'", value,
+						 pg_encoding_to_char(srcEncoding));
+				}
+
+				/*
+				 * The input has been converted to database encoding by now,
+				 * so the source encoding must not be declared anymore. As
+				 * for text input, the declaration names client encoding,
+				 * which is what the text is delivered in.
+				 */
+				decl->enc = pg_get_client_encoding();
+			}
+			else if (encDeclNow)
 			{
 				const char *clEnc = pg_get_client_encoding_name();
 				char	   *clEncSmp = getEncodingSimplified(clEnc);
@@ -1942,6 +2173,57 @@ readDTD(XMLParserState state)
 	}
 }
 
+static void
+addIdAttrDecl(XMLParserState state, unsigned int elName, unsigned int elNameLen,
+			  unsigned int attrName, unsigned int attrNameLen)
+{
+	XMLIdAttrDeclData *decl;
+
+	if (state->idAttrCount == state->idAttrsMax)
+	{
+		if (state->idAttrs == NULL)
+		{
+			state->idAttrsMax = XNODE_PARSER_LIST_CHUNK;
+			state->idAttrs = (XMLIdAttrDeclData *) palloc(state->idAttrsMax * sizeof(XMLIdAttrDeclData));
+		}
+		else
+		{
+			state->idAttrsMax *= 2;
+			state->idAttrs = (XMLIdAttrDeclData *) repalloc(state->idAttrs,
+								   state->idAttrsMax * sizeof(XMLIdAttrDeclData));
+		}
+	}
+	decl = state->idAttrs + state->idAttrCount++;
+	decl->elName = elName;
+	decl->elNameLen = elNameLen;
+	decl->attrName = attrName;
+	decl->attrNameLen = attrNameLen;
+}
+
+/*
+ * Does the DTD declare attribute at position 'attrName' of the input text to
+ * be of type ID if it appears in element whose name starts at 'elName'?
+ */
+static bool
+isIdAttr(XMLParserState state, unsigned int elName, unsigned int elNameLen,
+		 unsigned int attrName, unsigned int attrNameLen)
+{
+	unsigned short i;
+
+	for (i = 0; i < state->idAttrCount; i++)
+	{
+		XMLIdAttrDeclData *decl = state->idAttrs + i;
+
+		if (decl->elNameLen == elNameLen && decl->attrNameLen == attrNameLen &&
+			strncmp(state->inputText + decl->elName, state->inputText + elName, elNameLen) == 0 &&
+			strncmp(state->inputText + decl->attrName, state->inputText + attrName, attrNameLen) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 static void
 processDTDNode(XMLParserState state)
 {
@@ -2036,12 +2318,17 @@ processDTDNode(XMLParserState state)
 		}
 		else if (readSpecialString(specStringsDTD, XNODE_STR_DTD_ATTLIST, state))
 		{
+			unsigned int elName,
+						elNameLen;
+
 			if (!XNODE_WHITESPACE(state->c))
 			{
 				UNEXPECTED_CHARACTER;
 			}
 			readWhitespace(state, false);
+			elName = state->srcPos;
 			readName(state, false);
+			elNameLen = state->srcPos - elName;
 			while (XNODE_WHITESPACE(state->c))
 			{
 				nextChar(state, false);
@@ -2055,19 +2342,29 @@ processDTDNode(XMLParserState state)
 								len;
 					char	   *type;
 					bool		found = false;
+					unsigned int attrName = state->srcPos;
+					unsigned int attrNameLen;
 
 					readName(state, true);
+					/* readName() has also consumed one whitespace character. */
+					attrNameLen = state->srcPos - attrName - 1;
 					for (i = 0; i < XNODE_DTD_ATTR_TYPES; i++)
 					{
 						type = dtdAttTypes[i];
 						len = strlen(type);
-						if (strncmp(type, state->c, len) == 0)
+
+						/* Make sure that 'ID' doesn't match 'IDREF', etc. */
+						if (strncmp(type, state->c, len) == 0 && !XNODE_VALID_NAME_CHAR(state->c + len))
 						{
-							for (j = 0; i < len; j++)
+							for (j = 0; j < len; j++)
 							{
 								nextChar(state, false);
 							}
 							found = true;
+							if (strcmp(type, "ID") == 0)
+							{
+								addIdAttrDecl(state, elName, elNameLen, attrName, attrNameLen);
+							}
 							break;
 						}
 					}
@@ -2430,7 +2727,15 @@ ensureSpace(unsigned int size, XMLParserState state)
 	{
 		if (!state->attrValue)
 		{
+			if (state->sizeOut == MaxAllocSize - VARHDRSZ)
+			{
+				elog(ERROR, "binary form of the document would exceed %u bytes", (unsigned int) MaxAllocSize);
+			}
 			state->sizeOut += state->sizeOut >> XNODE_OUT_OVERHEAD_BITS;
+			if (state->sizeOut > MaxAllocSize - VARHDRSZ)
+			{
+				state->sizeOut = MaxAllocSize - VARHDRSZ;
+			}
 		}
 		else
 		{
@@ -2489,6 +2794,7 @@ saveNodeHeader(XMLParserState state, XMLNodeInternal nodeInfo, char flags)
 			break;
 		case TOKEN_TEXT:
 			node->kind = XMLNODE_TEXT;
+			state->textOut = nodeInfo->nodeOut;
 			break;
 		case TOKEN_REFERENCE:
 
@@ -2497,6 +2803,7 @@ saveNodeHeader(XMLParserState state, XMLNodeInternal nodeInfo, char flags)
 			 * will be used.
 			 */
 			node->kind = XMLNODE_TEXT;
+			state->textOut = nodeInfo->nodeOut;
 			break;
 		default:
 			elog(ERROR, "saveNodeHeader(): unrecognized token type: %u", nodeInfo->tokenType);
@@ -2536,8 +2843,9 @@ saveReferences(XMLParserState state, XMLNodeInternal nodeInfo,
 	XMLNodeOffset dist = nodeInfo->nodeOut -
 	state->stack.content[state->stack.position - children].value.single;
 	char		bwidth = getXMLNodeOffsetByteWidth(dist);
-	unsigned int refsTotal = children * bwidth;
+	unsigned int refsTotal = XNODE_REFS_SIZE(children, bwidth);
 	char	   *childOffTarg;
+	char	   *kinds;
 	unsigned short int i;
 	XMLNodeOffset elementOff = (char *) compNode - state->tree;
 
@@ -2545,6 +2853,7 @@ saveReferences(XMLParserState state, XMLNodeInternal nodeInfo,
 	compNode = (XMLCompNodeHdr) (state->tree + elementOff);
 	XNODE_SET_REF_BWIDTH(compNode, bwidth);
 	childOffTarg = XNODE_LAST_REF(compNode);
+	kinds = XNODE_CHILD_KINDS(compNode);
 	for (i = 0; i < children; i++)
 	{
 		XMLNodeOffset childOffset = xmlnodePop(&state->stack);
@@ -2556,6 +2865,7 @@ saveReferences(XMLParserState state, XMLNodeInternal nodeInfo,
 
 		writeXMLNodeOffset(dist, &childOffTarg, bwidth, false);
 		childOffTarg = XNODE_PREV_REF(childOffTarg, compNode);
+		kinds[children - i - 1] = ((XMLNodeHdr) (state->tree + childOffset))->kind;
 	}
 	state->dstPos += refsTotal;
 }
@@ -2626,6 +2936,7 @@ saveRootNodeHeader(XMLParserState state, XMLNodeKind kind)
 	XMLCompNodeHdr rootNode;
 	XNodeListItem *rootOffSrc;
 	char	   *rootOffTarg;
+	char	   *rootKinds;
 	XMLNodeOffset rootNodeOff = state->dstPos;
 	XMLNodeOffset *rootNodeOffPtr;
 	unsigned short int childCount;
@@ -2642,7 +2953,7 @@ saveRootNodeHeader(XMLParserState state, XMLNodeKind kind)
 	childCount = state->stack.position;
 	rootOffSrc = state->stack.content;
 	bwidth = getXMLNodeOffsetByteWidth(rootNodeOff - rootOffSrc->value.single);
-	refsTotal = childCount * bwidth;
+	refsTotal = XNODE_REFS_SIZE(childCount, bwidth);
 	ensureSpace(rootHdrSz + refsTotal, state);
 	state->dstPos += rootHdrSz;
 	rootNode = (XMLCompNodeHdr) (state->tree + rootNodeOff);
@@ -2650,17 +2961,20 @@ saveRootNodeHeader(XMLParserState state, XMLNodeKind kind)
 	XNODE_SET_REF_BWIDTH(rootNode, bwidth);
 	rootNode->common.kind = kind;
 	rootNode->children = childCount;
+	rootNode->attributes = 0;
 
 	/*
 	 * Not using xmlnodePop() on purpose. We need to get the nodes in the
 	 * correct order.
 	 */
 	rootOffTarg = XNODE_FIRST_REF(rootNode);
+	rootKinds = XNODE_CHILD_KINDS(rootNode);
 	for (i = 0; i < childCount; i++)
 	{
 		XMLNodeOffset dist = rootNodeOff - rootOffSrc->value.single;
 
 		writeXMLNodeOffset(dist, &rootOffTarg, bwidth, true);
+		rootKinds[i] = ((XMLNodeHdr) (state->tree + rootOffSrc->value.single))->kind;
 		rootOffSrc++;
 	}
 	state->dstPos += refsTotal;
@@ -2684,7 +2998,7 @@ saveRootNodeHeader(XMLParserState state, XMLNodeKind kind)
 	rootNode = (XMLCompNodeHdr) (state->tree + rootNodeOff);
 
 	rootNodeOffPtr = (XMLNodeOffset *) (state->tree + state->dstPos);
-	*rootNodeOffPtr = ((char *) rootNode - state->tree);
+	XNODE_SET_ROOT_OFFSET(rootNodeOffPtr, (char *) rootNode - state->tree);
 	state->dstPos += sizeof(XMLNodeOffset);
 	SET_VARSIZE(state->result, state->dstPos + VARHDRSZ);
 }
@@ -2704,8 +3018,8 @@ xmlnodeDumpNode(char *input, XMLNodeOffset nodeOff, char **output, unsigned int
 	switch (node->kind)
 	{
 			unsigned short int i;
-			char	   *childOffPtr,
-					   *lastChild;
+			char	   *childOffPtr;
+			XMLNodeOffset ref;
 
 		case XMLNODE_ELEMENT:
 		case XMLNODE_DOC:
@@ -2738,8 +3052,8 @@ xmlnodeDumpNode(char *input, XMLNodeOffset nodeOff, char **output, unsigned int
 			{
 				XMLCompNodeHdr eh = (XMLCompNodeHdr) node;
 
-				i = dumpAttributes(eh, input, output, pos);
-				childOffPtr = childOffPtr + i * XNODE_GET_REF_BWIDTH(eh);
+				dumpAttributes(eh, input, output, pos);
+				childOffPtr = XNODE_FIRST_CONTENT_REF(eh);
 
 				if (node->flags & XNODE_EMPTY)
 				{
@@ -2757,8 +3071,6 @@ xmlnodeDumpNode(char *input, XMLNodeOffset nodeOff, char **output, unsigned int
 				}
 				else
 				{
-					char	   *lastChild = XNODE_LAST_REF((XMLCompNodeHdr) node);
-
 					if (*output != NULL)
 					{
 						**output = XNODE_CHAR_RARROW;
@@ -2766,11 +3078,10 @@ xmlnodeDumpNode(char *input, XMLNodeOffset nodeOff, char **output, unsigned int
 					}
 					(*pos)++;
 
-					while (childOffPtr <= lastChild)
+					XNODE_FOREACH_REF(childOffPtr, XNODE_GET_REF_BWIDTH(eh), eh->children - eh->attributes, i, ref,
 					{
-						xmlnodeDumpNode(input, nodeOff - readXMLNodeOffset(&childOffPtr,
-							   XNODE_GET_REF_BWIDTH(eh), true), output, pos);
-					}
+						xmlnodeDumpNode(input, nodeOff - ref, output, pos);
+					});
 
 					/*
 					 * Etag
@@ -2795,14 +3106,12 @@ xmlnodeDumpNode(char *input, XMLNodeOffset nodeOff, char **output, unsigned int
 				/*
 				 * This is a document node.
 				 */
-				char	   *lastChild = XNODE_LAST_REF((XMLCompNodeHdr) node);
+				XMLCompNodeHdr doc = (XMLCompNodeHdr) node;
 
-				while (childOffPtr <= lastChild)
+				XNODE_FOREACH_REF(childOffPtr, XNODE_GET_REF_BWIDTH(doc), doc->children, i, ref,
 				{
-					xmlnodeDumpNode(input, nodeOff -
-									readXMLNodeOffset(&childOffPtr, XNODE_GET_REF_BWIDTH((XMLCompNodeHdr) node), true),
-									output, pos);
-				}
+					xmlnodeDumpNode(input, nodeOff - ref, output, pos);
+				});
 			}
 			break;
 
@@ -2828,12 +3137,7 @@ xmlnodeDumpNode(char *input, XMLNodeOffset nodeOff, char **output, unsigned int
 			break;
 
 		case XMLNODE_ATTRIBUTE:
-			content = XNODE_CONTENT(node);
-
-			/*
-			 * Skip name
-			 */
-			content += strlen(content) + 1;
+			content = XNODE_ATTR_VALUE(node);
 			cntLen = strlen(content);
 			if (*output != NULL)
 			{
@@ -2902,7 +3206,7 @@ xmlnodeDumpNode(char *input, XMLNodeOffset nodeOff, char **output, unsigned int
 
 		case XMLNODE_CDATA:
 		case XMLNODE_TEXT:
-			content = XNODE_CONTENT(node);
+			content = XNODE_TEXT(node);
 			cntLen = strlen(content);
 
 			if (node->flags & XNODE_TEXT_SPEC_CHARS)
@@ -2922,14 +3226,11 @@ xmlnodeDumpNode(char *input, XMLNodeOffset nodeOff, char **output, unsigned int
 
 		case XMLNODE_DOC_FRAGMENT:
 			childOffPtr = XNODE_FIRST_REF(((XMLCompNodeHdr) node));
-			lastChild = XNODE_LAST_REF((XMLCompNodeHdr) node);
-			while (childOffPtr <= lastChild)
+			XNODE_FOREACH_REF(childOffPtr, XNODE_GET_REF_BWIDTH((XMLCompNodeHdr) node),
+							  ((XMLCompNodeHdr) node)->children, i, ref,
 			{
-				XMLCompNodeHdr eh = (XMLCompNodeHdr) node;
-
-				xmlnodeDumpNode(input, nodeOff - readXMLNodeOffset(&childOffPtr, XNODE_GET_REF_BWIDTH(eh), true),
-								output, pos);
-			}
+				xmlnodeDumpNode(input, nodeOff - ref, output, pos);
+			});
 			break;
 
 		default:
@@ -2938,16 +3239,201 @@ xmlnodeDumpNode(char *input, XMLNodeOffset nodeOff, char **output, unsigned int
 	}
 }
 
+/*
+ * Append text representation of a node to 'output', so that each child of
+ * element having element-only content starts on a new line, 'indent' spaces
+ * deeper than its parent. White space text nodes of such elements are not
+ * dumped, the indentation replaces them.
+ *
+ * Content of elements in the scope of xml:space="preserve", as well as mixed
+ * content, is dumped as it is. Descendant having xml:space="default" is
+ * indented again.
+ */
+void
+xmlnodeDumpNodeIndented(char *input, XMLNodeOffset nodeOff, StringInfo output, unsigned int indent)
+{
+	dumpNodeIndented(input, nodeOff, output, indent, 0, false);
+}
+
+static void
+dumpNodeIndented(char *input, XMLNodeOffset nodeOff, StringInfo output, unsigned int indent,
+				 unsigned int level, bool preserve)
+{
+	XMLNodeHdr	node = (XMLNodeHdr) (input + nodeOff);
+	XMLCompNodeHdr compNode;
+	char		bwidth;
+	char	   *childOffPtr;
+	unsigned int childLevel = level;
+	bool		reindent,
+				childDumped = false;
+	unsigned short i;
+
+	if (node->kind != XMLNODE_ELEMENT && node->kind != XMLNODE_DOC && node->kind != XMLNODE_DOC_FRAGMENT)
+	{
+		appendXMLNodeDump(output, input, nodeOff);
+		return;
+	}
+
+	compNode = (XMLCompNodeHdr) node;
+	if (node->kind == XMLNODE_ELEMENT)
+	{
+		preserve = getXMLSpace(compNode, preserve);
+		appendStartTag(output, compNode, input);
+		if (node->flags & XNODE_EMPTY)
+		{
+			return;
+		}
+		childLevel++;
+	}
+
+	reindent = !preserve && hasElementOnlyContent(compNode);
+	bwidth = XNODE_GET_REF_BWIDTH(compNode);
+	childOffPtr = XNODE_FIRST_CONTENT_REF(compNode);
+	for (i = compNode->attributes; i < compNode->children; i++)
+	{
+		XMLNodeOffset childOff = nodeOff - readXMLNodeOffset(&childOffPtr, bwidth, true);
+
+		if (reindent)
+		{
+			if (XNODE_CHILD_KINDS(compNode)[i] == XMLNODE_TEXT)
+			{
+				/* White space, see hasElementOnlyContent(). */
+				continue;
+			}
+			if (output->len > 0)
+			{
+				appendStringInfoChar(output, '\n');
+			}
+			appendStringInfoSpaces(output, childLevel * indent);
+			childDumped = true;
+		}
+		dumpNodeIndented(input, childOff, output, indent, childLevel, !reindent);
+	}
+
+	if (node->kind == XMLNODE_ELEMENT)
+	{
+		if (childDumped)
+		{
+			appendStringInfoChar(output, '\n');
+			appendStringInfoSpaces(output, level * indent);
+		}
+		appendStringInfo(output, "</%s>", XNODE_ELEMENT_NAME(compNode));
+	}
+}
+
+/*
+ * Returns true if xml:space attribute of 'element' requires white space to
+ * be preserved, or 'preserve' if the element has no such attribute.
+ */
+static bool
+getXMLSpace(XMLCompNodeHdr element, bool preserve)
+{
+	char	   *refPtr = XNODE_FIRST_REF(element);
+	unsigned short i;
+
+	for (i = 0; i < element->attributes; i++)
+	{
+		XMLNodeHdr	attr = (XMLNodeHdr) ((char *) element -
+							 readXMLNodeOffset(&refPtr, XNODE_GET_REF_BWIDTH(element), true));
+
+		if (strcmp(XNODE_CONTENT(attr), XNODE_XML_SPACE) == 0)
+		{
+			char	   *value = XNODE_ATTR_VALUE(attr);
+
+			if (strcmp(value, XNODE_XML_SPACE_PRESERVE) == 0)
+			{
+				return true;
+			}
+			else if (strcmp(value, XNODE_XML_SPACE_DEFAULT) == 0)
+			{
+				return false;
+			}
+			break;
+		}
+	}
+	return preserve;
+}
+
+/*
+ * Element-only content contains at least one node other than text, and the
+ * text nodes (if there are any) only contain white spaces.
+ */
+static bool
+hasElementOnlyContent(XMLCompNodeHdr node)
+{
+	char	   *kinds = XNODE_CHILD_KINDS(node);
+	char	   *refPtr = XNODE_FIRST_CONTENT_REF(node);
+	char		bwidth = XNODE_GET_REF_BWIDTH(node);
+	bool		markup = false;
+	unsigned short i;
+
+	for (i = node->attributes; i < node->children; i++)
+	{
+		XMLNodeHdr	child = (XMLNodeHdr) ((char *) node - readXMLNodeOffset(&refPtr, bwidth, true));
+
+		if (kinds[i] == XMLNODE_CDATA)
+		{
+			return false;
+		}
+		else if (kinds[i] == XMLNODE_TEXT)
+		{
+			if (!isWhitespaceOnly(XNODE_TEXT(child)))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			markup = true;
+		}
+	}
+	return markup;
+}
+
+static void
+appendXMLNodeDump(StringInfo output, char *input, XMLNodeOffset nodeOff)
+{
+	char	   *out = NULL;
+	unsigned int size = 0;
+
+	xmlnodeDumpNode(input, nodeOff, &out, &size);
+	enlargeStringInfo(output, size);
+	out = output->data + output->len;
+	size = 0;
+	xmlnodeDumpNode(input, nodeOff, &out, &size);
+	output->len += size;
+	output->data[output->len] = '\0';
+}
+
+/*
+ * STag, or EmptyElemTag if the element has the XNODE_EMPTY flag.
+ */
+static void
+appendStartTag(StringInfo output, XMLCompNodeHdr element, char *input)
+{
+	char	   *out = NULL;
+	unsigned int size = 0;
+
+	appendStringInfo(output, "<%s", XNODE_ELEMENT_NAME(element));
+	dumpAttributes(element, input, &out, &size);
+	enlargeStringInfo(output, size);
+	out = output->data + output->len;
+	size = 0;
+	dumpAttributes(element, input, &out, &size);
+	output->len += size;
+	output->data[output->len] = '\0';
+	appendStringInfoString(output, (element->common.flags & XNODE_EMPTY) ? "/>" : ">");
+}
+
 static unsigned int
 dumpAttributes(XMLCompNodeHdr element, char *input,
 			   char **output, unsigned int *pos)
 {
 
-	unsigned int i = 0;
+	unsigned int i;
 	char	   *childOffPtr = XNODE_FIRST_REF(element);
-	char	   *lastChild = XNODE_LAST_REF(element);
 
-	while (childOffPtr <= lastChild)
+	for (i = 0; i < element->attributes; i++)
 	{
 		XMLNodeHdr	attrNode = (XMLNodeHdr) ((char *) element
 											 - readXMLNodeOffset(&childOffPtr, XNODE_GET_REF_BWIDTH(element), true));
@@ -2957,10 +3443,6 @@ dumpAttributes(XMLCompNodeHdr element, char *input,
 					attrValueLen;
 		char		qMark = (attrNode->flags & XNODE_ATTR_APOSTROPHE) ? XNODE_CHAR_APOSTR : XNODE_CHAR_QUOTMARK;
 
-		if (attrNode->kind != XMLNODE_ATTRIBUTE)
-		{
-			break;
-		}
 		attrName = (char *) attrNode + sizeof(XMLNodeHdrData);
 		attrNameLen = strlen(attrName);
 		if (*output != NULL)
@@ -2976,7 +3458,7 @@ dumpAttributes(XMLCompNodeHdr element, char *input,
 		}
 		*pos += attrNameLen + 3;
 
-		attrValue = attrName + attrNameLen + 1;
+		attrValue = XNODE_STRING(attrNode, attrName + attrNameLen + 1);
 		attrValueLen = strlen(attrValue);
 
 		if (attrNode->flags & XNODE_ATTR_CONTAINS_REF)
@@ -2999,7 +3481,6 @@ dumpAttributes(XMLCompNodeHdr element, char *input,
 			(*output)++;
 		}
 		(*pos)++;
-		i++;
 	}
 	return i;
 }
@@ -3117,70 +3598,6 @@ dumpSpecString(char **output, char *outNew, unsigned int *outPos, unsigned int *
 }
 
 
-/*
- * Write node offset into a character array. Little-endian byte ordering is
- * used, regardless the actual platform endianness.
- *
- * ref - the value to be written.
- * outPtr - where pointer to the current position in the output stream is stored.
- * bytes - how many bytes the value takes. This could be computed for each 'ref' value again,
- * however all references within a particular node must have the same 'byte width'.
- * Thus we need to determine this value outside.
- * step - whether '*outPtr' should be moved so that it's ready for the next write.
- */
-
-void
-writeXMLNodeOffset(XMLNodeOffset ref, char **outPtr, unsigned char bytes, bool step)
-{
-	unsigned int mask = 0xFF;
-	unsigned short int shift = 0;
-	unsigned char i;
-	char	   *out = *outPtr;
-
-	for (i = 0; i < bytes; i++)
-	{
-		unsigned int d = (ref & mask);
-
-		*out = (d >> shift);
-		out++;
-		mask <<= 8;
-		shift += 8;
-	}
-
-	if (step)
-	{
-		*outPtr += bytes;
-	}
-}
-
-/*
- * Return node offset value from '*input' char array where value takes 'bool'
- * bytes. If 'step' is true then the '*input' value is incremented so that
- * the next value can be retrieved.
- */
-XMLNodeOffset
-readXMLNodeOffset(char **input, unsigned char bytes, bool step)
-{
-	char	   *inpTmp = *input;
-	unsigned char i;
-	XMLNodeOffset result = 0;
-	unsigned short int shift = 0;
-
-	for (i = 0; i < bytes; i++)
-	{
-		unsigned int posValue = *((unsigned char *) inpTmp);
-
-		result += (posValue << shift);
-		inpTmp++;
-		shift += 8;
-	}
-	if (step)
-	{
-		*input = inpTmp;
-	}
-	return result;
-}
-
 char *
 dumpXMLDecl(XMLDecl decl)
 {
@@ -83,6 +83,18 @@ typedef enum XNodeXDeclAttNames
 #define XNODE_SPEC_TEXT_END(i)	((state->srcPos + 2 < state->sizeIn) && strncmp(state->c, specStrings[i],	strlen(specStrings[i])) == 0)
 
 
+/*
+ * Attribute declared as ID by the DTD. Names are referenced by position and
+ * length in the input text.
+ */
+typedef struct XMLIdAttrDeclData
+{
+	unsigned int elName;
+	unsigned int elNameLen;
+	unsigned int attrName;
+	unsigned int attrNameLen;
+}	XMLIdAttrDeclData;
+
 typedef struct XMLParserStateData
 {
 	/*
@@ -116,6 +128,35 @@ typedef struct XMLParserStateData
 	bool		saveHeader;
 	XMLNodeContainerData stack;
 	XMLDecl		decl;
+
+	/*
+	 * Encoding the input text had before it was converted to UTF-8. Encoding
+	 * in the XML declaration (if there's one) must match it. -1 means that
+	 * the input comes from client, so the client encoding is used.
+	 */
+	int			srcEncoding;
+
+	/*
+	 * ATTLIST declarations of ID attributes found in the DTD. The matching
+	 * attributes get XNODE_ATTR_ID flag.
+	 */
+	XMLIdAttrDeclData *idAttrs;
+	unsigned short idAttrCount;
+	unsigned short idAttrsMax;
+
+	/*
+	 * The text node being saved. Text and references may be saved in
+	 * multiple steps, see processToken().
+	 */
+	XMLNodeOffset textOut;
+
+	/*
+	 * If 'stripWhitespace' is true, text nodes consisting of white spaces
+	 * only are removed from element-only content, unless xml:space="preserve"
+	 * applies ('preserveSpace').
+	 */
+	bool		stripWhitespace;
+	bool		preserveSpace;
 }	XMLNodeParserStateData;
 
 typedef struct XMLParserStateData *XMLParserState;
@@ -131,10 +172,11 @@ extern void finalizeXMLParserState(XMLParserState state);
 extern void xmlnodeParseDoc(XMLParserState state);
 extern void xmlnodeParseNode(XMLParserState state);
 extern char *readXMLAttValue(XMLParserState state, bool output, bool *refs);
-extern bool xmlAttrValueIsNumber(char *value);
 
 extern void xmlnodeDumpNode(char *input, XMLNodeOffset nodeOff,
 				char **output, unsigned int *pos);
+extern void xmlnodeDumpNodeIndented(char *input, XMLNodeOffset nodeOff, StringInfo output,
+						unsigned int indent);
 extern char *dumpXMLDecl(XMLDecl decl);
 
 #endif   /* XML_PARSER_H */
@@ -15,6 +15,8 @@ static void prepareLiteral(XPathExprState exprState, XPathExprOperand operand);
 static void evaluateBinaryOperator(XPathExprState exprState, XPathExprOperandValue valueLeft, XPathExprOperandValue valueRight,
 					   XPathExprOperator operator, XPathExprOperandValue result, XMLCompNodeHdr element);
 
+static void initXMLScanLevel(XMLScan xscan, XMLScanOneLevel level, XMLCompNodeHdr parent);
+static bool skipToXMLElement(XMLScanOneLevel level);
 static bool considerSubScan(XPathElement xpEl, XMLNodeHdr node, XMLScan xscan, bool subScanJustDone);
 static void addNodeToIgnoreList(XMLNodeHdr node, XMLScan scan);
 
@@ -34,12 +36,12 @@ static bool compareValueToNode(XPathExprState exprState, XPathExprOperandValue v
 				   XPathExprOperator operator);
 static void compareNumToStr(double num, char *numStr, XPathExprOperator operator,
 				XPathExprOperandValue result);
+static bool getNodeNumValue(XMLNodeHdr node, double *num);
 static bool compareValueToNodeSet(XPathExprState exprState, XPathExprOperandValue value, XPathNodeSet ns,
 					  XPathExprOperator operator);
 static bool isOnIgnoreList(XMLNodeHdr node, XMLScan scan);
 static void getUnion(XPathExprState exprState, XPathNodeSet setLeft, XPathNodeSet setRight, XPathNodeSet setResult);
 static void copyNodeSet(XPathExprState exprState, XPathNodeSet nodeSet, XMLNodeHdr * output, unsigned int *position);
-static int	nodePtrComparator(const void *arg1, const void *arg2);
 
 /*
  * 'xscan' - the scan to be initialized 'xpath' - location path to be used
@@ -62,14 +64,11 @@ initXMLScan(XMLScan xscan, XMLScan parent, XPath xpath, XPathHeader xpHdr, XMLCo
 	xscan->xpath = xpath;
 	xscan->xpathHeader = xpHdr;
 	xscan->xpathRoot = 0;
+	xscan->depth = 0;
 	if (xscan->xpath->depth > 0)
 	{
 		firstLevel = (XMLScanOneLevel) palloc(xscan->xpath->depth * sizeof(XMLScanOneLevelData));
-		firstLevel->parent = scanRoot;
-		firstLevel->nodeRefPtr = XNODE_FIRST_REF(scanRoot);
-		firstLevel->siblingsLeft = scanRoot->children;
-		firstLevel->contextPosition = 0;
-		firstLevel->contextSizeKnown = false;
+		initXMLScanLevel(xscan, firstLevel, scanRoot);
 		firstLevel->up = (parent == NULL) ? NULL : XMLSCAN_CURRENT_LEVEL(parent);
 
 		xscan->state = firstLevel;
@@ -79,13 +78,22 @@ initXMLScan(XMLScan xscan, XMLScan parent, XPath xpath, XPathHeader xpHdr, XMLCo
 		xscan->state = NULL;
 	}
 
-	xscan->depth = 0;
 	xscan->skip = false;
 	xscan->subtreeDone = false;
 	xscan->document = document;
 
 	xscan->parent = parent;
 
+	if (xscan->parent == NULL)
+	{
+		initXMLIdIndexSlot(&xscan->idIndexData);
+		xscan->idIndex = &xscan->idIndexData;
+	}
+	else
+	{
+		xscan->idIndex = xscan->parent->idIndex;
+	}
+
 	if (checkUniqueness)
 	{
 		/*
@@ -210,6 +218,19 @@ getNextXMLNode(XMLScan xscan, bool removed)
 					subScanDone = true;
 				}
 			}
+			else if (!xscan->skip &&
+					 (!XPATH_LAST_LEVEL(xscan) || xscan->xpath->targNdKind == XMLNODE_ELEMENT))
+			{
+				/*
+				 * Only elements can match the current step or lead to a
+				 * matching node, so the other children need not be
+				 * dereferenced at all.
+				 */
+				if (!skipToXMLElement(scanLevel))
+				{
+					break;
+				}
+			}
 			currentNode = (XMLNodeHdr) ((char *) eh -
 										readXMLNodeOffset(&scanLevel->nodeRefPtr, XNODE_GET_REF_BWIDTH(eh), false));
 
@@ -265,7 +286,6 @@ getNextXMLNode(XMLScan xscan, bool removed)
 				!(XPATH_LAST_LEVEL(xscan) && xscan->xpath->targNdKind != XMLNODE_ELEMENT))
 			{
 				XMLCompNodeHdr currentElement = (XMLCompNodeHdr) currentNode;
-				char	   *childFirst = XNODE_FIRST_REF(currentElement);
 				char	   *name = XNODE_ELEMENT_NAME(currentElement);
 				char	   *nameTest = xpEl->name;
 
@@ -351,11 +371,7 @@ getNextXMLNode(XMLScan xscan, bool removed)
 							 */
 							xscan->depth++;
 							nextLevel = XMLSCAN_CURRENT_LEVEL(xscan);
-							nextLevel->parent = currentElement;
-							nextLevel->nodeRefPtr = childFirst;
-							nextLevel->siblingsLeft = currentElement->children;
-							nextLevel->contextPosition = 0;
-							nextLevel->contextSizeKnown = false;
+							initXMLScanLevel(xscan, nextLevel, currentElement);
 							nextLevel->up = scanLevel;
 							break;
 						}
@@ -505,16 +521,86 @@ getNextXMLNode(XMLScan xscan, bool removed)
 XPathExprState
 prepareXPathExpression(XPathExpression exprOrig, XMLCompNodeHdr ctxElem,
 					   xmldoc document, XPathHeader xpHdr, XMLScan xscan)
+{
+	XPathExprState state = createXPathExpressionState(exprOrig);
+
+	substituteXPathExpressionVars(state, ctxElem, document, xpHdr, xscan);
+	return state;
+}
+
+/*
+ * Allocate the expression copy and the variable caches, but do not substitute
+ * anything yet. This is the part of 'prepareXPathExpression()' that does not
+ * depend on the context node, so callers evaluating the same expression for
+ * many nodes only need to do it once and then use
+ * 'resetXPathExpressionState()' + 'substituteXPathExpressionVars()' for each
+ * node.
+ */
+XPathExprState
+createXPathExpressionState(XPathExpression exprOrig)
 {
 	XPathExpression expr = (XPathExpression) palloc(exprOrig->size);
 	XPathExprState state = (XPathExprState) palloc(sizeof(XPathExprStateData));
 
 	memcpy(expr, exprOrig, exprOrig->size);
 	state->expr = expr;
+	state->document = NULL;
+	initXMLIdIndexSlot(&state->idIndexData);
+	state->idIndex = &state->idIndexData;
 
 	allocXPathExpressionVarCache(state, XPATH_VAR_STRING, true);
 	allocXPathExpressionVarCache(state, XPATH_VAR_NODE_SINGLE, true);
 	allocXPathExpressionVarCache(state, XPATH_VAR_NODE_ARRAY, true);
+	return state;
+}
+
+/*
+ * Make the state ready for evaluation against another context node.
+ *
+ * The substitution modifies the expression, so the original one has to be
+ * copied again. The variable caches keep their size (they may have grown
+ * during the previous evaluation) and only the counters are cleared.
+ *
+ * The node-sets of the previous evaluation are not freed: they were allocated
+ * in the memory context of the previous function call, which might have been
+ * reset already.
+ */
+void
+resetXPathExpressionState(XPathExprState state, XPathExpression exprOrig)
+{
+	Assert(state->expr->size == exprOrig->size);
+	memcpy(state->expr, exprOrig, exprOrig->size);
+
+	state->count[XPATH_VAR_STRING] = 0;
+	state->count[XPATH_VAR_NODE_SINGLE] = 0;
+	state->count[XPATH_VAR_NODE_ARRAY] = 0;
+
+	if (state->nodeSets != NULL)
+	{
+		memset(state->nodeSets, 0, state->countMax[XPATH_VAR_NODE_ARRAY] * sizeof(XMLNodeHdr *));
+	}
+}
+
+void
+substituteXPathExpressionVars(XPathExprState state, XMLCompNodeHdr ctxElem, xmldoc document,
+							  XPathHeader xpHdr, XMLScan xscan)
+{
+	XPathExpression expr = state->expr;
+
+	if (xscan != NULL)
+	{
+		state->idIndex = xscan->idIndex;
+	}
+	else
+	{
+		if (document != state->document)
+		{
+			/* Index of the previous document must not be used. */
+			state->idIndexData.index = NULL;
+		}
+		state->idIndex = &state->idIndexData;
+	}
+	state->document = document;
 
 	/* Replace attribute names with the values found in the current node.  */
 	substituteAttributes(state, ctxElem);
@@ -533,10 +619,8 @@ prepareXPathExpression(XPathExpression exprOrig, XMLCompNodeHdr ctxElem,
 		 */
 		substituteFunctions(expr, xscan);
 	}
-	return state;
 }
 
-
 /*
  * Size is estimated for the initial allocation so that reallocation may not be needed.
  */
@@ -1169,6 +1253,59 @@ finalizeScanForTextNodes(XMLScan xscan)
 	finalizeXMLScan(xscan);
 }
 
+/*
+ * Prepare 'level' for iteration through children of 'parent'. Only the
+ * attribute block is scanned if attribute is the target of the path step
+ * (unless the step also needs descendants) and only the block following it
+ * if attributes are not of interest.
+ */
+static void
+initXMLScanLevel(XMLScan xscan, XMLScanOneLevel level, XMLCompNodeHdr parent)
+{
+	level->parent = parent;
+	level->contextPosition = 0;
+	level->contextSizeKnown = false;
+
+	if (xscan->xpath->targNdKind == XMLNODE_ATTRIBUTE && XPATH_LAST_LEVEL(xscan))
+	{
+		level->nodeRefPtr = XNODE_FIRST_REF(parent);
+		if (XPATH_CURRENT_LEVEL(xscan)->descendant)
+		{
+			level->siblingsLeft = parent->children;
+		}
+		else
+		{
+			level->siblingsLeft = parent->attributes;
+		}
+	}
+	else
+	{
+		level->nodeRefPtr = XNODE_FIRST_CONTENT_REF(parent);
+		level->siblingsLeft = XNODE_CONTENT_CHILDREN(parent);
+	}
+}
+
+/*
+ * Move 'level' to the next element child, using the array of child kinds.
+ * Returns false (and leaves no siblings to process) if there's no such child.
+ */
+static bool
+skipToXMLElement(XMLScanOneLevel level)
+{
+	XMLCompNodeHdr parent = level->parent;
+	char	   *kind = XNODE_CHILD_KINDS(parent) + XMLSCAN_LEVEL_NODE_INDEX(level);
+	char	   *element = memchr(kind, XMLNODE_ELEMENT, level->siblingsLeft);
+
+	if (element == NULL)
+	{
+		level->siblingsLeft = 0;
+		return false;
+	}
+	level->nodeRefPtr += (element - kind) * XNODE_GET_REF_BWIDTH(parent);
+	level->siblingsLeft -= element - kind;
+	return true;
+}
+
 /*
  * Sub-scans are used to search for descendants recursively.
  * It takes the current node as the root, so it in fact scans children of the current node.
@@ -1187,6 +1324,8 @@ considerSubScan(XPathElement xpEl, XMLNodeHdr node, XMLScan xscan, bool subScanJ
 			initXMLScan(xscan->subScan, xscan, xscan->xpath, xscan->xpathHeader, el, xscan->document,
 						xscan->ignoreList != NULL);
 			xscan->subScan->xpathRoot = xscan->xpathRoot + xscan->depth;
+			/* The first level depends on the path step, which has changed. */
+			initXMLScanLevel(xscan->subScan, xscan->subScan->state, el);
 			return true;
 		}
 	}
@@ -1214,7 +1353,7 @@ addNodeToIgnoreList(XMLNodeHdr node, XMLScan scan)
 static void
 substituteAttributes(XPathExprState exprState, XMLCompNodeHdr element)
 {
-	unsigned short childrenLeft = element->children;
+	unsigned short attrsLeft = element->attributes;
 	char	   *childFirst = XNODE_FIRST_REF(element);
 	char		bwidth = XNODE_GET_REF_BWIDTH(element);
 	char	   *chldOffPtr = childFirst;
@@ -1224,154 +1363,135 @@ substituteAttributes(XPathExprState exprState, XMLCompNodeHdr element)
 	unsigned int attrId = 0;
 	unsigned int attrsArrayId = 0;
 
-	while (childrenLeft > 0)
+	while (attrsLeft > 0)
 	{
 		XMLNodeHdr	child = (XMLNodeHdr) ((char *) element -
 							   readXMLNodeOffset(&chldOffPtr, bwidth, true));
 
-		if (child->kind == XMLNODE_ATTRIBUTE)
+		char	   *attrName = XNODE_CONTENT(child);
+		unsigned short i;
+		unsigned short matches = 0;
+		XPathOffset *varOffPtr = (XPathOffset *) ((char *) exprState->expr +
+											sizeof(XPathExpressionData));
+
+		Assert(child->kind == XMLNODE_ATTRIBUTE);
+
+		/*
+		 * Check all variables and find those referencing 'child'
+		 * attribute.
+		 */
+		for (i = 0; i < exprState->expr->variables; i++)
 		{
-			char	   *attrName = XNODE_CONTENT(child);
-			unsigned short i;
-			unsigned short matches = 0;
-			XPathOffset *varOffPtr = (XPathOffset *) ((char *) exprState->expr +
-												sizeof(XPathExpressionData));
+			XPathExprOperand opnd = (XPathExprOperand) ((char *) exprState->expr +
+														*varOffPtr);
 
-			/*
-			 * Check all variables and find those referencing 'child'
-			 * attribute.
-			 */
-			for (i = 0; i < exprState->expr->variables; i++)
+			if (opnd->substituted)
 			{
-				XPathExprOperand opnd = (XPathExprOperand) ((char *) exprState->expr +
-															*varOffPtr);
+				varOffPtr++;
+				continue;
+			}
 
-				if (opnd->substituted)
-				{
-					varOffPtr++;
-					continue;
-				}
+			if (opnd->type == XPATH_OPERAND_ATTRIBUTE)
+			{
+				XPathNodeSet nodeSet = &opnd->value.v.nodeSet;
+				unsigned int nodeNr = exprState->count[XPATH_VAR_NODE_SINGLE] + attrNr;
+				char	   *opndValue = XPATH_STRING_LITERAL(&opnd->value);
 
-				if (opnd->type == XPATH_OPERAND_ATTRIBUTE)
+				if (*opndValue == XNODE_CHAR_ASTERISK)
 				{
-					XPathNodeSet nodeSet = &opnd->value.v.nodeSet;
-					unsigned int nodeNr = exprState->count[XPATH_VAR_NODE_SINGLE] + attrNr;
-					char	   *opndValue = XPATH_STRING_LITERAL(&opnd->value);
-
-					if (*opndValue == XNODE_CHAR_ASTERISK)
+					if (attributes == NULL)
 					{
-						if (attributes == NULL)
-						{
-							char	   *attrOffPtr = childFirst;
-							unsigned short j;
-							unsigned int size = element->children * sizeof(XMLNodeHdr);
+						unsigned short j;
+						XMLNodeOffset ref;
 
-							attributes = (XMLNodeHdr *) palloc(size);
-							MemSet(attributes, 0, size);
-							for (j = 0; j < element->children; j++)
-							{
-								XMLNodeHdr	attrNode = (XMLNodeHdr) ((char *) element -
-								readXMLNodeOffset(&attrOffPtr, bwidth, true));
-
-								if (attrNode->kind != XMLNODE_ATTRIBUTE)
-								{
-									break;
-								}
-								attributes[j] = attrNode;
-								attrCount++;
-							}
-							Assert(j > 0);
-
-							if (attrCount == 1)
-							{
-								attrId = getXPathOperandId(exprState, attributes[0], XPATH_VAR_NODE_SINGLE);
+						attrCount = element->attributes;
+						attributes = (XMLNodeHdr *) palloc(attrCount * sizeof(XMLNodeHdr));
+						XNODE_FOREACH_REF(childFirst, bwidth, attrCount, j, ref,
+						{
+							attributes[j] = (XMLNodeHdr) ((char *) element - ref);
+						});
 
-								/*
-								 * In this case only the single attribute has
-								 * been added to the cache, so the
-								 * 'attributes' array is no longer needed.
-								 */
-								pfree(attributes);
-							}
-							else
-							{
-								attrsArrayId = getXPathOperandId(exprState, attributes, XPATH_VAR_NODE_ARRAY);
-							}
-						}
 						if (attrCount == 1)
 						{
-							nodeSet->nodes.nodeId = attrId;
+							attrId = getXPathOperandId(exprState, attributes[0], XPATH_VAR_NODE_SINGLE);
+
+							/*
+							 * In this case only the single attribute has
+							 * been added to the cache, so the
+							 * 'attributes' array is no longer needed.
+							 */
+							pfree(attributes);
 						}
 						else
 						{
-							nodeSet->nodes.arrayId = attrsArrayId;
+							attrsArrayId = getXPathOperandId(exprState, attributes, XPATH_VAR_NODE_ARRAY);
 						}
-						nodeSet->count = attrCount;
-						nodeSet->isDocument = false;
-						opnd->value.isNull = false;
-						opnd->substituted = true;
-						opnd->value.type = XPATH_VAL_NODESET;
 					}
-					else if (strcmp(attrName, opndValue) == 0)
+					if (attrCount == 1)
 					{
-						/*
-						 * Save node pointer into the variable cache and
-						 * assign its id to the operand.
-						 *
-						 * getXPathOperandId() can't be used here because any
-						 * attribute may be substituted for multiple
-						 * variables. It wouldn't bee too efficient to assign
-						 * a separate id (and storage) to such attribute
-						 * multiple times (i.e. once for each variable that
-						 * references it).
-						 */
-						matches++;
-						Assert(nodeNr <= exprState->countMax[XPATH_VAR_NODE_SINGLE]);
-						if (nodeNr == exprState->countMax[XPATH_VAR_NODE_SINGLE])
-						{
-							allocXPathExpressionVarCache(exprState, XPATH_VAR_NODE_SINGLE, false);
-						}
+						nodeSet->nodes.nodeId = attrId;
+					}
+					else
+					{
+						nodeSet->nodes.arrayId = attrsArrayId;
+					}
+					nodeSet->count = attrCount;
+					nodeSet->isDocument = false;
+					opnd->value.isNull = false;
+					opnd->substituted = true;
+					opnd->value.type = XPATH_VAL_NODESET;
+				}
+				else if (strcmp(attrName, opndValue) == 0)
+				{
+					/*
+					 * Save node pointer into the variable cache and
+					 * assign its id to the operand.
+					 *
+					 * getXPathOperandId() can't be used here because any
+					 * attribute may be substituted for multiple
+					 * variables. It wouldn't bee too efficient to assign
+					 * a separate id (and storage) to such attribute
+					 * multiple times (i.e. once for each variable that
+					 * references it).
+					 */
+					matches++;
+					Assert(nodeNr <= exprState->countMax[XPATH_VAR_NODE_SINGLE]);
+					if (nodeNr == exprState->countMax[XPATH_VAR_NODE_SINGLE])
+					{
+						allocXPathExpressionVarCache(exprState, XPATH_VAR_NODE_SINGLE, false);
+					}
 
-						/*
-						 * The attribute pointer is only added to cache once.
-						 * If it occurs in the expression multiple times, all
-						 * occurrences share the same instance in the cache.
-						 */
-						if (matches == 1)
-						{
-							exprState->nodes[nodeNr] = child;
-						}
+					/*
+					 * The attribute pointer is only added to cache once.
+					 * If it occurs in the expression multiple times, all
+					 * occurrences share the same instance in the cache.
+					 */
+					if (matches == 1)
+					{
+						exprState->nodes[nodeNr] = child;
+					}
 
-						nodeSet->nodes.nodeId = nodeNr;
-						nodeSet->count = 1;
-						nodeSet->isDocument = false;
+					nodeSet->nodes.nodeId = nodeNr;
+					nodeSet->count = 1;
+					nodeSet->isDocument = false;
 
-						opnd->value.isNull = false;
-						opnd->substituted = true;
-						opnd->value.type = XPATH_VAL_NODESET;
-					}
+					opnd->value.isNull = false;
+					opnd->substituted = true;
+					opnd->value.type = XPATH_VAL_NODESET;
 				}
-				varOffPtr++;
-			}
-
-			/*
-			 * If at least one variable references the current attribute, the
-			 * potential next attribute needs a new unique number.
-			 */
-			if (matches > 0)
-			{
-				attrNr++;
 			}
+			varOffPtr++;
 		}
-		else
+
+		/*
+		 * If at least one variable references the current attribute, the
+		 * potential next attribute needs a new unique number.
+		 */
+		if (matches > 0)
 		{
-			/*
-			 * Attributes are first of the children. Thus if the current node
-			 * is not an attribute, we're done.
-			 */
-			break;
+			attrNr++;
 		}
-		childrenLeft--;
+		attrsLeft--;
 	}
 	exprState->count[XPATH_VAR_NODE_SINGLE] += attrNr;
 }
@@ -1427,6 +1547,8 @@ substitutePaths(XPathExprState exprState, XPathExpression expression, XMLCompNod
 				XMLCompNodeHdr parent = (subPath->relative) ? element : (XMLCompNodeHdr) XNODE_ROOT(document);
 
 				initXMLScan(&xscanSub, NULL, subPath, xpHdr, parent, document, subPath->descendants > 0);
+				/* Predicates of the sub-path can use the index of 'exprState'. */
+				xscanSub.idIndex = exprState->idIndex;
 				while ((matching = getNextXMLNode(&xscanSub, false)) != NULL)
 				{
 					XMLNodeHdr *array = NULL;
@@ -1774,9 +1896,9 @@ compareElements(XMLCompNodeHdr elLeft, XMLCompNodeHdr elRight)
 	/*
 	 * Both left and right nodes are not null at this moment.
 	 */
-	textLeft = XNODE_CONTENT(nodeLeft);
+	textLeft = XNODE_TEXT(nodeLeft);
 	lengthLeft = strlen(textLeft);
-	textRight = XNODE_CONTENT(nodeRight);
+	textRight = XNODE_TEXT(nodeRight);
 	lengthRight = strlen(textRight);
 	charsToCompare = (lengthLeft < lengthRight) ? lengthLeft : lengthRight;
 
@@ -1793,7 +1915,7 @@ compareElements(XMLCompNodeHdr elLeft, XMLCompNodeHdr elRight)
 			{
 				break;
 			}
-			textLeft = XNODE_CONTENT(nodeLeft);
+			textLeft = XNODE_TEXT(nodeLeft);
 			textRight += charsToCompare;
 		}
 		else if (lengthLeft > lengthRight)
@@ -1804,7 +1926,7 @@ compareElements(XMLCompNodeHdr elLeft, XMLCompNodeHdr elRight)
 				break;
 			}
 			textLeft += charsToCompare;
-			textRight = XNODE_CONTENT(nodeRight);
+			textRight = XNODE_TEXT(nodeRight);
 		}
 		else
 		{
@@ -1820,8 +1942,8 @@ compareElements(XMLCompNodeHdr elLeft, XMLCompNodeHdr elRight)
 			{
 				break;
 			}
-			textLeft = XNODE_CONTENT(nodeLeft);
-			textRight = XNODE_CONTENT(nodeRight);
+			textLeft = XNODE_TEXT(nodeLeft);
+			textRight = XNODE_TEXT(nodeRight);
 		}
 		lengthLeft = strlen(textLeft);
 		lengthRight = strlen(textRight);
@@ -1848,6 +1970,21 @@ compareValueToNode(XPathExprState exprState, XPathExprOperandValue value, XMLNod
 	{
 		elog(ERROR, "unable to compare operand value type %u to a node", value->type);
 	}
+
+	/* Use the value stored at parse time if there's one. */
+	if (value->type == XPATH_VAL_NUMBER)
+	{
+		double		numValue;
+
+		if (getNodeNumValue(node, &numValue))
+		{
+			XPathExprOperandValueData result;
+
+			compareNumbers(value->v.num, numValue, operator, &result);
+			return result.v.boolean;
+		}
+	}
+
 	if (node->kind == XMLNODE_ELEMENT)
 	{
 
@@ -1865,7 +2002,7 @@ compareValueToNode(XPathExprState exprState, XPathExprOperandValue value, XMLNod
 
 			while ((textNode = getNextXMLNode(&textScan, false)) != NULL)
 			{
-				char	   *cntPart = XNODE_CONTENT(textNode);
+				char	   *cntPart = XNODE_TEXT(textNode);
 				unsigned int cntPartLen = strlen(cntPart);
 
 				nodeCntLen += cntPartLen;
@@ -2006,6 +2143,37 @@ compareNumToStr(double num, char *numStr, XPathExprOperator operator, XPathExprO
 	}
 }
 
+/*
+ * If the string value of 'node' has its binary number stored, set '*num' to
+ * it and return true. Element qualifies if its only content child is a text
+ * node, otherwise the text nodes would have to be concatenated.
+ */
+static bool
+getNodeNumValue(XMLNodeHdr node, double *num)
+{
+	if (node->kind == XMLNODE_ELEMENT)
+	{
+		XMLCompNodeHdr element = (XMLCompNodeHdr) node;
+		char	   *refPtr;
+
+		if (XNODE_CONTENT_CHILDREN(element) != 1 ||
+			XNODE_CHILD_KINDS(element)[element->attributes] != XMLNODE_TEXT)
+		{
+			return false;
+		}
+		refPtr = XNODE_FIRST_CONTENT_REF(element);
+		node = (XMLNodeHdr) ((char *) element -
+					 readXMLNodeOffset(&refPtr, XNODE_GET_REF_BWIDTH(element), false));
+	}
+
+	if (!XNODE_IS_NUMBER(node))
+	{
+		return false;
+	}
+	*num = getXMLNodeNumValue(node);
+	return true;
+}
+
 /*
  * The operator direction (whether '<' or '>') assumes 'value' is on the left
  * side in the expression and node-set on the right. If it's the other way
@@ -2178,7 +2346,7 @@ copyNodeSet(XPathExprState exprState, XPathNodeSet nodeSet, XMLNodeHdr * output,
 	}
 }
 
-static int
+int
 nodePtrComparator(const void *arg1, const void *arg2)
 {
 	XMLNodeHdr *node1 = (XMLNodeHdr *) arg1;
@@ -2,27 +2,69 @@
  * Copyright (C) 2012, Antonin Houska
  */
 
+#include "postgres.h"
+#include "utils/guc.h"
+
 #include "xmlnode.h"
 #include "xmlnode_util.h"
 #include "xml_update.h"
 #include "xpath.h"
 
+/*
+ * If less than 100, an element that a node is being appended into gets free
+ * space behind its header, so that the element can accommodate further
+ * nodes w/o the rest of the document being rewritten. The space is
+ * (100 - fillfactor) percent of the element (subtree) size.
+ */
+int			xnodeNodeFillfactor = 100;
+
+static xmldoc appendXMLNodeLocally(xmldoc doc, XMLScan xscan, XMLScanOneLevel levelScan,
+					 XMLCompNodeHdr targElement, XMLNodeHdr newNode, unsigned int newNdSize,
+					 bool freeSrc, XNodeListItem * ignore);
+static unsigned int getXMLNodeTrailingSpace(XMLCompNodeHdr parent, unsigned short index,
+						XMLNodeHdr node);
+static XMLNodeOffset getNewXMLNodeRootOffset(XMLNodeHdr newNode);
 static void adjustIgnoreList(XMLScan scan, XMLNodeOffset minimum, int shift);
 static void propagateChange(XMLScanOneLevel levelScan, int *shift, int *hdrSizeIncr, char *tree, char *resData,
-			 char **srcCursor, char **resCursor, XMLNodeOffset * newRootOff);
+			 char *resEnd, char **srcCursor, char **resCursor, XMLNodeOffset * newRootOff);
+static char getPropagatedRefBWidth(XMLScanOneLevel levelScan, int shift, int hdrSizeIncr);
+static unsigned int getXMLUpdateResultSize(xmldoc doc, XMLScanOneLevel levelScan, int shift,
+					   int hdrSizeIncr);
+static void checkXMLUpdateResultSpace(char *resCursor, unsigned int size, char *resEnd);
+static void finishXMLUpdateResult(XMLCompNodeHdr docNodeSrc, char *result, char *resCursor,
+					  XMLNodeOffset newRootOff, unsigned int resultSize);
 static void copyXMLDecl(XMLCompNodeHdr doc, char **resCursor);
 static void copySiblings(XMLCompNodeHdr parent, char **srcCursor, char **resCursor);
+static void copyChildKinds(XMLCompNodeHdr parentSrc, unsigned short index, unsigned short removed,
+			   char *added, unsigned short addedCount, char **srcCursor, char **resCursor);
+
+void
+initXMLUpdate(void)
+{
+	DefineCustomIntVariable("xnode.node_fillfactor",
+							"Percentage of space an element keeps occupied when a node is appended into it.",
+							"The rest is reserved for further appends. 100 disables the reservation.",
+							&xnodeNodeFillfactor,
+							100,
+							10,
+							100,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+}
 
 PG_FUNCTION_INFO_V1(xmlnode_add);
 
 Datum
 xmlnode_add(PG_FUNCTION_ARGS)
 {
-	xmldoc		doc = (xmldoc) PG_GETARG_VARLENA_P(0);
+	xmldoc		doc;
 	xpath		xpathPtr = (xpath) PG_GETARG_POINTER(1);
 	XPathExpression exprBase = (XPathExpression) VARDATA(xpathPtr);
 	XPathHeader xpHdr = (XPathHeader) ((char *) exprBase + exprBase->size);
-	XPath		xpath = getSingleXPath(exprBase, xpHdr);
+	XPath		xpath = getSingleXPath(exprBase, xpHdr, false);
 	xmlnode		newNdVar = (xmlnode) PG_GETARG_VARLENA_P(2);
 	BpChar	   *modeVar = PG_GETARG_BPCHAR_PP(3);
 	char		mode = *(VARDATA_ANY(modeVar));
@@ -30,6 +72,9 @@ xmlnode_add(PG_FUNCTION_ARGS)
 	xmldoc		result;
 	XMLScanData xscan;
 	XMLCompNodeHdr docRoot;
+	MemoryContext resContext,
+				oldcontext;
+	bool		inPlace;
 
 	if (xpath->relative)
 	{
@@ -44,11 +89,20 @@ xmlnode_add(PG_FUNCTION_ARGS)
 	{
 		elog(ERROR, "invalid node type to add: %s", getXMLNodeKindStr(newNode->kind));
 	}
+
+	/*
+	 * The document is modified w/o the string pool. The pool is created
+	 * again when the result gets flattened.
+	 */
+	doc = getXMLDocForUpdate(PG_GETARG_DATUM(0), &inPlace);
 	docRoot = (XMLCompNodeHdr) XNODE_ROOT(doc);
+	resContext = getXMLDocUpdateContext();
+	oldcontext = MemoryContextSwitchTo(resContext);
 	initXMLScan(&xscan, NULL, xpath, xpHdr, docRoot, doc, xpath->descendants > 0);
-	result = updateXMLDocument(&xscan, doc, XMLNODE_ACTION_ADD, newNode, XMLADD_MODE(mode));
+	result = updateXMLDocument(&xscan, doc, XMLNODE_ACTION_ADD, newNode, XMLADD_MODE(mode), inPlace);
 	finalizeXMLScan(&xscan);
-	PG_RETURN_POINTER(result);
+	MemoryContextSwitchTo(oldcontext);
+	PG_RETURN_DATUM(getXMLDocUpdateResult(PG_GETARG_DATUM(0), inPlace, result, resContext));
 }
 
 PG_FUNCTION_INFO_V1(xmlnode_remove);
@@ -56,14 +110,17 @@ PG_FUNCTION_INFO_V1(xmlnode_remove);
 extern Datum
 xmlnode_remove(PG_FUNCTION_ARGS)
 {
-	xmldoc		doc = (xmldoc) PG_GETARG_VARLENA_P(0);
+	xmldoc		doc;
 	xpath		xpathPtr = (xpath) PG_GETARG_POINTER(1);
 	XPathExpression exprBase = (XPathExpression) VARDATA(xpathPtr);
 	XPathHeader xpHdr = (XPathHeader) ((char *) exprBase + exprBase->size);
-	XPath		xpath = getSingleXPath(exprBase, xpHdr);
+	XPath		xpath = getSingleXPath(exprBase, xpHdr, false);
 	xmldoc		result;
 	XMLScanData xscan;
 	XMLCompNodeHdr docRoot;
+	MemoryContext resContext,
+				oldcontext;
+	bool		inPlace;
 
 	if (xpath->relative)
 	{
@@ -73,17 +130,23 @@ xmlnode_remove(PG_FUNCTION_ARGS)
 	{
 		elog(ERROR, "invalid target path");
 	}
+	doc = getXMLDocForUpdate(PG_GETARG_DATUM(0), &inPlace);
 	docRoot = (XMLCompNodeHdr) XNODE_ROOT(doc);
+	resContext = getXMLDocUpdateContext();
+	oldcontext = MemoryContextSwitchTo(resContext);
 	initXMLScan(&xscan, NULL, xpath, xpHdr, docRoot, doc, false);
-	result = updateXMLDocument(&xscan, doc, XMLNODE_ACTION_REMOVE, NULL, XMLADD_INVALID);
-
+	result = updateXMLDocument(&xscan, doc, XMLNODE_ACTION_REMOVE, NULL, XMLADD_INVALID, inPlace);
 	finalizeXMLScan(&xscan);
-	PG_RETURN_POINTER(result);
+	MemoryContextSwitchTo(oldcontext);
+	PG_RETURN_DATUM(getXMLDocUpdateResult(PG_GETARG_DATUM(0), inPlace, result, resContext));
 }
 
+/*
+ * If 'inPlace' is true, 'doc' may be modified or freed.
+ */
 xmldoc
 updateXMLDocument(XMLScan xscan, xmldoc doc, XMLNodeAction action, XMLNodeHdr newNode,
-				  XMLAddMode addMode)
+				  XMLAddMode addMode, bool inPlace)
 {
 
 	XMLNodeHdr	targNode = getNextXMLNode(xscan, false);
@@ -91,7 +154,7 @@ updateXMLDocument(XMLScan xscan, xmldoc doc, XMLNodeAction action, XMLNodeHdr ne
 
 	if (targNode != NULL)
 	{
-		bool		freeSrc = false;
+		bool		freeSrc = inPlace;
 
 		result = doc;
 
@@ -125,9 +188,7 @@ updateXMLDocument(XMLScan xscan, xmldoc doc, XMLNodeAction action, XMLNodeHdr ne
 			 */
 			if (xscan->depth == 0)
 			{
-				XMLNodeOffset *rootOff = (XMLNodeOffset *) ((char *) result + VARSIZE(result) -
-													  sizeof(XMLNodeOffset));
-				XMLCompNodeHdr root = (XMLCompNodeHdr) ((char *) VARDATA(result) + *rootOff);
+				XMLCompNodeHdr root = (XMLCompNodeHdr) XNODE_ROOT(result);
 
 				checkXMLWellFormedness(root);
 			}
@@ -149,12 +210,13 @@ updateXMLDocument(XMLScan xscan, xmldoc doc, XMLNodeAction action, XMLNodeHdr ne
 			}
 		}
 	}
+	else if (inPlace)
+	{
+		result = doc;
+	}
 	else
 	{
-		XMLNodeOffset *docRootOff = (XMLNodeOffset *) ((char *) doc + VARSIZE(doc) -
-													   sizeof(XMLNodeOffset));
-		char	   *inputTree = (char *) VARDATA(doc);
-		XMLNodeHdr	srcNode = (XMLNodeHdr) (inputTree + *docRootOff);
+		XMLNodeHdr	srcNode = XNODE_ROOT(doc);
 
 		result = (xmldoc) copyXMLNode(srcNode, NULL, true, NULL);
 	}
@@ -177,28 +239,32 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 {
 
 	char	   *inputTree = (char *) VARDATA(doc);
-	XMLNodeOffset *docRootOff = NULL;
 	XMLCompNodeHdr docNodeSrc = (XMLCompNodeHdr) XNODE_ROOT(doc);
 	XMLScanOneLevel levelScan;
-	unsigned short int i;
-	unsigned int extraSpace = 0;
 	unsigned int newNdSize,
 				targNdSize,
-				resultSizeMax,
 				resultSize;
 	char	   *result = NULL;
 	char	   *resData = NULL;
+	char	   *resEnd;
 	XMLNodeOffset targNdOff;
 	XMLNodeOffset srcIncr;
 	char	   *srcCursor = inputTree;
 	char	   *resCursor = NULL;
-	XMLCompNodeHdr levelNode,
-				parentSrc,
+	char	   *refPtr;
+	XMLCompNodeHdr parentSrc,
 				parentTarg;
 	unsigned char bwidthSrc,
 				bwidthTarg;
 	XMLScan		xscTmp;
 
+	/* Number of the nodes added and that of the parent's children. */
+	unsigned short added,
+				childrenTarg;
+
+	/* Reference width of the target element (XMLADD_INTO). */
+	char		bwidthInto = 0;
+
 	/*
 	 * Where root of the new subtree is located in the 'resultData'.
 	 */
@@ -208,6 +274,7 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 	int			shift;
 	XMLNodeOffset refSrc,
 				refTarg,
+				refMax,
 				newRootOff;
 	unsigned short lastInd = 0;
 
@@ -216,8 +283,12 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 	 * of the existing node a new node has been inserted into.
 	 */
 	unsigned short newNdIndex = 0;
+	unsigned short targNdIndex;
 	unsigned int intoHdrSzIncr = 0;
 
+	/* Free space to be reserved behind the target element (XMLADD_INTO). */
+	unsigned int slack = 0;
+
 	/*
 	 * Check the parameters
 	 */
@@ -235,41 +306,32 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 			elog(ERROR, "'replace' mode can't be used to replace attribute with non-attribute node and vice versa.");
 		}
 	}
+	else if (targNode->kind == XMLNODE_ATTRIBUTE)
+	{
+		/* Attributes have their own block of references. */
+		elog(ERROR, "attribute can only be target of the 'replace' mode");
+	}
+	else if (mode == XMLADD_INTO && targNode->kind != XMLNODE_ELEMENT)
+	{
+		elog(ERROR, "'into' addition mode can only be used for element");
+	}
 	if (newNode->kind == XMLNODE_DOC_FRAGMENT)
 	{
 		Assert(((XMLCompNodeHdr) newNode)->children > 0);
 	}
 
-	/*
-	 * Estimate how much the storage will grow. First, find out if some
-	 * references will grow in 'byte width'
-	 */
 	targNdOff = (char *) targNode - inputTree;
 
+	/* The target node might have been found by a sub-scan. */
 	xscTmp = xscan;
-	do
+	while (xscTmp->subScan != NULL)
 	{
-		levelScan = xscTmp->state;
-
-		for (i = 0; i <= xscTmp->depth; i++)
-		{
-			levelNode = levelScan->parent;
-
-			/*
-			 * Let's expect the worst - each reference size to grow to the
-			 * maximum: sizeof(XMLNodeOffset)
-			 */
-			extraSpace += levelNode->children * (sizeof(XMLNodeOffset) - XNODE_GET_REF_BWIDTH(levelNode));
-			levelScan++;
-		}
 		xscTmp = xscTmp->subScan;
-	} while (xscTmp != NULL);
-
-	levelScan--;
+	}
+	levelScan = XMLSCAN_CURRENT_LEVEL(xscTmp);
+	parentSrc = levelScan->parent;
+	targNdIndex = XMLSCAN_LEVEL_NODE_INDEX(levelScan);
 
-	/*
-	 * .. plus the new node(s) and the corresponding reference(s)
-	 */
 	newNdSize = getXMLNodeSize(newNode, true);
 	if (newNode->kind == XMLNODE_DOC_FRAGMENT)
 	{
@@ -277,19 +339,119 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		 * Ignore the fragment node itself - only its children will be added.
 		 */
 		newNdSize -= getXMLNodeSize(newNode, false);
-		extraSpace += newNdSize + ((XMLCompNodeHdr) newNode)->children * sizeof(XMLNodeOffset);
+		added = ((XMLCompNodeHdr) newNode)->children;
 	}
 	else
 	{
-		extraSpace += newNdSize + sizeof(XMLNodeOffset);
+		added = 1;
 	}
 
-	resultSizeMax = VARSIZE(doc) + extraSpace;
 	targNdSize = getXMLNodeSize(targNode, true);
-	if (mode == XMLADD_REPLACE)
+	if (mode == XMLADD_INTO)
+	{
+		xmldoc		resultLocal;
+		unsigned int space;
+		uint64		reserve;
+
+		resultLocal = appendXMLNodeLocally(doc, xscan, levelScan, (XMLCompNodeHdr) targNode,
+										   newNode, newNdSize, freeSrc, ignore);
+		if (resultLocal != NULL)
+		{
+			return resultLocal;
+		}
+
+		/*
+		 * The document has to be rewritten. If the fillfactor says so, make
+		 * sure that the next append into the same element won't need that.
+		 */
+		if (xnodeNodeFillfactor < 100)
+		{
+			space = getXMLNodeTrailingSpace(parentSrc, targNdIndex, targNode);
+			reserve = (uint64) (targNdSize + newNdSize) * (100 - xnodeNodeFillfactor) /
+				xnodeNodeFillfactor;
+			if (reserve > space)
+			{
+				slack = (unsigned int) reserve - space;
+			}
+		}
+	}
+
+	/*
+	 * Compute the size of the result, so that it can be allocated at once.
+	 * First, how the nodes below the parent's header and the header itself
+	 * change. The target node is a child of the parent, so the parent has
+	 * references.
+	 */
+	Assert(parentSrc->children > 0);
+	bwidthSrc = XNODE_GET_REF_BWIDTH(parentSrc);
+	refPtr = XNODE_FIRST_REF(parentSrc);
+	refSrc = readXMLNodeOffset(&refPtr, bwidthSrc, false);
+	if (mode == XMLADD_INTO)
+	{
+		XMLCompNodeHdr targElement = (XMLCompNodeHdr) targNode;
+		char		bwidthIntoSrc = 0;
+
+		/*
+		 * The greatest reference of the target element is that to its first
+		 * child or, if there's no child yet, that to the (first) new node.
+		 */
+		if (targElement->children > 0)
+		{
+			bwidthIntoSrc = XNODE_GET_REF_BWIDTH(targElement);
+			refPtr = XNODE_FIRST_REF(targElement);
+			bwidthInto = getXMLNodeOffsetByteWidth(readXMLNodeOffset(&refPtr, bwidthIntoSrc, false) +
+												   newNdSize);
+		}
+		else
+		{
+			/* The new node(s) are right before the target's header. */
+			bwidthInto = getXMLNodeOffsetByteWidth(newNdSize - getNewXMLNodeRootOffset(newNode));
+		}
+		intoHdrSzIncr = XNODE_REFS_SIZE(targElement->children + added, bwidthInto) -
+			XNODE_REFS_SIZE(targElement->children, bwidthIntoSrc) + slack;
+		shift = newNdSize + intoHdrSzIncr;
+		childrenTarg = parentSrc->children;
+	}
+	else
 	{
-		resultSizeMax -= targNdSize;
+		shift = newNdSize;
+		childrenTarg = parentSrc->children + added;
+		if (mode == XMLADD_REPLACE)
+		{
+			shift -= targNdSize;
+			childrenTarg--;
+		}
+	}
+
+	/*
+	 * The greatest reference of the parent is that to its first child. If
+	 * the new node becomes the first child, the reference points to it: the
+	 * new node is written where subtree of the target node starts and the
+	 * parent moves by 'shift'.
+	 */
+	if (mode == XMLADD_INTO)
+	{
+		refMax = refSrc + ((targNdIndex > 0) ? shift : intoHdrSzIncr);
+	}
+	else if (mode == XMLADD_AFTER || targNdIndex > 0)
+	{
+		refMax = refSrc + shift;
+	}
+	else
+	{
+		XMLNodeOffset newNdOff = targNdOff;
+
+		if (targNode->kind == XMLNODE_ELEMENT)
+		{
+			newNdOff = (char *) getFirstXMLNodeLeaf((XMLCompNodeHdr) targNode) - inputTree;
+		}
+		refMax = ((char *) parentSrc - inputTree) + shift - newNdOff - getNewXMLNodeRootOffset(newNode);
 	}
+	bwidthTarg = getXMLNodeOffsetByteWidth(refMax);
+	hdrSizeIncr = XNODE_REFS_SIZE(childrenTarg, bwidthTarg) - XNODE_REFS_SIZE(parentSrc->children, bwidthSrc);
+
+	/* ... and then the upper levels. */
+	resultSize = getXMLUpdateResultSize(doc, levelScan, shift + hdrSizeIncr, hdrSizeIncr);
 
 	/*
 	 * Make sure that the new node / subtree is ignored by further scan. For
@@ -300,11 +462,12 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 	ignore->kind = XNODE_LIST_ITEM_RANGE;
 	ignore->valid = true;
 
+	result = (char *) palloc(resultSize);
+	resCursor = resData = VARDATA(result);
+	resEnd = result + resultSize;
+
 	if (mode == XMLADD_BEFORE || mode == XMLADD_REPLACE)
 	{
-		result = (char *) palloc(resultSizeMax);
-		resCursor = resData = VARDATA(result);
-
 		/*
 		 * Copy input tree up to the target node's first descendant (first in
 		 * terms of absolute offset in the array)
@@ -317,6 +480,7 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		{
 			srcIncr = targNdOff;
 		}
+		checkXMLUpdateResultSpace(resCursor, srcIncr, resEnd);
 		memcpy(resCursor, inputTree, srcIncr);
 		srcCursor += srcIncr;
 		resCursor += srcIncr;
@@ -327,6 +491,7 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		 * Copy the new node(s). Once it's done, 'resCursor' points to a
 		 * position right after the new node.
 		 */
+		checkXMLUpdateResultSpace(resCursor, newNdSize, resEnd);
 		copyXMLNodeOrDocFragment(newNode, newNdSize, &resCursor, &newNdRoot, &newNdRoots);
 
 		/*
@@ -380,6 +545,7 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 			/*
 			 * Copy the whole target node (including subtree)
 			 */
+			checkXMLUpdateResultSpace(resCursor, targNdSize, resEnd);
 			copyXMLNode(targNode, resCursor, false, NULL);
 			resCursor += targNdSize;
 			shift = newNdSize;
@@ -415,13 +581,11 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 	}
 	else if (mode == XMLADD_AFTER)
 	{
-		result = (char *) palloc(resultSizeMax);
-		resCursor = resData = VARDATA(result);
-
 		/*
 		 * Copy input tree up to the target node header
 		 */
 		srcIncr = targNdOff;
+		checkXMLUpdateResultSpace(resCursor, srcIncr, resEnd);
 		memcpy(resCursor, inputTree, srcIncr);
 		srcCursor += srcIncr;
 		resCursor += srcIncr;
@@ -430,7 +594,9 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		 * Copy the target node header. If the node has descendants, these are
 		 * at lower offsets and were copied at the initial stage.
 		 */
-		memcpy(resCursor, srcCursor, srcIncr = getXMLNodeSize(targNode, false));
+		srcIncr = getXMLNodeSize(targNode, false);
+		checkXMLUpdateResultSpace(resCursor, srcIncr, resEnd);
+		memcpy(resCursor, srcCursor, srcIncr);
 
 		/*
 		 * 'srcCursor' is still at the target node (header). As the new node
@@ -445,6 +611,7 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 
 		/* ... and copy the new node */
 		ignore->value.range.lower = resCursor - resData;
+		checkXMLUpdateResultSpace(resCursor, newNdSize, resEnd);
 		copyXMLNodeOrDocFragment(newNode, newNdSize, &resCursor, &newNdRoot, &newNdRoots);
 		ignore->value.range.upper = resCursor - 1 - resData;
 	}
@@ -456,26 +623,21 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		XMLCompNodeHdr targUpdated;
 		unsigned int cntLen;
 		char		bws,
-					bwt;
-
-		if (targNode->kind != XMLNODE_ELEMENT)
-		{
-			elog(ERROR, "'into' addition mode can only be used for element");
-		}
-		result = (char *) palloc(resultSizeMax);
-		resCursor = resData = VARDATA(result);
+					bwt = bwidthInto;
 
 		/*
 		 * The following is similar to 'XMLADD_BEFORE', however the target
 		 * node is not copied.
 		 */
 		srcIncr = (char *) targElement - inputTree;
+		checkXMLUpdateResultSpace(resCursor, srcIncr, resEnd);
 		memcpy(resCursor, inputTree, srcIncr);
 		srcCursor += srcIncr;
 		resCursor += srcIncr;
 
 		/* Copy the new node. */
 		ignore->value.range.lower = resCursor - resData;
+		checkXMLUpdateResultSpace(resCursor, newNdSize, resEnd);
 		copyXMLNodeOrDocFragment(newNode, newNdSize, &resCursor, &newNdRoot, &newNdRoots);
 		ignore->value.range.upper = resCursor - 1 - resData;
 
@@ -490,6 +652,7 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		/*
 		 * Copy the target node header now
 		 */
+		checkXMLUpdateResultSpace(resCursor, getXMLNodeSize(targNode, false) + intoHdrSzIncr, resEnd);
 		memcpy(resCursor, srcCursor, srcIncr = sizeof(XMLCompNodeHdrData));
 		targUpdated = (XMLCompNodeHdr) resCursor;
 		refDstPtr = XNODE_FIRST_REF(targUpdated);
@@ -498,20 +661,15 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		if (targElement->children > 0)
 		{
 			unsigned short i;
-			XMLNodeHdr	last;
 
 			refSrcPtr = XNODE_FIRST_REF(targElement);
 			bws = XNODE_GET_REF_BWIDTH(targElement);
-			refSrc = readXMLNodeOffset(&refSrcPtr, bws, false);
-			bwt = getXMLNodeOffsetByteWidth(refSrc + newNdSize);
-
 			for (i = 0; i < targElement->children; i++)
 			{
 				refSrc = readXMLNodeOffset(&refSrcPtr, bws, true);
 				writeXMLNodeOffset(refSrc + newNdSize, &refDstPtr, bwt, true);
 			}
-			last = (XMLNodeHdr) ((char *) targElement - refSrc);
-			if (last->kind == XMLNODE_ATTRIBUTE)
+			if (XNODE_CONTENT_CHILDREN(targElement) == 0)
 			{
 				targUpdated->common.flags &= ~XNODE_EMPTY;
 			}
@@ -520,7 +678,6 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		{
 			bws = 0;
 			targUpdated->common.flags &= ~XNODE_EMPTY;
-			bwt = getXMLNodeOffsetByteWidth(newNdSize);
 		}
 
 		/* Add reference(s) for the new node */
@@ -540,15 +697,24 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		else
 		{
 			refTarg = (XMLNodeOffset) ((char *) targUpdated - newNdRoot);
-			if (targElement->children == 0)
-			{
-				bwt = getXMLNodeOffsetByteWidth(refTarg);
-			}
 			writeXMLNodeOffset(refTarg, &refDstPtr, bwt, true);
 			targUpdated->children++;
 		}
 
-		intoHdrSzIncr = targUpdated->children * bwt - targElement->children * bws;
+		/* Kinds of the existing children, followed by those of the new one(s). */
+		memcpy(refDstPtr, XNODE_CHILD_KINDS(targElement), targElement->children);
+		refDstPtr += targElement->children;
+		if (newNode->kind == XMLNODE_DOC_FRAGMENT)
+		{
+			XMLCompNodeHdr frag = (XMLCompNodeHdr) newNode;
+
+			memcpy(refDstPtr, XNODE_CHILD_KINDS(frag), frag->children);
+			refDstPtr += frag->children;
+		}
+		else
+		{
+			*(refDstPtr++) = newNode->kind;
+		}
 
 		/* copy target node name */
 		srcCursor = XNODE_ELEMENT_NAME(targElement);
@@ -566,7 +732,18 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 			XNODE_SET_REF_BWIDTH(targUpdated, bwt);
 		}
 
-		intoHdrSzIncr = getXMLNodeSize((XMLNodeHdr) targUpdated, false) - getXMLNodeSize(targNode, false);
+		/*
+		 * The free space follows the header, so the parent references it as
+		 * if it was part of the header.
+		 */
+		if (slack > 0)
+		{
+			memset(resCursor, 0, slack);
+			resCursor += slack;
+		}
+
+		intoHdrSzIncr = getXMLNodeSize((XMLNodeHdr) targUpdated, false) - getXMLNodeSize(targNode, false) +
+			slack;
 		if (intoHdrSzIncr > 0)
 		{
 			/*
@@ -584,23 +761,17 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		elog(ERROR, "Unknown addition mode.");
 	}
 
-	parentSrc = levelScan->parent;
-
 	/*
-	 * Note that 'siblingsLeft' attribute of the scan does include the child
-	 * element we're at.
+	 * Copy the remaining siblings of the new node if there are some.
 	 */
-	if (levelScan->siblingsLeft > 1)
-	{
-		/*
-		 * Copy the remaining siblings of the new node if there are some.
-		 */
-		copySiblings(parentSrc, &srcCursor, &resCursor);
-	}
+	checkXMLUpdateResultSpace(resCursor, (char *) parentSrc - srcCursor, resEnd);
+	copySiblings(parentSrc, &srcCursor, &resCursor);
 
 	/*
 	 * Copy header of the new node's parent and (adjusted) references
 	 */
+	checkXMLUpdateResultSpace(resCursor, getXMLNodeSize((XMLNodeHdr) parentSrc, false) + hdrSizeIncr,
+							  resEnd);
 	newRootOff = resCursor - resData;
 	memcpy(resCursor, srcCursor, srcIncr = sizeof(XMLCompNodeHdrData));
 	parentTarg = (XMLCompNodeHdr) resCursor;
@@ -616,24 +787,9 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		unsigned int i = 0;
 		unsigned short int refSrcCount = 1;
 
-		bwidthSrc = XNODE_GET_REF_BWIDTH(parentSrc);
+		/* 'bwidthSrc' and 'bwidthTarg' are known since the size computation. */
 		refSrc = readXMLNodeOffset(&srcCursor, bwidthSrc, false);
 
-		/*
-		 * TODO if the new node will have index 0, only its header size should
-		 * be added to the maximum reference range and not the whole
-		 * 'newNdSize'
-		 */
-		if (mode != XMLADD_REPLACE)
-		{
-			bwidthTarg = getXMLNodeOffsetByteWidth(refSrc + newNdSize);
-		}
-		else
-		{
-			bwidthTarg = getXMLNodeOffsetByteWidth(refSrc + newNdSize - targNdSize);
-		}
-
-
 		/*
 		 * Determine index (order) of the new node. If document fragment is
 		 * being added, this is the index of the first child of the fragment.
@@ -641,13 +797,13 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		switch (mode)
 		{
 			case XMLADD_AFTER:
-				newNdIndex = parentSrc->children - levelScan->siblingsLeft + 1;
+				newNdIndex = targNdIndex + 1;
 				break;
 
 			case XMLADD_BEFORE:
 			case XMLADD_REPLACE:
 			case XMLADD_INTO:
-				newNdIndex = parentSrc->children - levelScan->siblingsLeft;
+				newNdIndex = targNdIndex;
 				break;
 
 			default:
@@ -765,7 +921,6 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 				writeXMLNodeOffset(refTarg, &resCursor, bwidthTarg, true);
 			}
 		}
-		hdrSizeIncr = parentTarg->children * bwidthTarg - parentSrc->children * bwidthSrc;
 	}
 	else
 	{
@@ -787,7 +942,7 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 					writeXMLNodeOffset(refTarg, &resCursor, bwidthTarg, true);
 				}
 				parentTarg->children = fragNode->children;
-				hdrSizeIncr = parentTarg->children * bwidthTarg;
+				hdrSizeIncr = XNODE_REFS_SIZE(parentTarg->children, bwidthTarg);
 			}
 			else
 			{
@@ -795,7 +950,7 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 				bwidthTarg = getXMLNodeOffsetByteWidth(refTarg);
 				writeXMLNodeOffset(refTarg, &resCursor, bwidthTarg, true);
 				parentTarg->children = 1;
-				hdrSizeIncr = bwidthTarg;
+				hdrSizeIncr = XNODE_REFS_SIZE(1, bwidthTarg);
 			}
 		}
 		else
@@ -804,10 +959,28 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 			bwidthTarg = getXMLNodeOffsetByteWidth(refTarg);
 			writeXMLNodeOffset(refTarg, &resCursor, bwidthTarg, true);
 			parentTarg->children = 1;
-			hdrSizeIncr = bwidthTarg;
+			hdrSizeIncr = XNODE_REFS_SIZE(1, bwidthTarg);
 		}
 	}
 
+	if (mode == XMLADD_INTO)
+	{
+		/* The new node(s) went one level lower. */
+		copyChildKinds(parentSrc, 0, 0, NULL, 0, &srcCursor, &resCursor);
+	}
+	else if (newNode->kind == XMLNODE_DOC_FRAGMENT)
+	{
+		XMLCompNodeHdr fragNode = (XMLCompNodeHdr) newNode;
+
+		copyChildKinds(parentSrc, newNdIndex, (mode == XMLADD_REPLACE) ? 1 : 0,
+					   XNODE_CHILD_KINDS(fragNode), fragNode->children, &srcCursor, &resCursor);
+	}
+	else
+	{
+		copyChildKinds(parentSrc, newNdIndex, (mode == XMLADD_REPLACE) ? 1 : 0,
+					   (char *) &newNode->kind, 1, &srcCursor, &resCursor);
+	}
+
 	if (newNdRoots != NULL)
 	{
 		pfree(newNdRoots);
@@ -893,18 +1066,9 @@ xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 	 * Propagate the reference changes to higher levels of the tree if such
 	 * exist.
 	 */
-	propagateChange(levelScan, &shift, &hdrSizeIncr, inputTree, resData, &srcCursor, &resCursor, &newRootOff);
-
-	copyXMLDecl(docNodeSrc, &resCursor);
-	docRootOff = (XMLNodeOffset *) resCursor;
-	*docRootOff = newRootOff;
-	resultSize = resCursor - result + sizeof(XMLNodeOffset);
-
-	if (resultSize > resultSizeMax)
-	{
-		elog(ERROR, "add node: wrong estimate of result size");
-	}
-	SET_VARSIZE(result, resultSize);
+	propagateChange(levelScan, &shift, &hdrSizeIncr, inputTree, resData, resEnd, &srcCursor, &resCursor,
+					&newRootOff);
+	finishXMLUpdateResult(docNodeSrc, result, resCursor, newRootOff, resultSize);
 	if (freeSrc)
 	{
 		pfree(doc);
@@ -929,13 +1093,13 @@ xmldoc
 xmlnodeRemove(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, bool freeSrc)
 {
 	char	   *inputTree = (char *) VARDATA(doc);
-	XMLNodeOffset *docRootOff = NULL;
 	XMLCompNodeHdr docNodeSrc = (XMLCompNodeHdr) XNODE_ROOT(doc);
 	XMLScanOneLevel levelScan;
 	unsigned int targNdSize;
-	unsigned int resultSizeMax;
+	unsigned int resultSize;
 	char	   *result = NULL;
 	char	   *resData = NULL;
+	char	   *resEnd;
 	XMLNodeOffset targNdOff;
 	XMLNodeOffset srcIncr;
 	char	   *srcCursor = inputTree;
@@ -950,7 +1114,7 @@ xmlnodeRemove(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, bool freeSrc)
 	XMLNodeOffset refSrc,
 				newRootOff,
 				refTarg = 0;
-	unsigned short int targNdIndex = 0;
+	unsigned short int targNdIndex;
 
 	Assert(targNode != NULL);
 
@@ -960,12 +1124,50 @@ xmlnodeRemove(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, bool freeSrc)
 		xscan = xscan->subScan;
 	}
 	levelScan = XMLSCAN_CURRENT_LEVEL(xscan);
+	parentSrc = levelScan->parent;
+	targNdIndex = XMLSCAN_LEVEL_NODE_INDEX(levelScan);
 
 	targNdOff = (char *) targNode - inputTree;
 	targNdSize = getXMLNodeSize(targNode, true);
-	resultSizeMax = VARSIZE(doc) - targNdSize;
-	result = (char *) palloc(resultSizeMax);
+
+	/*
+	 * Compute the size of the result, see xmlnodeAdd(). If no child remains,
+	 * the parent has no references.
+	 */
+	bwidthSrc = XNODE_GET_REF_BWIDTH(parentSrc);
+	if (parentSrc->children > 1)
+	{
+		unsigned int refRangeDecr;
+		char	   *refPtr = XNODE_FIRST_REF(parentSrc);
+
+		/*
+		 * If the first child is removed, the reference to the second one
+		 * becomes the greatest. It does not change.
+		 */
+		if (targNdIndex == 0)
+		{
+			refPtr += bwidthSrc;
+			refRangeDecr = 0;
+		}
+		else
+		{
+			refRangeDecr = targNdSize;
+		}
+		refSrc = readXMLNodeOffset(&refPtr, bwidthSrc, false);
+		bwidthTarg = getXMLNodeOffsetByteWidth(refSrc - refRangeDecr);
+	}
+	else
+	{
+		bwidthTarg = 0;
+	}
+	hdrSizeIncr = XNODE_REFS_SIZE(parentSrc->children - 1, bwidthTarg) -
+		XNODE_REFS_SIZE(parentSrc->children, bwidthSrc);
+	shift = -targNdSize;
+	resultSize = getXMLUpdateResultSize(doc, levelScan, shift + hdrSizeIncr, hdrSizeIncr);
+
+	result = (char *) palloc(resultSize);
 	resCursor = resData = VARDATA(result);
+	resEnd = result + resultSize;
 
 	/*
 	 * The principle is quite similar to that of 'xmlnodeAss()', except for
@@ -979,6 +1181,7 @@ xmlnodeRemove(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, bool freeSrc)
 	{
 		srcIncr = targNdOff;
 	}
+	checkXMLUpdateResultSpace(resCursor, srcIncr, resEnd);
 	memcpy(resCursor, inputTree, srcIncr);
 
 	/*
@@ -987,38 +1190,27 @@ xmlnodeRemove(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, bool freeSrc)
 	srcCursor += srcIncr + targNdSize;
 	resCursor += srcIncr;
 
-	shift = -targNdSize;
-
-	parentSrc = levelScan->parent;
-	if (levelScan->siblingsLeft > 1)
-	{
-		copySiblings(parentSrc, &srcCursor, &resCursor);
-	}
+	checkXMLUpdateResultSpace(resCursor, (char *) parentSrc - srcCursor, resEnd);
+	copySiblings(parentSrc, &srcCursor, &resCursor);
+	checkXMLUpdateResultSpace(resCursor, getXMLNodeSize((XMLNodeHdr) parentSrc, false) + hdrSizeIncr,
+							  resEnd);
 	newRootOff = resCursor - resData;
 	memcpy(resCursor, srcCursor, srcIncr = sizeof(XMLCompNodeHdrData));
 	parentTarg = (XMLCompNodeHdr) resCursor;
 	srcCursor += srcIncr;
 	resCursor += srcIncr;
 	parentTarg->children = parentSrc->children - 1;
-	bwidthSrc = XNODE_GET_REF_BWIDTH(parentSrc);
+	if (targNode->kind == XMLNODE_ATTRIBUTE)
+	{
+		parentTarg->attributes--;
+	}
 
 	if (parentSrc->children > 1)
 	{
-		unsigned int refRangeDecr;
 		unsigned short int refSrcCount;
 
-		targNdIndex = parentSrc->children - levelScan->siblingsLeft;
-		if (targNdIndex == 0)
-		{
-			refRangeDecr = getXMLNodeSize(targNode, false);
-		}
-		else
-		{
-			refRangeDecr = targNdSize;
-		}
 		refSrc = readXMLNodeOffset(&srcCursor, bwidthSrc, false);
 		refSrcCount = 1;
-		bwidthTarg = getXMLNodeOffsetByteWidth(refSrc - refRangeDecr);
 		for (i = 0; i < parentSrc->children; i++)
 		{
 			if (i < targNdIndex)
@@ -1040,22 +1232,25 @@ xmlnodeRemove(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, bool freeSrc)
 				refSrcCount++;
 			}
 		}
-		hdrSizeIncr = parentTarg->children * bwidthTarg - parentSrc->children * bwidthSrc;
 	}
 	else
 	{
 		/*
 		 * No children left
 		 */
-		hdrSizeIncr = -bwidthSrc;
-		bwidthTarg = 0;
 		srcCursor += bwidthSrc;
 	}
+	copyChildKinds(parentSrc, targNdIndex, 1, NULL, 0, &srcCursor, &resCursor);
 
 	if (bwidthSrc != bwidthTarg)
 	{
 		XNODE_RESET_REF_BWIDTH(parentTarg);
-		XNODE_SET_REF_BWIDTH(parentTarg, bwidthTarg);
+
+		/* Zero width (no references) must not be stored in the flags. */
+		if (bwidthTarg > 0)
+		{
+			XNODE_SET_REF_BWIDTH(parentTarg, bwidthTarg);
+		}
 	}
 
 	/*
@@ -1090,44 +1285,211 @@ xmlnodeRemove(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, bool freeSrc)
 		/*
 		 * ... does it become empty element?
 		 */
-		if (!(parentSrc->common.flags & XNODE_EMPTY))
+		if (XNODE_CONTENT_CHILDREN(parentTarg) == 0)
 		{
-			bool		empty = false;
+			parentTarg->common.flags |= XNODE_EMPTY;
+		}
+	}
 
-			if (parentTarg->children > 0)
-			{
-				char	   *refPtr = XNODE_LAST_REF(parentTarg);
-				XMLNodeOffset lastRefOff = readXMLNodeOffset(&refPtr, XNODE_GET_REF_BWIDTH(parentTarg), false);
-				XMLNodeHdr	lastChild = (XMLNodeHdr) ((char *) parentTarg - lastRefOff);
+	propagateChange(levelScan, &shift, &hdrSizeIncr, inputTree, resData, resEnd, &srcCursor,
+					&resCursor, &newRootOff);
+	finishXMLUpdateResult(docNodeSrc, result, resCursor, newRootOff, resultSize);
+	if (freeSrc)
+	{
+		pfree(doc);
+	}
+	return (xmldoc) result;
+}
 
-				if (lastChild->kind == XMLNODE_ATTRIBUTE)
-				{
-					empty = true;
-				}
-			}
-			else
-			{
-				empty = true;
-			}
-			if (empty)
+/*
+ * Append 'newNode' (of size 'newNdSize') to the children of 'targElement'
+ * w/o rewriting the rest of the document. That's possible if the free space
+ * behind the element header (see 'xnode.node_fillfactor') can accommodate
+ * both the new node and the grown header: the new node is written where the
+ * header starts and the header is moved behind it, so that only the parent's
+ * reference to the element needs to change.
+ *
+ * The document is modified in place if 'freeSrc' is true, i.e. if it's a
+ * result of the previous update. Otherwise a copy is modified.
+ *
+ * Returns NULL if there's not enough free space.
+ */
+static xmldoc
+appendXMLNodeLocally(xmldoc doc, XMLScan xscan, XMLScanOneLevel levelScan,
+					 XMLCompNodeHdr targElement, XMLNodeHdr newNode, unsigned int newNdSize,
+					 bool freeSrc, XNodeListItem * ignore)
+{
+	char	   *inputTree = (char *) VARDATA(doc);
+	XMLCompNodeHdr parentSrc = levelScan->parent;
+	unsigned short targNdIndex = XMLSCAN_LEVEL_NODE_INDEX(levelScan);
+	unsigned int hdrSize = getXMLNodeSize((XMLNodeHdr) targElement, false);
+	unsigned int space = getXMLNodeTrailingSpace(parentSrc, targNdIndex, (XMLNodeHdr) targElement);
+	XMLNodeOffset targNdOff = (char *) targElement - inputTree;
+	unsigned short added;
+	char		bws = XNODE_GET_REF_BWIDTH(targElement);
+	char		bwt,
+				bwp;
+	XMLNodeOffset refMax,
+				ref;
+	char	   *result,
+			   *resData,
+			   *resCursor,
+			   *refSrcPtr,
+			   *refDstPtr;
+	char	   *newNdRoot = NULL;
+	char	  **newNdRoots = NULL;
+	XMLCompNodeHdr targSrc,
+				targUpdated,
+				parentTarg;
+	unsigned short i;
+
+	added = (newNode->kind == XMLNODE_DOC_FRAGMENT) ? ((XMLCompNodeHdr) newNode)->children : 1;
+
+	/*
+	 * References to the existing children grow by the size of the new
+	 * node(s), those to the new ones can't be greater than that.
+	 */
+	if (targElement->children > 0)
+	{
+		refSrcPtr = XNODE_FIRST_REF(targElement);
+		refMax = readXMLNodeOffset(&refSrcPtr, bws, false) + newNdSize;
+	}
+	else
+	{
+		refMax = newNdSize;
+	}
+	bwt = getXMLNodeOffsetByteWidth(refMax);
+	if (newNdSize + hdrSize + XNODE_REFS_SIZE(targElement->children + added, bwt) -
+		XNODE_REFS_SIZE(targElement->children, bws) > hdrSize + space)
+	{
+		return NULL;
+	}
+
+	if (freeSrc)
+	{
+		result = (char *) doc;
+	}
+	else
+	{
+		result = (char *) palloc(VARSIZE(doc));
+		memcpy(result, doc, VARSIZE(doc));
+	}
+	resData = VARDATA(result);
+
+	/* The new node(s) will overwrite the header. */
+	targSrc = (XMLCompNodeHdr) palloc(hdrSize);
+	memcpy(targSrc, targElement, hdrSize);
+
+	resCursor = resData + targNdOff;
+	ignore->kind = XNODE_LIST_ITEM_RANGE;
+	ignore->valid = true;
+	ignore->value.range.lower = targNdOff;
+	copyXMLNodeOrDocFragment(newNode, newNdSize, &resCursor, &newNdRoot, &newNdRoots);
+	ignore->value.range.upper = resCursor - 1 - resData;
+
+	targUpdated = (XMLCompNodeHdr) resCursor;
+	memcpy(targUpdated, targSrc, sizeof(XMLCompNodeHdrData));
+	targUpdated->children += added;
+	targUpdated->common.flags &= ~XNODE_EMPTY;
+	XNODE_RESET_REF_BWIDTH(targUpdated);
+	XNODE_SET_REF_BWIDTH(targUpdated, bwt);
+
+	refSrcPtr = XNODE_FIRST_REF(targSrc);
+	refDstPtr = XNODE_FIRST_REF(targUpdated);
+	for (i = 0; i < targSrc->children; i++)
+	{
+		ref = readXMLNodeOffset(&refSrcPtr, bws, true);
+		writeXMLNodeOffset(ref + newNdSize, &refDstPtr, bwt, true);
+	}
+	if (newNode->kind == XMLNODE_DOC_FRAGMENT)
+	{
+		for (i = 0; i < added; i++)
+		{
+			writeXMLNodeOffset((char *) targUpdated - newNdRoots[i], &refDstPtr, bwt, true);
+		}
+		memcpy(refDstPtr + targSrc->children, XNODE_CHILD_KINDS((XMLCompNodeHdr) newNode), added);
+		pfree(newNdRoots);
+	}
+	else
+	{
+		writeXMLNodeOffset((char *) targUpdated - newNdRoot, &refDstPtr, bwt, true);
+		refDstPtr[targSrc->children] = newNode->kind;
+	}
+	memcpy(refDstPtr, XNODE_CHILD_KINDS(targSrc), targSrc->children);
+	refDstPtr += targSrc->children + added;
+	strcpy(refDstPtr, XNODE_ELEMENT_NAME(targSrc));
+	pfree(targSrc);
+
+	/* The element has moved towards its parent. */
+	parentTarg = (XMLCompNodeHdr) (resData + ((char *) parentSrc - inputTree));
+	bwp = XNODE_GET_REF_BWIDTH(parentTarg);
+	refDstPtr = XNODE_FIRST_REF(parentTarg) + targNdIndex * bwp;
+	ref = readXMLNodeOffset(&refDstPtr, bwp, false);
+	writeXMLNodeOffset(ref - newNdSize, &refDstPtr, bwp, false);
+
+	/*
+	 * Only the element itself has moved, the nodes following the free space
+	 * have not.
+	 */
+	adjustIgnoreList(xscan, targNdOff, newNdSize);
+	adjustIgnoreList(xscan, targNdOff + hdrSize + space + newNdSize, -((int) newNdSize));
+
+	if (result != (char *) doc)
+	{
+		/* Let the scan continue in the copy. */
+		while (levelScan != NULL)
+		{
+			levelScan->parent = (XMLCompNodeHdr) (resData + ((char *) levelScan->parent - inputTree));
+			if (levelScan->nodeRefPtr != NULL)
 			{
-				parentTarg->common.flags |= XNODE_EMPTY;
+				levelScan->nodeRefPtr = resData + (levelScan->nodeRefPtr - inputTree);
 			}
+			levelScan = levelScan->up;
 		}
 	}
+	return (xmldoc) result;
+}
 
-	propagateChange(levelScan, &shift, &hdrSizeIncr, inputTree, resData, &srcCursor,
-					&resCursor, &newRootOff);
+/*
+ * Returns offset of the root of 'newNode' from the position where
+ * copyXMLNodeOrDocFragment() starts writing it. If 'newNode' is a document
+ * fragment, the root of its first child is meant.
+ */
+static XMLNodeOffset
+getNewXMLNodeRootOffset(XMLNodeHdr newNode)
+{
+	if (newNode->kind == XMLNODE_DOC_FRAGMENT)
+	{
+		XMLCompNodeHdr frag = (XMLCompNodeHdr) newNode;
+		char	   *refPtr = XNODE_FIRST_REF(frag);
 
-	copyXMLDecl(docNodeSrc, &resCursor);
-	docRootOff = (XMLNodeOffset *) resCursor;
-	*docRootOff = newRootOff;
-	SET_VARSIZE(result, resCursor - result + sizeof(XMLNodeOffset));
-	if (freeSrc)
+		newNode = (XMLNodeHdr) ((char *) frag - readXMLNodeOffset(&refPtr, XNODE_GET_REF_BWIDTH(frag), false));
+	}
+	return getXMLNodeSize(newNode, true) - getXMLNodeSize(newNode, false);
+}
+
+/*
+ * Returns size of the free space between header of 'node' and the next node
+ * in the storage. 'node' is child of 'parent' at position 'index'.
+ */
+static unsigned int
+getXMLNodeTrailingSpace(XMLCompNodeHdr parent, unsigned short index, XMLNodeHdr node)
+{
+	char	   *next = (char *) parent;
+
+	if (index < parent->children - 1)
 	{
-		pfree(doc);
+		char		bwidth = XNODE_GET_REF_BWIDTH(parent);
+		char	   *refPtr = XNODE_FIRST_REF(parent) + (index + 1) * bwidth;
+		XMLNodeHdr	sibling = (XMLNodeHdr) ((char *) parent - readXMLNodeOffset(&refPtr, bwidth, false));
+
+		next = (char *) sibling;
+		if (sibling->kind == XMLNODE_ELEMENT)
+		{
+			next = (char *) getFirstXMLNodeLeaf((XMLCompNodeHdr) sibling);
+		}
 	}
-	return (xmldoc) result;
+	return next - ((char *) node + getXMLNodeSize(node, false));
 }
 
 /*
@@ -1178,14 +1540,14 @@ adjustIgnoreList(XMLScan scan, XMLNodeOffset minimum, int shift)
  */
 static void
 propagateChange(XMLScanOneLevel levelScan, int *shift, int *hdrSizeIncr,
-				char *tree, char *resData, char **srcCursor, char **resCursor, XMLNodeOffset * newRootOff)
+				char *tree, char *resData, char *resEnd, char **srcCursor, char **resCursor,
+				XMLNodeOffset * newRootOff)
 {
 
 	while (levelScan->up)
 	{
 		unsigned short int currChild,
 					j,
-					gap,
 					bwidthSrc,
 					bwidthTarg;
 		XMLCompNodeHdr parentSrc,
@@ -1193,7 +1555,7 @@ propagateChange(XMLScanOneLevel levelScan, int *shift, int *hdrSizeIncr,
 		XMLNodeOffset refSrc;
 		unsigned int srcIncr;
 		XMLNodeOffset parentSrcOff;
-		int			refMax;
+		unsigned int gap;
 
 		/* Move one level higher */
 		levelScan = levelScan->up;
@@ -1205,6 +1567,7 @@ propagateChange(XMLScanOneLevel levelScan, int *shift, int *hdrSizeIncr,
 			/*
 			 * Copy nodes not affected by this change.
 			 */
+			checkXMLUpdateResultSpace(*resCursor, gap, resEnd);
 			memcpy(*resCursor, *srcCursor, gap);
 		}
 		*srcCursor = (char *) parentSrc;
@@ -1212,6 +1575,14 @@ propagateChange(XMLScanOneLevel levelScan, int *shift, int *hdrSizeIncr,
 		parentTarg = (XMLCompNodeHdr) (resData + parentSrcOff + *shift);
 		*resCursor = (char *) parentTarg;
 		*newRootOff = (char *) parentTarg - resData;
+
+		currChild = XMLSCAN_LEVEL_NODE_INDEX(levelScan);
+		bwidthSrc = XNODE_GET_REF_BWIDTH(parentSrc);
+		bwidthTarg = getPropagatedRefBWidth(levelScan, *shift, *hdrSizeIncr);
+		checkXMLUpdateResultSpace(*resCursor, getXMLNodeSize((XMLNodeHdr) parentSrc, false) +
+								  XNODE_REFS_SIZE(parentSrc->children, bwidthTarg) -
+								  XNODE_REFS_SIZE(parentSrc->children, bwidthSrc), resEnd);
+
 		memcpy(*resCursor, *srcCursor, srcIncr = sizeof(XMLCompNodeHdrData));
 		*srcCursor += srcIncr;
 		*resCursor += srcIncr;
@@ -1219,15 +1590,8 @@ propagateChange(XMLScanOneLevel levelScan, int *shift, int *hdrSizeIncr,
 		/*
 		 * Again, copy (and adjust) the references
 		 */
-		bwidthSrc = XNODE_GET_REF_BWIDTH(parentSrc);
 		refSrc = readXMLNodeOffset(srcCursor, bwidthSrc, false);
 
-		currChild = parentSrc->children - levelScan->siblingsLeft;
-		refMax = currChild > 0 ? refSrc + *shift : refSrc + *hdrSizeIncr;
-
-		bwidthTarg = getXMLNodeOffsetByteWidth(refMax);
-
-
 		for (j = 0; j < parentSrc->children; j++)
 		{
 			XMLNodeOffset refTarg;;
@@ -1254,6 +1618,8 @@ propagateChange(XMLScanOneLevel levelScan, int *shift, int *hdrSizeIncr,
 			}
 		}
 
+		copyChildKinds(parentSrc, 0, 0, NULL, 0, srcCursor, resCursor);
+
 		if (bwidthSrc != bwidthTarg)
 		{
 			XNODE_RESET_REF_BWIDTH(parentTarg);
@@ -1278,7 +1644,8 @@ propagateChange(XMLScanOneLevel levelScan, int *shift, int *hdrSizeIncr,
 		 * be responsible for increased node size. That's why only header size
 		 * is added to the shift.
 		 */
-		*hdrSizeIncr = parentTarg->children * bwidthTarg - parentSrc->children * bwidthSrc;
+		*hdrSizeIncr = XNODE_REFS_SIZE(parentTarg->children, bwidthTarg) -
+			XNODE_REFS_SIZE(parentSrc->children, bwidthSrc);
 		*shift += *hdrSizeIncr;
 
 		/*
@@ -1289,6 +1656,94 @@ propagateChange(XMLScanOneLevel levelScan, int *shift, int *hdrSizeIncr,
 	}
 }
 
+/*
+ * Returns byte width of the references of 'levelScan->parent' (ancestor of
+ * the node added / removed) once the change has been propagated to it.
+ * 'shift' and 'hdrSizeIncr' have the meaning they have in propagateChange()
+ * when it proceeds to that level.
+ */
+static char
+getPropagatedRefBWidth(XMLScanOneLevel levelScan, int shift, int hdrSizeIncr)
+{
+	XMLCompNodeHdr parent = levelScan->parent;
+	char	   *refPtr = XNODE_FIRST_REF(parent);
+	int			refMax = readXMLNodeOffset(&refPtr, XNODE_GET_REF_BWIDTH(parent), false);
+
+	/*
+	 * Reference to the first child is the greatest one. If the change took
+	 * place in the first child's subtree, only the child's header size
+	 * affects the reference.
+	 */
+	refMax += XMLSCAN_LEVEL_NODE_INDEX(levelScan) > 0 ? shift : hdrSizeIncr;
+	return getXMLNodeOffsetByteWidth(refMax);
+}
+
+/*
+ * Returns size of the document that xmlnodeAdd() / xmlnodeRemove() creates
+ * from 'doc'. 'levelScan', 'shift' and 'hdrSizeIncr' are what those
+ * functions will pass to propagateChange(). The computation is the same as
+ * that of propagateChange(), except that nothing is written. Thus the result
+ * can be allocated exactly before the document gets rewritten.
+ */
+static unsigned int
+getXMLUpdateResultSize(xmldoc doc, XMLScanOneLevel levelScan, int shift, int hdrSizeIncr)
+{
+	while (levelScan->up)
+	{
+		XMLCompNodeHdr parent;
+		char		bwidthTarg;
+
+		levelScan = levelScan->up;
+		parent = levelScan->parent;
+		bwidthTarg = getPropagatedRefBWidth(levelScan, shift, hdrSizeIncr);
+		hdrSizeIncr = XNODE_REFS_SIZE(parent->children, bwidthTarg) -
+			XNODE_REFS_SIZE(parent->children, XNODE_GET_REF_BWIDTH(parent));
+		shift += hdrSizeIncr;
+	}
+	return VARSIZE(doc) + shift;
+}
+
+/*
+ * The result of an update is allocated exactly, see
+ * getXMLUpdateResultSize(). Raise ERROR if 'size' bytes written at
+ * 'resCursor' would exceed the allocated chunk, which ends at 'resEnd', so
+ * that a wrong computation can't cause memory corruption.
+ */
+static void
+checkXMLUpdateResultSpace(char *resCursor, unsigned int size, char *resEnd)
+{
+	if (resCursor + size > resEnd)
+	{
+		elog(ERROR, "modified document exceeds its computed size");
+	}
+}
+
+/*
+ * Write the trailing part of document 'result', i.e. XML declaration of the
+ * source document ('docNodeSrc') and offset of the new root node, and set
+ * the size, which must be equal to 'resultSize' computed in advance.
+ */
+static void
+finishXMLUpdateResult(XMLCompNodeHdr docNodeSrc, char *result, char *resCursor,
+					  XMLNodeOffset newRootOff, unsigned int resultSize)
+{
+	XMLNodeOffset *docRootOff;
+
+	checkXMLUpdateResultSpace(resCursor, ((docNodeSrc->common.flags & XNODE_DOC_XMLDECL) ?
+										  sizeof(XMLDeclData) : 0) + sizeof(XMLNodeOffset),
+							  result + resultSize);
+	copyXMLDecl(docNodeSrc, &resCursor);
+	docRootOff = (XMLNodeOffset *) resCursor;
+	XNODE_SET_ROOT_OFFSET(docRootOff, newRootOff);
+	resCursor += sizeof(XMLNodeOffset);
+	if (resCursor - result != resultSize)
+	{
+		elog(ERROR, "wrong size of the modified document: %u bytes expected, %u written",
+			 resultSize, (unsigned int) (resCursor - result));
+	}
+	SET_VARSIZE(result, resultSize);
+}
+
 static void
 copyXMLDecl(XMLCompNodeHdr doc, char **resCursor)
 {
@@ -1305,16 +1760,39 @@ copyXMLDecl(XMLCompNodeHdr doc, char **resCursor)
 
 /*
  * Continue copying nodes from '*srcCursor' to '*resCursor' and stop right before their parent.
+ *
+ * Free space reserved behind the last sibling (see 'xnode.node_fillfactor') is copied too.
  */
 static void
 copySiblings(XMLCompNodeHdr parent, char **srcCursor, char **resCursor)
 {
-	char	   *refPtr = XNODE_LAST_REF(parent);
-	XMLNodeOffset lastSblOffRel = readXMLNodeOffset(&refPtr, XNODE_GET_REF_BWIDTH(parent), false);
-	XMLCompNodeHdr lastSbl = (XMLCompNodeHdr) ((char *) parent - lastSblOffRel);
-	unsigned int incr = (char *) lastSbl + getXMLNodeSize((XMLNodeHdr) lastSbl, false) - *srcCursor;
+	unsigned int incr = (char *) parent - *srcCursor;
 
 	memcpy(*resCursor, *srcCursor, incr);
 	*srcCursor += incr;
 	*resCursor += incr;
 }
+
+/*
+ * Copy kinds of the children of 'parentSrc' ('*srcCursor' must point to them), except for 'removed'
+ * ones starting at 'index'. Kinds of 'addedCount' new nodes are inserted at 'index'.
+ */
+static void
+copyChildKinds(XMLCompNodeHdr parentSrc, unsigned short index, unsigned short removed,
+			   char *added, unsigned short addedCount, char **srcCursor, char **resCursor)
+{
+	unsigned short rest = parentSrc->children - index - removed;
+
+	Assert(*srcCursor == XNODE_CHILD_KINDS(parentSrc));
+
+	memcpy(*resCursor, *srcCursor, index);
+	*resCursor += index;
+	if (addedCount > 0)
+	{
+		memcpy(*resCursor, added, addedCount);
+		*resCursor += addedCount;
+	}
+	memcpy(*resCursor, *srcCursor + index + removed, rest);
+	*resCursor += rest;
+	*srcCursor += parentSrc->children;
+}
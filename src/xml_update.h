@@ -11,7 +11,7 @@ extern Datum xmlnode_add(PG_FUNCTION_ARGS);
 extern Datum xmlnode_remove(PG_FUNCTION_ARGS);
 
 extern xmldoc updateXMLDocument(XMLScan xscan, xmldoc doc, XMLNodeAction action, XMLNodeHdr newNode,
-				  XMLAddMode addMode);
+				  XMLAddMode addMode, bool inPlace);
 extern xmldoc xmlnodeAdd(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, XMLNodeHdr newNode,
 		   XMLAddMode mode, bool freeSrc, XNodeListItem * ignore);
 extern xmldoc xmlnodeRemove(xmldoc doc, XMLScan xscan, XMLNodeHdr targNode, bool freeSrc);
@@ -4,8 +4,14 @@
 
 #include "postgres.h"
 #include "funcapi.h"
+#include "access/tupmacs.h"
 #include "catalog/pg_proc.h"
+#include "lib/stringinfo.h"
+#include "libpq/libpq-fs.h"
 #include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "storage/large_object.h"
+#include "utils/acl.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
@@ -77,9 +83,62 @@ initXNodeTypeInfo(Oid fnOid, int argNr, TypeInfo *ti)
 	get_typlenbyvalalign(ti->oid, &ti->elmlen, &ti->elmbyval, &ti->elmalign);
 }
 
+/*
+ * Type info of the function's argument, looked up only once per call site.
+ *
+ * Global variable can't be used to remember the values: all backends would
+ * have to invalidate it whenever the extension gets dropped / created.
+ */
+static TypeInfo *
+getXNodeTypeInfo(FunctionCallInfo fcinfo, int argNr)
+{
+	TypeInfo   *ti;
+
+	Assert(fcinfo->flinfo != NULL);
+	ti = (TypeInfo *) fcinfo->flinfo->fn_extra;
+	if (ti == NULL)
+	{
+		ti = (TypeInfo *) MemoryContextAlloc(fcinfo->flinfo->fn_mcxt, sizeof(TypeInfo));
+		initXNodeTypeInfo(fcinfo->flinfo->fn_oid, argNr, ti);
+		fcinfo->flinfo->fn_extra = ti;
+	}
+	return ti;
+}
+
+/*
+ * Allocate one-dimensional array of 'count' elements of type 'ti'.
+ * 'dataSize' is the total size of the elements, including alignment padding.
+ * The caller is responsible for copying the elements to ARR_DATA_PTR() of
+ * the result.
+ */
+static ArrayType *
+allocXNodeArray(TypeInfo *ti, int count, Size dataSize)
+{
+	Size		totalSize = ARR_OVERHEAD_NONULLS(1) + dataSize;
+	ArrayType  *result = (ArrayType *) palloc0(totalSize);
+
+	SET_VARSIZE(result, totalSize);
+	result->ndim = 1;
+	result->dataoffset = 0;
+	result->elemtype = ti->oid;
+	ARR_DIMS(result)[0] = count;
+	ARR_LBOUND(result)[0] = 1;
+	return result;
+}
+
 
 PG_MODULE_MAGIC;
 
+void		_PG_init(void);
+
+void
+_PG_init(void)
+{
+	initXMLDocCache();
+	initXMLStringPool();
+	initXMLUpdate();
+}
+
 PG_FUNCTION_INFO_V1(xmlnode_in);
 
 Datum
@@ -140,14 +199,18 @@ xmlnode_debug_print(PG_FUNCTION_ARGS)
 	PG_RETURN_TEXT_P(cstring_to_text(output->data));
 }
 
-PG_FUNCTION_INFO_V1(xmldoc_in);
-
-Datum
-xmldoc_in(PG_FUNCTION_ARGS)
+/*
+ * Parse NULL-terminated document text and return the binary value.
+ *
+ * 'srcEncoding' is the encoding the text had before it was converted to
+ * UTF-8, or -1 if the text was received from client. If 'stripWhitespace' is
+ * true, white space separating markup is not stored.
+ */
+static xmldoc
+parseXMLDocument(char *input, int srcEncoding, bool stripWhitespace)
 {
 	pg_enc		dbEnc;
 	XMLNodeParserStateData parserState;
-	char	   *input = PG_GETARG_CSTRING(0);
 
 	if (strlen(input) == 0)
 	{
@@ -159,9 +222,348 @@ xmldoc_in(PG_FUNCTION_ARGS)
 		elog(ERROR, "The current version of xmlnode requires both database encoding to be UTF-8.");
 	}
 	initXMLParserState(&parserState, input, false);
+	parserState.srcEncoding = srcEncoding;
+	parserState.stripWhitespace = stripWhitespace;
 	xmlnodeParseDoc(&parserState);
 	finalizeXMLParserState(&parserState);
-	PG_RETURN_POINTER(parserState.result);
+	return poolXMLDocStrings((xmldoc) parserState.result);
+}
+
+/*
+ * Find out encoding of document that starts at 'data' and has 'len' bytes
+ * (or more, if only the beginning of the document is available).
+ *
+ * http://www.w3.org/TR/xml/#sec-guessing: if there's no byte order mark and
+ * no encoding declaration, the document is UTF-8. Encodings that are not
+ * ASCII-compatible are not supported.
+ *
+ * '*bomLen' receives length of the byte order mark, so that caller can skip
+ * it.
+ */
+static int
+getXMLInputEncoding(const char *data, int len, int *bomLen)
+{
+	const char *c,
+			   *declEnd;
+	char		quotMark;
+	char		encName[NAMEDATALEN];
+	unsigned int i;
+	int			encoding;
+
+	*bomLen = 0;
+	if (len >= 3 && (unsigned char) data[0] == 0xEF && (unsigned char) data[1] == 0xBB &&
+		(unsigned char) data[2] == 0xBF)
+	{
+		*bomLen = 3;
+		return PG_UTF8;
+	}
+	if (len >= 2 && (((unsigned char) data[0] == 0xFE && (unsigned char) data[1] == 0xFF) ||
+					 ((unsigned char) data[0] == 0xFF && (unsigned char) data[1] == 0xFE)))
+	{
+		elog(ERROR, "UTF-16 encoded documents are not supported");
+	}
+
+	if (len < 5 || strncmp(data, "<?xml", 5) != 0)
+	{
+		return PG_UTF8;
+	}
+
+	/* Find the end of the declaration. */
+	declEnd = NULL;
+	for (c = data + 5; c < data + len - 1; c++)
+	{
+		if (*c == XNODE_CHAR_QUESTMARK && *(c + 1) == XNODE_CHAR_RARROW)
+		{
+			declEnd = c;
+			break;
+		}
+	}
+	if (declEnd == NULL)
+	{
+		/* Let the parser report the error. */
+		return PG_UTF8;
+	}
+
+	/*
+	 * The encoding declaration is only checked as far as needed to find the
+	 * name. Syntax of the declaration is checked by the parser.
+	 */
+	c = data + 5;
+	while (c < declEnd - 8 && strncmp(c, "encoding", 8) != 0)
+	{
+		c++;
+	}
+	if (c >= declEnd - 8)
+	{
+		return PG_UTF8;
+	}
+	c += 8;
+	while (c < declEnd && (XNODE_WHITESPACE(c) || *c == XNODE_CHAR_EQ))
+	{
+		c++;
+	}
+	if (c == declEnd || (*c != XNODE_CHAR_QUOTMARK && *c != XNODE_CHAR_APOSTR))
+	{
+		return PG_UTF8;
+	}
+	quotMark = *c++;
+	for (i = 0; c < declEnd && *c != quotMark; i++, c++)
+	{
+		if (i == NAMEDATALEN - 1)
+		{
+			elog(ERROR, "encoding name in XML declaration is too long");
+		}
+		encName[i] = *c;
+	}
+	encName[i] = '\0';
+
+	encoding = pg_char_to_encoding(encName);
+	if (encoding < 0)
+	{
+		elog(ERROR, "unsupported encoding '%s'", encName);
+	}
+	return encoding;
+}
+
+/*
+ * Convert the longest sequence of complete characters at the beginning of
+ * 'data' to UTF-8 and append it to 'buf'. Returns number of bytes consumed.
+ * The remaining bytes (an incomplete character) are expected to be passed
+ * again, along with the next part of the input.
+ */
+static int
+appendXMLInputText(StringInfo buf, const char *data, int len, int encoding)
+{
+	int			complete = 0;
+
+	while (complete < len)
+	{
+		int			charLen = pg_encoding_mblen(encoding, data + complete);
+
+		if (complete + charLen > len)
+		{
+			break;
+		}
+		complete += charLen;
+	}
+
+	if (complete > 0)
+	{
+		char	   *converted;
+
+		/*
+		 * No conversion is performed for SQL_ASCII, so the input must be
+		 * valid UTF-8 as it is.
+		 */
+		pg_verify_mbstr(encoding == PG_SQL_ASCII ? PG_UTF8 : encoding, data, complete, false);
+		converted = (char *) pg_do_encoding_conversion((unsigned char *) data, complete, encoding, PG_UTF8);
+		if (converted == data)
+		{
+			appendBinaryStringInfo(buf, data, complete);
+		}
+		else
+		{
+			appendStringInfoString(buf, converted);
+			pfree(converted);
+		}
+	}
+	return complete;
+}
+
+PG_FUNCTION_INFO_V1(xmldoc_in);
+
+Datum
+xmldoc_in(PG_FUNCTION_ARGS)
+{
+	char	   *input = PG_GETARG_CSTRING(0);
+
+	PG_RETURN_POINTER(parseXMLDocument(input, -1, false));
+}
+
+PG_FUNCTION_INFO_V1(xmldoc_parse);
+
+/*
+ * Parse document stored as binary string. The encoding is determined from
+ * the document itself, see getXMLInputEncoding().
+ */
+Datum
+xmldoc_parse(PG_FUNCTION_ARGS)
+{
+	bytea	   *input = PG_GETARG_BYTEA_PP(0);
+	char	   *data = VARDATA_ANY(input);
+	int			len = VARSIZE_ANY_EXHDR(input);
+	int			encoding,
+				bomLen,
+				used;
+	StringInfoData text;
+
+	encoding = getXMLInputEncoding(data, len, &bomLen);
+	data += bomLen;
+	len -= bomLen;
+
+	initStringInfo(&text);
+	used = appendXMLInputText(&text, data, len, encoding);
+	if (used < len)
+	{
+		/* Incomplete character at the end, let the check report it. */
+		pg_verify_mbstr(encoding, data + used, len - used, false);
+	}
+	PG_RETURN_POINTER(parseXMLDocument(text.data, encoding, false));
+}
+
+PG_FUNCTION_INFO_V1(xmldoc_parse_text);
+
+/*
+ * Parse document, optionally w/o the white space that only separates markup
+ * (e.g. indentation).
+ */
+Datum
+xmldoc_parse_text(PG_FUNCTION_ARGS)
+{
+	char	   *input = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	bool		stripWhitespace = PG_GETARG_BOOL(1);
+
+	PG_RETURN_POINTER(parseXMLDocument(input, -1, stripWhitespace));
+}
+
+PG_FUNCTION_INFO_V1(xmldoc_parse_lo);
+
+/*
+ * Parse document stored as large object. The object is read and converted
+ * to UTF-8 in chunks of XNODE_LO_CHUNK_SIZE bytes, so the original text is
+ * never held in memory as a whole.
+ *
+ * The parser needs the whole converted text though (it refers to the start
+ * tags of the open elements, etc.). The buffer for it is allocated according
+ * to the size of the object, so it doesn't have to be enlarged (and copied)
+ * while the object is being read, and an object that can't fit is rejected
+ * before anything is read.
+ */
+Datum
+xmldoc_parse_lo(PG_FUNCTION_ARGS)
+{
+	Oid			loOid = PG_GETARG_OID(0);
+	LargeObjectDesc *loDesc;
+	int64		loSize;
+	char	   *chunk;
+	int			pending = 0;
+	int			nread;
+	int			encoding = PG_UTF8;
+	bool		first = true;
+	StringInfoData text;
+
+	loDesc = inv_open(loOid, INV_READ, CurrentMemoryContext);
+	if (!lo_compat_privileges &&
+		pg_largeobject_aclcheck_snapshot(loOid, GetUserId(), ACL_SELECT, loDesc->snapshot) != ACLCHECK_OK)
+	{
+		elog(ERROR, "permission denied for large object %u", loOid);
+	}
+
+	loSize = inv_seek(loDesc, 0, SEEK_END);
+	if (loSize >= (int64) MaxAllocSize)
+	{
+		elog(ERROR, "large object %u is too big to be parsed", loOid);
+	}
+	inv_seek(loDesc, 0, SEEK_SET);
+
+	initStringInfo(&text);
+	enlargeStringInfo(&text, (int) loSize);
+	chunk = (char *) palloc(XNODE_LO_CHUNK_SIZE);
+
+	/*
+	 * 'pending' bytes at the beginning of 'chunk' are the incomplete
+	 * character left from the previous iteration.
+	 */
+	while ((nread = inv_read(loDesc, chunk + pending, XNODE_LO_CHUNK_SIZE - pending)) > 0)
+	{
+		int			avail = pending + nread;
+		int			start = 0;
+		int			used;
+
+		if (first)
+		{
+			encoding = getXMLInputEncoding(chunk, avail, &start);
+			first = false;
+		}
+		used = appendXMLInputText(&text, chunk + start, avail - start, encoding);
+		pending = avail - start - used;
+		memmove(chunk, chunk + start + used, pending);
+	}
+	inv_close(loDesc);
+
+	if (pending > 0)
+	{
+		pg_verify_mbstr(encoding, chunk, pending, false);
+	}
+	pfree(chunk);
+
+	if (text.len == 0)
+	{
+		elog(ERROR, "large object %u is empty", loOid);
+	}
+	PG_RETURN_POINTER(parseXMLDocument(text.data, encoding, false));
+}
+
+PG_FUNCTION_INFO_V1(xmldoc_chunk_add);
+
+/*
+ * Transition function of xml.doc_from_chunks() aggregate.
+ *
+ * The chunks are appended to a buffer that lives in the aggregate context,
+ * so the document text never has to be passed around as a single value,
+ * nor converted to cstring before parsing.
+ *
+ * The parser needs the whole text (it refers to the start tags of the open
+ * elements, etc.), so the buffer is only parsed by the final function. Thus
+ * the aggregate doesn't need less memory than xmldoc_in() does.
+ */
+Datum
+xmldoc_chunk_add(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggContext;
+	StringInfo	buf;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+	{
+		elog(ERROR, "xmldoc_chunk_add() called in non-aggregate context");
+	}
+
+	if (PG_ARGISNULL(0))
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(aggContext);
+
+		buf = makeStringInfo();
+		MemoryContextSwitchTo(oldContext);
+	}
+	else
+	{
+		buf = (StringInfo) PG_GETARG_POINTER(0);
+	}
+
+	if (!PG_ARGISNULL(1))
+	{
+		text	   *chunk = PG_GETARG_TEXT_PP(1);
+
+		appendBinaryStringInfo(buf, VARDATA_ANY(chunk), VARSIZE_ANY_EXHDR(chunk));
+	}
+	PG_RETURN_POINTER(buf);
+}
+
+PG_FUNCTION_INFO_V1(xmldoc_from_chunks_final);
+
+Datum
+xmldoc_from_chunks_final(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf;
+
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	buf = (StringInfo) PG_GETARG_POINTER(0);
+
+	/* The buffer is NULL-terminated, so the parser can read it directly. */
+	PG_RETURN_POINTER(parseXMLDocument(buf->data, -1, false));
 }
 
 PG_FUNCTION_INFO_V1(xmldoc_out);
@@ -176,6 +578,36 @@ xmldoc_out(PG_FUNCTION_ARGS)
 	PG_RETURN_CSTRING(dumpXMLNode(data, rootNdOff));
 }
 
+PG_FUNCTION_INFO_V1(xmldoc_indent);
+
+/*
+ * Text representation of the document, with each node on a separate line and
+ * indented according to its level.
+ */
+Datum
+xmldoc_indent(PG_FUNCTION_ARGS)
+{
+	xmldoc		doc = (xmldoc) PG_GETARG_VARLENA_P(0);
+	int32		indent = PG_GETARG_INT32(1);
+	XMLNodeHdr	root = XNODE_ROOT(doc);
+	StringInfoData output;
+
+	if (indent < 0)
+	{
+		elog(ERROR, "indentation must not be negative");
+	}
+	initStringInfo(&output);
+	if (root->flags & XNODE_DOC_XMLDECL)
+	{
+		char	   *declStr = dumpXMLDecl((XMLDecl) XNODE_ELEMENT_NAME((XMLCompNodeHdr) root));
+
+		appendStringInfoString(&output, declStr);
+		pfree(declStr);
+	}
+	xmlnodeDumpNodeIndented(VARDATA(doc), XNODE_ROOT_OFFSET(doc), &output, indent);
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(output.data, output.len));
+}
+
 
 PG_FUNCTION_INFO_V1(xmlnode_to_xmldoc);
 
@@ -199,11 +631,8 @@ xmlnode_to_xmldoc(PG_FUNCTION_ARGS)
 	 */
 	XMLNodeOffset rootOffsetNew = dataSizeOrig - sizeof(XMLNodeOffset);
 
-	/* Find that 'old last (root offset) value' ... */
-	XMLNodeOffset *rootOffPtrOrig = (XMLNodeOffset *) (nodeData + rootOffsetNew);
-
-	/* ... and read it */
-	XMLNodeOffset rootOffsetOrig = *rootOffPtrOrig;
+	/* Read that 'old last (root offset) value' */
+	XMLNodeOffset rootOffsetOrig = XNODE_ROOT_OFFSET(node);
 
 	/*
 	 * Compute 'relative reference' of the 'old root' that the document ('new
@@ -223,7 +652,7 @@ xmlnode_to_xmldoc(PG_FUNCTION_ARGS)
 		 */
 		char	   *refTargPtr;
 
-		sizeNew = sizeOrig + sizeof(XMLCompNodeHdrData) + bwidth;
+		sizeNew = sizeOrig + sizeof(XMLCompNodeHdrData) + XNODE_REFS_SIZE(1, bwidth);
 		dataSizeNew = sizeNew - VARHDRSZ;
 		document = (xmldoc) palloc(sizeNew);
 		docData = (char *) VARDATA(document);
@@ -233,10 +662,12 @@ xmlnode_to_xmldoc(PG_FUNCTION_ARGS)
 		rootDoc->common.flags = 0;
 		XNODE_SET_REF_BWIDTH(rootDoc, bwidth);
 		rootDoc->children = 1;
+		rootDoc->attributes = 0;
 		refTargPtr = (char *) rootDoc + sizeof(XMLCompNodeHdrData);
 		writeXMLNodeOffset(dist, &refTargPtr, bwidth, false);
+		*XNODE_CHILD_KINDS(rootDoc) = XMLNODE_ELEMENT;
 		rootOffPtrNew = (XMLNodeOffset *) (docData + dataSizeNew - sizeof(XMLNodeOffset));
-		*rootOffPtrNew = rootOffsetNew;
+		XNODE_SET_ROOT_OFFSET(rootOffPtrNew, rootOffsetNew);
 		SET_VARSIZE(document, sizeNew);
 	}
 	else if (rootNode->common.kind == XMLNODE_DOC_FRAGMENT)
@@ -284,7 +715,7 @@ xmldoc_to_xmlnode(PG_FUNCTION_ARGS)
 
 		node = (xmlnode) copyXMLNode(child, NULL, true, &rootOffNew);
 		rootOffPtrNew = XNODE_ROOT_OFFSET_PTR(node);
-		*rootOffPtrNew = rootOffNew;
+		XNODE_SET_ROOT_OFFSET(rootOffPtrNew, rootOffNew);
 	}
 	else
 	{
@@ -305,7 +736,7 @@ xmldoc_to_xmlnode(PG_FUNCTION_ARGS)
 		 * could have contained XMLDeclData.
 		 */
 		rootOffPtrNew = (XMLNodeOffset *) XNODE_ELEMENT_NAME(rootNew);
-		*rootOffPtrNew = rootOffNew;
+		XNODE_SET_ROOT_OFFSET(rootOffPtrNew, rootOffNew);
 	}
 
 	PG_RETURN_POINTER(node);
@@ -374,150 +805,332 @@ xmlnode_children(PG_FUNCTION_ARGS)
 	char	   *data = (char *) VARDATA(nodeRaw);
 	XMLNodeOffset rootNdOff = XNODE_ROOT_OFFSET(nodeRaw);
 	XMLNodeHdr	node = (XMLNodeHdr) (data + rootNdOff);
-	TypeInfo	nodeType;
+	TypeInfo   *nodeType = getXNodeTypeInfo(fcinfo, 0);
 	ArrayType  *result;
 
-	/*
-	 * Unfortunately the type info has to be retrieved every time again. If
-	 * the backend used global variable to remember the values, all backends
-	 * would have to invalidate the values whenever the extension gets dropped
-	 * / created.
-	 */
-
-	Assert(fcinfo->flinfo != NULL);
-	initXNodeTypeInfo(fcinfo->flinfo->fn_oid, 0, &nodeType);
-
 	if (node->kind == XMLNODE_DOC || node->kind == XMLNODE_ELEMENT || node->kind == XMLNODE_DOC_FRAGMENT)
 	{
 		XMLCompNodeHdr root = (XMLCompNodeHdr) node;
 		unsigned short children = root->children;
-		Datum	   *elems;
+		XMLNodeHdr *childNodes;
 		char	   *childOffPtr;
+		char	   *resCursor;
+		Size		dataSize = 0;
 		unsigned short i;
 
 		if (children == 0)
 		{
-			result = construct_empty_array(nodeType.oid);
+			result = construct_empty_array(nodeType->oid);
 			PG_RETURN_POINTER(result);
 		}
 
-		elems = (Datum *) palloc(children * sizeof(Datum));
-
+		/*
+		 * Compute the array size first so that each child can be copied
+		 * directly to its final location.
+		 */
+		childNodes = (XMLNodeHdr *) palloc(children * sizeof(XMLNodeHdr));
 		childOffPtr = XNODE_FIRST_REF(root);
 		for (i = 0; i < children; i++)
 		{
 			XMLNodeOffset childOff = readXMLNodeOffset(&childOffPtr, XNODE_GET_REF_BWIDTH(root), true);
 			XMLNodeHdr	childNode = (XMLNodeHdr) (data + rootNdOff - childOff);
-			char	   *childNodeCopy = copyXMLNode(childNode, NULL, true, NULL);
+			Size		childSize = VARHDRSZ + getXMLNodeSize(childNode, true) + sizeof(XMLNodeOffset);
 
-			elems[i] = PointerGetDatum(childNodeCopy);
+			childNodes[i] = childNode;
+			dataSize += att_align_nominal(childSize, nodeType->elmalign);
 		}
 
-		result = construct_array(elems, children, nodeType.oid, nodeType.elmlen, nodeType.elmbyval,
-								 nodeType.elmalign);
+		result = allocXNodeArray(nodeType, children, dataSize);
+		resCursor = ARR_DATA_PTR(result);
+		for (i = 0; i < children; i++)
+		{
+			copyXMLNode(childNodes[i], resCursor, true, NULL);
+			resCursor += att_align_nominal(VARSIZE(resCursor), nodeType->elmalign);
+		}
+		Assert(resCursor == ARR_DATA_PTR(result) + dataSize);
+		pfree(childNodes);
 		PG_RETURN_POINTER(result);
 	}
 	else
 	{
-		result = construct_empty_array(nodeType.oid);
+		result = construct_empty_array(nodeType->oid);
 		PG_RETURN_POINTER(result);
 	}
 }
 
-
-PG_FUNCTION_INFO_V1(xmlelement);
+PG_FUNCTION_INFO_V1(xmlnoderef_in);
 
 Datum
-xmlelement(PG_FUNCTION_ARGS)
+xmlnoderef_in(PG_FUNCTION_ARGS)
 {
-	Datum		nameText;
-	ArrayType  *attrs = NULL;
-	char	   *elName;
-	unsigned int nameLen,
-				resSizeMax;
-	unsigned int childSize = 0;
-	char	   *c,
-			   *result,
-			   *resData,
-			   *resCursor,
-			   *nameDst;
-	XMLCompNodeHdr element;
-	XMLNodeOffset *rootOffPtr;
-	bool		nameFirstChar = true;
-	char	  **attrNames = NULL;
-	char	  **attrValues = NULL;
-	char	   *attrValFlags = NULL;
-	XMLNodeHdr *attrNodes = NULL;
-	XMLNodeHdr	child = NULL;
-	char	  **newNds = NULL;
-	char	   *newNd = NULL;
-	unsigned int attrCount = 0;
-	unsigned int attrsSizeTotal = 0;
-	unsigned short childCount = 0;
+	char	   *input = PG_GETARG_CSTRING(0);
+	char	   *end;
+	unsigned long value;
 
-	if (PG_ARGISNULL(0))
+	errno = 0;
+	value = strtoul(input, &end, 10);
+	if (!isdigit((unsigned char) *input) || *end != '\0' || errno != 0 ||
+		(unsigned long) (XMLNodeRef) value != value)
 	{
-		elog(ERROR, "invalid element name");
+		elog(ERROR, "invalid node reference: \"%s\"", input);
 	}
-	nameText = PG_GETARG_DATUM(0);
-	elName = TextDatumGetCString(nameText);
+	PG_RETURN_XNODEREF((XMLNodeRef) value);
+}
 
-	nameLen = strlen(elName);
-	if (nameLen == 0)
-	{
-		elog(ERROR, "invalid element name");
-	}
+PG_FUNCTION_INFO_V1(xmlnoderef_out);
 
-	if (!PG_ARGISNULL(1))
-	{
-		int		   *dims;
-		Oid			elType,
-					arrType;
-		int16		arrLen,
-					elLen;
-		bool		elByVal,
-					elIsNull;
-		char		elAlign;
-		unsigned int i;
+Datum
+xmlnoderef_out(PG_FUNCTION_ARGS)
+{
+	XMLNodeRef	ref = PG_GETARG_XNODEREF(0);
+	char	   *result = (char *) palloc(11);
 
-		attrs = PG_GETARG_ARRAYTYPE_P(1);
-		if (ARR_NDIM(attrs) != 2)
-		{
-			elog(ERROR, "attributes must be passed in 2 dimensional array");
-		}
-		dims = ARR_DIMS(attrs);
-		if (dims[1] != 2)
-		{
-			elog(ERROR, "the second dimension of attribute array must be 2");
-		}
+	snprintf(result, 11, "%u", ref);
+	PG_RETURN_CSTRING(result);
+}
 
-		attrCount = dims[0];
-		Assert(attrCount > 0);
+/*
+ * Reference to the root of a node or document.
+ */
+PG_FUNCTION_INFO_V1(xmlnode_to_ref);
 
-		elType = attrs->elemtype;
-		arrType = get_array_type(elType);
-		arrLen = get_typlen(arrType);
-		Assert(arrType != InvalidOid);
-		get_typlenbyvalalign(elType, &elLen, &elByVal, &elAlign);
-		attrNames = (char **) palloc(attrCount * sizeof(char *));
-		attrValues = (char **) palloc(attrCount * sizeof(char *));
-		attrValFlags = (bool *) palloc(attrCount * sizeof(char));
+Datum
+xmlnode_to_ref(PG_FUNCTION_ARGS)
+{
+	xmlnode		tree = (xmlnode) detoastXMLDocCached(PG_GETARG_DATUM(0));
 
-		for (i = 1; i <= attrCount; i++)
-		{
-			int			subscrName[] = {i, 1};
-			int			subscrValue[] = {i, 2};
-			Datum		elDatum;
-			char	   *nameStr,
-					   *valueStr;
+	PG_RETURN_XNODEREF(XNODE_ROOT_OFFSET(tree));
+}
+
+/*
+ * Construct a real node out of a reference.
+ */
+PG_FUNCTION_INFO_V1(xmlnoderef_deref);
+
+Datum
+xmlnoderef_deref(PG_FUNCTION_ARGS)
+{
+	xmlnode		tree = (xmlnode) detoastXMLDocCached(PG_GETARG_DATUM(0));
+	XMLNodeHdr	target = getXMLNodeRefTarget(tree, PG_GETARG_XNODEREF(1), NULL, NULL);
+
+	if (target->kind == XMLNODE_DOC)
+	{
+		/* Only the root can be a document. */
+		PG_RETURN_DATUM(DirectFunctionCall1(xmldoc_to_xmlnode, PointerGetDatum(tree)));
+	}
+	PG_RETURN_POINTER(copyXMLNode(target, NULL, true, NULL));
+}
+
+/*
+ * Like xmlnode_children() but returns references. All of them point to the
+ * tree passed, so no subtree has to be copied.
+ */
+PG_FUNCTION_INFO_V1(xmlnoderef_children);
+
+Datum
+xmlnoderef_children(PG_FUNCTION_ARGS)
+{
+	xmlnode		tree = (xmlnode) detoastXMLDocCached(PG_GETARG_DATUM(0));
+	XMLNodeHdr	node = getXMLNodeRefTarget(tree, PG_GETARG_XNODEREF(1), NULL, NULL);
+	TypeInfo   *refType = getXNodeTypeInfo(fcinfo, 1);
+	ArrayType  *result;
+
+	if ((node->kind == XMLNODE_DOC || node->kind == XMLNODE_ELEMENT || node->kind == XMLNODE_DOC_FRAGMENT) &&
+		XNODE_HAS_CHILDREN((XMLCompNodeHdr) node))
+	{
+		XMLCompNodeHdr root = (XMLCompNodeHdr) node;
+		unsigned short children = root->children;
+		char		bwidth = XNODE_GET_REF_BWIDTH(root);
+		char	   *childOffPtr = XNODE_FIRST_REF(root);
+		Datum	   *refs = (Datum *) palloc(children * sizeof(Datum));
+		unsigned short i;
+
+		for (i = 0; i < children; i++)
+		{
+			XMLNodeHdr	childNode = (XMLNodeHdr) ((char *) node - readXMLNodeOffset(&childOffPtr, bwidth, true));
+
+			refs[i] = XNodeRefGetDatum((char *) childNode - VARDATA(tree));
+		}
+		result = construct_array(refs, children, refType->oid, refType->elmlen, refType->elmbyval,
+								 refType->elmalign);
+		pfree(refs);
+		PG_RETURN_POINTER(result);
+	}
+	else
+	{
+		result = construct_empty_array(refType->oid);
+		PG_RETURN_POINTER(result);
+	}
+}
+
+
+/*
+ * Add 'node' to the list of element children. Document fragment is
+ * flattened, i.e. its children are added instead of the fragment itself.
+ * '*size' is increased by the size of the subtree(s) that will have to be
+ * copied into the new element.
+ */
+static void
+addXMLElementChild(XMLNodeHdr node, XMLNodeHdr **children, unsigned int *count,
+				   unsigned int *countMax, unsigned int *size)
+{
+	if (node->kind == XMLNODE_DOC_FRAGMENT)
+	{
+		XMLCompNodeHdr fragment = (XMLCompNodeHdr) node;
+		char	   *refPtr = XNODE_FIRST_REF(fragment);
+		char		bwidth = XNODE_GET_REF_BWIDTH(fragment);
+		unsigned short i;
+
+		/*
+		 * It's assumed that invalid node kinds are never added to document
+		 * fragment. Otherwise we'd have to check the fragment (recursively)
+		 * not only here.
+		 */
+		for (i = 0; i < fragment->children; i++)
+		{
+			XMLNodeHdr	fragChild = (XMLNodeHdr) ((char *) fragment -
+									   readXMLNodeOffset(&refPtr, bwidth, true));
+
+			addXMLElementChild(fragChild, children, count, countMax, size);
+		}
+		return;
+	}
+
+	if (node->kind == XMLNODE_DOC || node->kind == XMLNODE_DTD || node->kind == XMLNODE_ATTRIBUTE)
+	{
+		elog(ERROR, "the nested node must not be %s", getXMLNodeKindStr(node->kind));
+	}
+
+	if (*count == XMLNODE_MAX_CHILDREN)
+	{
+		elog(ERROR, "Maximum number of %u children exceeded for node element.",
+			 XMLNODE_MAX_CHILDREN);
+	}
+
+	if (*count == *countMax)
+	{
+		*countMax *= 2;
+		*children = (XMLNodeHdr *) repalloc(*children, *countMax * sizeof(XMLNodeHdr));
+	}
+	(*children)[(*count)++] = node;
+	*size += getXMLNodeSize(node, true);
+}
+
+/*
+ * Construct element named 'elName', having attributes 'attrs' (2-dimensional
+ * array of name / value pairs or NULL) and child nodes 'children'.
+ *
+ * Sizes of all parts are known before the result gets allocated, so the
+ * element is built in a single chunk of memory of the exact size and each
+ * child subtree is copied just once.
+ */
+static xmlnode
+buildXMLElement(char *elName, ArrayType *attrs, XMLNodeHdr *children, unsigned int childCount,
+				unsigned int childSizeTotal)
+{
+	unsigned int nameLen,
+				resSize;
+	char	   *c,
+			   *result,
+			   *resData,
+			   *resCursor,
+			   *nameDst,
+			   *refPtr,
+			   *kinds;
+	XMLCompNodeHdr element;
+	XMLNodeOffset *rootOffPtr;
+	XMLNodeOffset childOffMax;
+	char		bwidth;
+	bool		nameFirstChar = true;
+	char	  **attrNames = NULL;
+	char	  **attrValues = NULL;
+	char	   *attrValFlags = NULL;
+	double	   *attrNumValues = NULL;
+	XMLNodeHdr *attrNodes = NULL;
+	unsigned int attrCount = 0;
+	unsigned int attrsSizeTotal = 0;
+	unsigned int i;
+
+	nameLen = strlen(elName);
+	if (nameLen == 0)
+	{
+		elog(ERROR, "invalid element name");
+	}
+
+	/* Make sure the element name is valid. */
+	c = elName;
+	while (*c != '\0')
+	{
+		if ((nameFirstChar && !XNODE_VALID_NAME_START(c)) || (!nameFirstChar && !XNODE_VALID_NAME_CHAR(c)))
+		{
+			elog(ERROR, "unrecognized character '%c' in element name", *c);
+		}
+		if (nameFirstChar)
+		{
+			nameFirstChar = false;
+		}
+		c += pg_utf_mblen((unsigned char *) c);
+	};
+
+	if (attrs != NULL)
+	{
+		int		   *dims;
+		int16		elLen;
+		bool		elByVal;
+		char		elAlign;
+		Datum	   *elDatums;
+		bool	   *elNulls;
+		int			elCount;
+
+		if (ARR_NDIM(attrs) != 2)
+		{
+			elog(ERROR, "attributes must be passed in 2 dimensional array");
+		}
+		dims = ARR_DIMS(attrs);
+		if (dims[1] != 2)
+		{
+			elog(ERROR, "the second dimension of attribute array must be 2");
+		}
+
+		attrCount = dims[0];
+		Assert(attrCount > 0);
+
+		/*
+		 * Attributes and the other children share the (16-bit) children
+		 * count of the element.
+		 */
+		if (attrCount + childCount > XMLNODE_MAX_CHILDREN)
+		{
+			elog(ERROR, "Maximum number of %u children exceeded for node element.",
+				 XMLNODE_MAX_CHILDREN);
+		}
+
+		/*
+		 * Extract all the array elements at once. They are stored in
+		 * row-major order, so each name is immediately followed by its value.
+		 */
+		get_typlenbyvalalign(ARR_ELEMTYPE(attrs), &elLen, &elByVal, &elAlign);
+		deconstruct_array(attrs, ARR_ELEMTYPE(attrs), elLen, elByVal, elAlign, &elDatums, &elNulls,
+						  &elCount);
+		Assert(elCount == attrCount * 2);
+
+		attrNames = (char **) palloc(attrCount * sizeof(char *));
+		attrValues = (char **) palloc(attrCount * sizeof(char *));
+		attrValFlags = (char *) palloc(attrCount * sizeof(char));
+		attrNumValues = (double *) palloc(attrCount * sizeof(double));
+
+		for (i = 0; i < attrCount; i++)
+		{
+			char	   *nameStr,
+					   *valueStr;
+			char	   *numEnd;
 			bool		valueHasRefs = false;
 
-			elDatum = array_ref(attrs, 2, subscrName, arrLen, elLen, elByVal, elAlign, &elIsNull);
-			if (elIsNull)
+			if (elNulls[2 * i])
 			{
 				elog(ERROR, "attribute name must not be null");
 			}
-			nameStr = text_to_cstring(DatumGetTextP(elDatum));
+			nameStr = TextDatumGetCString(elDatums[2 * i]);
 			if (strlen(nameStr) == 0)
 			{
 				elog(ERROR, "attribute name must be a string of non-zero length");
@@ -543,11 +1156,11 @@ xmlelement(PG_FUNCTION_ARGS)
 			}
 
 			/* Check uniqueness of the attribute name. */
-			if (i > 1)
+			if (i > 0)
 			{
 				unsigned short j;
 
-				for (j = 0; j < (i - 1); j++)
+				for (j = 0; j < i; j++)
 				{
 					if (strcmp(nameStr, attrNames[j]) == 0)
 					{
@@ -556,14 +1169,13 @@ xmlelement(PG_FUNCTION_ARGS)
 				}
 			}
 
-			elDatum = array_ref(attrs, 2, subscrValue, arrLen, elLen, elByVal, elAlign, &elIsNull);
-			if (elIsNull)
+			if (elNulls[2 * i + 1])
 			{
 				elog(ERROR, "attribute value must not be null");
 			}
-			valueStr = text_to_cstring(DatumGetTextP(elDatum));
+			valueStr = TextDatumGetCString(elDatums[2 * i + 1]);
 
-			attrValFlags[i - 1] = 0;
+			attrValFlags[i] = 0;
 
 			if (strlen(valueStr) > 0)
 			{
@@ -580,79 +1192,62 @@ xmlelement(PG_FUNCTION_ARGS)
 				 */
 				if (strchr(valueStr, XNODE_CHAR_QUOTMARK) != NULL)
 				{
-					attrValFlags[i - 1] |= XNODE_ATTR_APOSTROPHE;
+					attrValFlags[i] |= XNODE_ATTR_APOSTROPHE;
 				}
 				finalizeXMLParserState(&state);
 				pfree(valueStrOrig);
 			}
 
-			attrNames[i - 1] = nameStr;
-			attrValues[i - 1] = valueStr;
+			attrNames[i] = nameStr;
+			attrValues[i] = valueStr;
 			if (valueHasRefs)
 			{
-				attrValFlags[i - 1] |= XNODE_ATTR_CONTAINS_REF;
+				attrValFlags[i] |= XNODE_ATTR_CONTAINS_REF;
 			}
 			attrsSizeTotal += sizeof(XMLNodeHdrData) + strlen(nameStr) + strlen(valueStr) + 2;
+			if (xmlStringIsNumber(valueStr, &attrNumValues[i], &numEnd, true))
+			{
+				attrValFlags[i] |= XNODE_ATTR_NUMBER;
+				attrsSizeTotal += sizeof(double);
+			}
 		}
+		pfree(elDatums);
+		pfree(elNulls);
 	}
 
-	if (!PG_ARGISNULL(2))
+	/*
+	 * The greatest reference is that to the first attribute or, if there's
+	 * no attribute, to the root of the first child. Both are known before
+	 * anything gets copied, and so is the reference byte width.
+	 */
+	if (attrCount > 0)
 	{
-		Datum		childNodeDatum = PG_GETARG_DATUM(2);
-		xmlnode		childRaw = (xmlnode) PG_DETOAST_DATUM(childNodeDatum);
-
-		child = XNODE_ROOT(childRaw);
-		if (child->kind == XMLNODE_DOC_FRAGMENT)
-		{
-			childSize = getXMLNodeSize(child, true) - getXMLNodeSize(child, false);
-		}
-		else
-		{
-			childSize = getXMLNodeSize(child, true);
-		}
+		childOffMax = attrsSizeTotal + childSizeTotal;
 	}
-
-	/* Make sure the element name is valid. */
-	c = elName;
-	while (*c != '\0')
+	else if (childCount > 0)
 	{
-		if ((nameFirstChar && !XNODE_VALID_NAME_START(c)) || (!nameFirstChar && !XNODE_VALID_NAME_CHAR(c)))
-		{
-			elog(ERROR, "unrecognized character '%c' in element name", *c);
-		}
-		if (nameFirstChar)
-		{
-			nameFirstChar = false;
-		}
-		c += pg_utf_mblen((unsigned char *) c);
-	};
+		XMLNodeHdr	first = children[0];
+		char	   *firstStart = (char *) first;
 
-	if (child != NULL)
-	{
-		if (child->kind == XMLNODE_DOC_FRAGMENT)
-		{
-			childCount = ((XMLCompNodeHdr) child)->children;
-		}
-		else
+		if (first->kind == XMLNODE_ELEMENT)
 		{
-			childCount = 1;
+			firstStart = (char *) getFirstXMLNodeLeaf((XMLCompNodeHdr) first);
 		}
+		childOffMax = childSizeTotal - ((char *) first - firstStart);
+	}
+	else
+	{
+		childOffMax = 0;
 	}
+	bwidth = getXMLNodeOffsetByteWidth(childOffMax);
 
-	/*
-	 * It's hard to determine the byte width of references until the copying
-	 * has finished. Therefore we assume the worst case: 4 bytes per
-	 * reference.
-	 */
-	resSizeMax = VARHDRSZ + attrsSizeTotal + childSize + (attrCount + childCount) * 4 +
-		sizeof(XMLCompNodeHdrData) + nameLen + 1 + sizeof(XMLNodeOffset);
-	result = (char *) palloc(resSizeMax);
+	resSize = VARHDRSZ + attrsSizeTotal + childSizeTotal + sizeof(XMLCompNodeHdrData) +
+		XNODE_REFS_SIZE(attrCount + childCount, bwidth) + nameLen + 1 + sizeof(XMLNodeOffset);
+	result = (char *) palloc(resSize);
 	resCursor = resData = VARDATA(result);
 
 	if (attrCount > 0)
 	{							/* Copy attributes. */
-		unsigned short i;
-
 		Assert(attrNames != NULL && attrValues != NULL && attrValFlags != NULL);
 
 		attrNodes = (XMLNodeHdr *) palloc(attrCount * sizeof(XMLNodeHdr));
@@ -668,11 +1263,6 @@ xmlelement(PG_FUNCTION_ARGS)
 			attrNode->kind = XMLNODE_ATTRIBUTE;
 			attrNode->flags = attrValFlags[i];
 
-			if (xmlAttrValueIsNumber(value))
-			{
-				attrNode->flags |= XNODE_ATTR_NUMBER;
-			}
-
 			resCursor = XNODE_CONTENT(attrNode);
 			memcpy(resCursor, name, nameLen);
 			resCursor += nameLen;
@@ -683,117 +1273,480 @@ xmlelement(PG_FUNCTION_ARGS)
 			resCursor += valueLen;
 			*(resCursor++) = '\0';
 			pfree(value);
+
+			if (XNODE_ATTR_IS_NUMBER(attrNode))
+			{
+				memcpy(resCursor, &attrNumValues[i], sizeof(double));
+				resCursor += sizeof(double);
+			}
 		}
 		pfree(attrNames);
 		pfree(attrValues);
 		pfree(attrValFlags);
+		pfree(attrNumValues);
 	}
 
-	if (child != NULL)
+	/*
+	 * Copy the child subtrees and remember where their roots are. The
+	 * 'children' array is no longer needed afterwards, so its slots are
+	 * reused for the new locations.
+	 */
+	for (i = 0; i < childCount; i++)
 	{
-		XMLNodeKind k = child->kind;
+		XMLNodeHdr	child = children[i];
+		XMLNodeOffset childRoot;
 
-		/*
-		 * Check if the node to be inserted is of a valid kind. If the node is
-		 * document fragment, its assumed that invalid node kinds are never
-		 * added. Otherwise we'd have to check the node fragment (recursively)
-		 * not only here.
-		 */
-		if (k != XMLNODE_DOC_FRAGMENT)
-		{
-			if (k == XMLNODE_DOC || k == XMLNODE_DTD || k == XMLNODE_ATTRIBUTE)
-			{
-				elog(ERROR, "the nested node must not be %s", getXMLNodeKindStr(k));
-			}
-		}
-		copyXMLNodeOrDocFragment(child, childSize, &resCursor, &newNd, &newNds);
+		copyXMLNode(child, resCursor, false, &childRoot);
+		children[i] = (XMLNodeHdr) (resCursor + childRoot);
+		resCursor += getXMLNodeSize(child, true);
 	}
 
 	element = (XMLCompNodeHdr) resCursor;
 	element->common.kind = XMLNODE_ELEMENT;
-	element->common.flags = (child == NULL) ? XNODE_EMPTY : 0;
+	element->common.flags = (childCount == 0) ? XNODE_EMPTY : 0;
 	element->children = attrCount + childCount;
+	element->attributes = attrCount;
+	XNODE_SET_REF_BWIDTH(element, bwidth);
 
-	if (childCount > 0 || attrCount > 0)
+	/* The attribute references first... */
+	refPtr = XNODE_FIRST_REF(element);
+	kinds = XNODE_CHILD_KINDS(element);
+	for (i = 0; i < attrCount; i++)
 	{
-		XMLNodeOffset childOff,
-					childOffMax;
-		char		bwidth;
-		char	   *refPtr;
+		writeXMLNodeOffset((char *) element - (char *) attrNodes[i], &refPtr, bwidth, true);
+		*(kinds++) = XMLNODE_ATTRIBUTE;
+	}
+	if (attrNodes != NULL)
+	{
+		pfree(attrNodes);
+	}
 
-		/* Save relative offset(s) of the child node(s). */
+	/* ...followed by those of the other children. */
+	for (i = 0; i < childCount; i++)
+	{
+		writeXMLNodeOffset((char *) element - (char *) children[i], &refPtr, bwidth, true);
+		*(kinds++) = children[i]->kind;
+	}
 
-		if (attrCount > 0)
-		{
-			childOffMax = (char *) element - resData;
-		}
-		else if (childCount > 0)
+	/* And finally set the element name. */
+	nameDst = XNODE_ELEMENT_NAME(element);
+	memcpy(nameDst, elName, nameLen);
+	nameDst[nameLen] = '\0';
+	resCursor = nameDst + nameLen + 1;
+
+	Assert(resCursor - result + sizeof(XMLNodeOffset) == resSize);
+	SET_VARSIZE(result, resSize);
+	rootOffPtr = XNODE_ROOT_OFFSET_PTR(result);
+	XNODE_SET_ROOT_OFFSET(rootOffPtr, (char *) element - resData);
+	return (xmlnode) result;
+}
+
+PG_FUNCTION_INFO_V1(xmlelement);
+
+Datum
+xmlelement(PG_FUNCTION_ARGS)
+{
+	char	   *elName;
+	ArrayType  *attrs = NULL;
+	XMLNodeHdr *children;
+	unsigned int childCount = 0;
+	unsigned int childCountMax = 1;
+	unsigned int childSize = 0;
+
+	if (PG_ARGISNULL(0))
+	{
+		elog(ERROR, "invalid element name");
+	}
+	elName = TextDatumGetCString(PG_GETARG_DATUM(0));
+
+	if (!PG_ARGISNULL(1))
+	{
+		attrs = PG_GETARG_ARRAYTYPE_P(1);
+	}
+
+	children = (XMLNodeHdr *) palloc(childCountMax * sizeof(XMLNodeHdr));
+	if (!PG_ARGISNULL(2))
+	{
+		xmlnode		childRaw = (xmlnode) PG_DETOAST_DATUM(PG_GETARG_DATUM(2));
+
+		addXMLElementChild(XNODE_ROOT(childRaw), &children, &childCount, &childCountMax,
+						   &childSize);
+	}
+	PG_RETURN_POINTER(buildXMLElement(elName, attrs, children, childCount, childSize));
+}
+
+/*
+ * The same as xmlelement(), except that any number of child nodes can be
+ * passed. NULL array elements are ignored.
+ */
+PG_FUNCTION_INFO_V1(xmlelement_variadic);
+
+Datum
+xmlelement_variadic(PG_FUNCTION_ARGS)
+{
+	char	   *elName;
+	ArrayType  *attrs = NULL;
+	XMLNodeHdr *children;
+	unsigned int childCount = 0;
+	unsigned int childCountMax = 8;
+	unsigned int childSize = 0;
+
+	if (PG_ARGISNULL(0))
+	{
+		elog(ERROR, "invalid element name");
+	}
+	elName = TextDatumGetCString(PG_GETARG_DATUM(0));
+
+	if (!PG_ARGISNULL(1))
+	{
+		attrs = PG_GETARG_ARRAYTYPE_P(1);
+	}
+
+	children = (XMLNodeHdr *) palloc(childCountMax * sizeof(XMLNodeHdr));
+	if (!PG_ARGISNULL(2))
+	{
+		ArrayType  *nodes = PG_GETARG_ARRAYTYPE_P(2);
+		int16		elLen;
+		bool		elByVal;
+		char		elAlign;
+		Datum	   *elDatums;
+		bool	   *elNulls;
+		int			elCount,
+					i;
+
+		get_typlenbyvalalign(ARR_ELEMTYPE(nodes), &elLen, &elByVal, &elAlign);
+		deconstruct_array(nodes, ARR_ELEMTYPE(nodes), elLen, elByVal, elAlign, &elDatums, &elNulls,
+						  &elCount);
+
+		for (i = 0; i < elCount; i++)
 		{
-			if (child->kind == XMLNODE_DOC_FRAGMENT)
-			{
-				Assert(newNds != NULL);
-				childOffMax = (char *) element - newNds[0];
-			}
-			else
+			xmlnode		childRaw;
+
+			if (elNulls[i])
 			{
-				childOffMax = (char *) element - newNd;
+				continue;
 			}
+			childRaw = (xmlnode) PG_DETOAST_DATUM(elDatums[i]);
+			addXMLElementChild(XNODE_ROOT(childRaw), &children, &childCount, &childCountMax,
+							   &childSize);
 		}
-		else
+	}
+	PG_RETURN_POINTER(buildXMLElement(elName, attrs, children, childCount, childSize));
+}
+
+/*
+ * Allocate aggregate state in the current memory context.
+ */
+static XMLFragmentAggState
+createXMLFragmentAggState(unsigned int sizeMax, unsigned int countMax)
+{
+	XMLFragmentAggState state = (XMLFragmentAggState) palloc(sizeof(XMLFragmentAggStateData));
+
+	state->sizeMax = (sizeMax > XNODE_FRAG_AGG_INIT_SIZE) ? sizeMax : XNODE_FRAG_AGG_INIT_SIZE;
+	state->data = (char *) palloc(state->sizeMax);
+	state->size = 0;
+	state->countMax = (countMax > XNODE_FRAG_AGG_INIT_COUNT) ? countMax : XNODE_FRAG_AGG_INIT_COUNT;
+	state->roots = (XMLNodeOffset *) palloc(state->countMax * sizeof(XMLNodeOffset));
+	state->count = 0;
+	return state;
+}
+
+/*
+ * Make sure 'state' can accept 'size' more bytes of data and 'count' more
+ * children.
+ */
+static void
+ensureXMLFragmentAggSpace(XMLFragmentAggState state, unsigned int size, unsigned int count)
+{
+	if (state->count + count > XMLNODE_MAX_CHILDREN)
+	{
+		elog(ERROR, "Maximum number of %u children exceeded for node document fragment.",
+			 XMLNODE_MAX_CHILDREN);
+	}
+
+	if (state->size + size > state->sizeMax)
+	{
+		while (state->size + size > state->sizeMax)
+		{
+			state->sizeMax <<= 1;
+		}
+		state->data = (char *) repalloc(state->data, state->sizeMax);
+	}
+	if (state->count + count > state->countMax)
+	{
+		while (state->count + count > state->countMax)
 		{
-			childOffMax = 0;
+			state->countMax <<= 1;
 		}
-		bwidth = getXMLNodeOffsetByteWidth(childOffMax);
-		XNODE_SET_REF_BWIDTH(element, bwidth);
+		state->roots = (XMLNodeOffset *) repalloc(state->roots, state->countMax * sizeof(XMLNodeOffset));
+	}
+}
+
+/*
+ * Append subtree of 'node' to the aggregate state.
+ */
+static void
+addXMLFragmentChild(XMLFragmentAggState state, XMLNodeHdr node)
+{
+	unsigned int nodeSize;
+	XMLNodeOffset root;
 
-		refPtr = XNODE_FIRST_REF(element);
+	if (node->kind == XMLNODE_DOC || node->kind == XMLNODE_DTD || node->kind == XMLNODE_ATTRIBUTE)
+	{
+		elog(ERROR, "document fragment can't contain %s", getXMLNodeKindStr(node->kind));
+	}
 
-		if (attrCount > 0)
-		{
-			unsigned short i;
+	nodeSize = getXMLNodeSize(node, true);
+	ensureXMLFragmentAggSpace(state, nodeSize, 1);
+	copyXMLNode(node, state->data + state->size, false, &root);
+	state->roots[state->count++] = state->size + root;
+	state->size += nodeSize;
+}
 
-			/* The attribute references first... */
-			for (i = 0; i < attrCount; i++)
-			{
-				XMLNodeHdr	node = attrNodes[i];
+PG_FUNCTION_INFO_V1(xmlnode_fragment_add);
 
-				childOff = (char *) element - (char *) node;
-				writeXMLNodeOffset(childOff, &refPtr, bwidth, true);
-			}
-			pfree(attrNodes);
-		}
+/*
+ * Transition function of xml.fragment_agg(). Each node is copied exactly
+ * once, unlike when the fragment is constructed by repeated xml.add(). If
+ * the node is a document fragment, its children are added instead.
+ */
+Datum
+xmlnode_fragment_add(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggContext;
+	XMLFragmentAggState state;
+	xmlnode		nodeRaw;
+	XMLNodeHdr	node;
 
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+	{
+		elog(ERROR, "xmlnode_fragment_add() called in non-aggregate context");
+	}
 
-		if (childCount > 0)
+	if (PG_ARGISNULL(0))
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(aggContext);
+
+		state = createXMLFragmentAggState(0, 0);
+		MemoryContextSwitchTo(oldContext);
+	}
+	else
+	{
+		state = (XMLFragmentAggState) PG_GETARG_POINTER(0);
+	}
+
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_POINTER(state);
+	}
+
+	nodeRaw = (xmlnode) PG_GETARG_VARLENA_P(1);
+	node = XNODE_ROOT(nodeRaw);
+	if (node->kind == XMLNODE_DOC_FRAGMENT)
+	{
+		XMLCompNodeHdr fragment = (XMLCompNodeHdr) node;
+		char	   *childRef = XNODE_FIRST_REF(fragment);
+		char		bwidth = XNODE_GET_REF_BWIDTH(fragment);
+		unsigned short i;
+
+		for (i = 0; i < fragment->children; i++)
 		{
-			/* ...followed by those of the other children. */
-			if (child->kind == XMLNODE_DOC_FRAGMENT)
-			{
-				unsigned short i;
+			XMLNodeHdr	child = (XMLNodeHdr) ((char *) fragment - readXMLNodeOffset(&childRef, bwidth, true));
 
-				for (i = 0; i < childCount; i++)
-				{
-					childOff = (char *) element - newNds[i];
-					writeXMLNodeOffset(childOff, &refPtr, bwidth, true);
-				}
-				pfree(newNds);
-			}
-			else
-			{
-				childOff = (char *) element - newNd;
-				writeXMLNodeOffset(childOff, &refPtr, bwidth, true);
-			}
+			addXMLFragmentChild(state, child);
 		}
 	}
+	else
+	{
+		addXMLFragmentChild(state, node);
+	}
+	PG_RETURN_POINTER(state);
+}
 
-	/* And finally set the element name. */
-	nameDst = XNODE_ELEMENT_NAME(element);
-	memcpy(nameDst, elName, nameLen);
-	nameDst[nameLen] = '\0';
-	resCursor = nameDst + strlen(elName) + 1;
+PG_FUNCTION_INFO_V1(xmlnode_fragment_final);
+
+/*
+ * Construct the resulting node. If there's only one child, it's returned as
+ * it is. Otherwise the child subtrees are followed by document fragment
+ * header, with the references as narrow as the distance to the first child
+ * allows.
+ *
+ * The state is not modified, as the function may be called multiple times
+ * for the same state (window aggregate).
+ */
+Datum
+xmlnode_fragment_final(PG_FUNCTION_ARGS)
+{
+	XMLFragmentAggState state;
+	unsigned int resSize;
+	char	   *result,
+			   *resData,
+			   *refPtr,
+			   *kinds;
+	char		bwidth;
+	XMLCompNodeHdr fragment;
+	XMLNodeOffset *rootOffPtr;
+	unsigned int i;
+
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	state = (XMLFragmentAggState) PG_GETARG_POINTER(0);
+
+	if (state->count == 0)
+	{
+		PG_RETURN_NULL();
+	}
 
-	SET_VARSIZE(result, (char *) resCursor - result + sizeof(XMLNodeOffset));
+	if (state->count == 1)
+	{
+		resSize = VARHDRSZ + state->size + sizeof(XMLNodeOffset);
+		result = (char *) palloc(resSize);
+		memcpy(VARDATA(result), state->data, state->size);
+		SET_VARSIZE(result, resSize);
+		rootOffPtr = XNODE_ROOT_OFFSET_PTR(result);
+		XNODE_SET_ROOT_OFFSET(rootOffPtr, state->roots[0]);
+		PG_RETURN_POINTER(result);
+	}
+
+	/* The first child is the most distant one. */
+	bwidth = getXMLNodeOffsetByteWidth(state->size - state->roots[0]);
+	resSize = VARHDRSZ + state->size + sizeof(XMLCompNodeHdrData) +
+		XNODE_REFS_SIZE(state->count, bwidth) + sizeof(XMLNodeOffset);
+	result = (char *) palloc(resSize);
+	resData = VARDATA(result);
+	memcpy(resData, state->data, state->size);
+
+	fragment = (XMLCompNodeHdr) (resData + state->size);
+	fragment->common.kind = XMLNODE_DOC_FRAGMENT;
+	fragment->common.flags = 0;
+	XNODE_SET_REF_BWIDTH(fragment, bwidth);
+	fragment->children = state->count;
+	fragment->attributes = 0;
+
+	refPtr = XNODE_FIRST_REF(fragment);
+	kinds = XNODE_CHILD_KINDS(fragment);
+	for (i = 0; i < state->count; i++)
+	{
+		writeXMLNodeOffset(state->size - state->roots[i], &refPtr, bwidth, true);
+		kinds[i] = ((XMLNodeHdr) (resData + state->roots[i]))->kind;
+	}
+
+	SET_VARSIZE(result, resSize);
 	rootOffPtr = XNODE_ROOT_OFFSET_PTR(result);
-	*rootOffPtr = (char *) element - resData;
+	XNODE_SET_ROOT_OFFSET(rootOffPtr, state->size);
 	PG_RETURN_POINTER(result);
 }
+
+PG_FUNCTION_INFO_V1(xmlnode_fragment_combine);
+
+/*
+ * Append children of the second state to the first one.
+ *
+ * The child subtrees are copied as they are, because the references inside
+ * them are relative. Only the root offsets have to be shifted. Byte width
+ * of the fragment references is determined by the final function.
+ */
+Datum
+xmlnode_fragment_combine(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggContext;
+	XMLFragmentAggState state1,
+				state2;
+	unsigned int i;
+
+	if (!AggCheckCallContext(fcinfo, &aggContext))
+	{
+		elog(ERROR, "xmlnode_fragment_combine() called in non-aggregate context");
+	}
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+		{
+			PG_RETURN_NULL();
+		}
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+	state2 = (XMLFragmentAggState) PG_GETARG_POINTER(1);
+
+	if (PG_ARGISNULL(0))
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(aggContext);
+
+		state1 = createXMLFragmentAggState(state2->size, state2->count);
+		MemoryContextSwitchTo(oldContext);
+	}
+	else
+	{
+		state1 = (XMLFragmentAggState) PG_GETARG_POINTER(0);
+	}
+
+	ensureXMLFragmentAggSpace(state1, state2->size, state2->count);
+	memcpy(state1->data + state1->size, state2->data, state2->size);
+	for (i = 0; i < state2->count; i++)
+	{
+		state1->roots[state1->count++] = state1->size + state2->roots[i];
+	}
+	state1->size += state2->size;
+	PG_RETURN_POINTER(state1);
+}
+
+PG_FUNCTION_INFO_V1(xmlnode_fragment_serialize);
+
+/*
+ * The serialized state consists of number of children, offsets of their
+ * roots and the child subtrees.
+ */
+Datum
+xmlnode_fragment_serialize(PG_FUNCTION_ARGS)
+{
+	XMLFragmentAggState state = (XMLFragmentAggState) PG_GETARG_POINTER(0);
+	unsigned int rootsSize = state->count * sizeof(XMLNodeOffset);
+	unsigned int resSize = VARHDRSZ + sizeof(uint32) + rootsSize + state->size;
+	bytea	   *result = (bytea *) palloc(resSize);
+	char	   *resCursor = VARDATA(result);
+	uint32		count = state->count;
+
+	memcpy(resCursor, &count, sizeof(uint32));
+	resCursor += sizeof(uint32);
+	memcpy(resCursor, state->roots, rootsSize);
+	resCursor += rootsSize;
+	memcpy(resCursor, state->data, state->size);
+	SET_VARSIZE(result, resSize);
+	PG_RETURN_BYTEA_P(result);
+}
+
+PG_FUNCTION_INFO_V1(xmlnode_fragment_deserialize);
+
+Datum
+xmlnode_fragment_deserialize(PG_FUNCTION_ARGS)
+{
+	bytea	   *input = PG_GETARG_BYTEA_PP(0);
+	char	   *inCursor = VARDATA_ANY(input);
+	unsigned int inSize = VARSIZE_ANY_EXHDR(input);
+	uint32		count;
+	unsigned int rootsSize;
+	XMLFragmentAggState state;
+
+	if (inSize < sizeof(uint32))
+	{
+		elog(ERROR, "invalid serialized state of fragment aggregate");
+	}
+	memcpy(&count, inCursor, sizeof(uint32));
+	inCursor += sizeof(uint32);
+	rootsSize = count * sizeof(XMLNodeOffset);
+	if (count > XMLNODE_MAX_CHILDREN || inSize < sizeof(uint32) + rootsSize)
+	{
+		elog(ERROR, "invalid serialized state of fragment aggregate");
+	}
+
+	state = createXMLFragmentAggState(inSize - sizeof(uint32) - rootsSize, count);
+	memcpy(state->roots, inCursor, rootsSize);
+	inCursor += rootsSize;
+	state->count = count;
+	state->size = inSize - sizeof(uint32) - rootsSize;
+	memcpy(state->data, inCursor, state->size);
+	PG_RETURN_POINTER(state);
+}
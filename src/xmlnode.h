@@ -85,14 +85,25 @@ typedef XMLNodeHdrData *XMLNodeHdr;
  * XNODE_GET_REF_BWIDTH() / XNODE_SET_REF_BWIDTH() should be used to set the byte width. Direct access
  * to the storage is discouraged.
  *
- * The array of references is followed either by element name (XMLNODE_ELEMENT) or by document header
+ * The array of references is followed by array of child node kinds, one byte per child and in the same
+ * order as the references. Thus nodes of particular kind can be searched for (e.g. using memchr())
+ * without reading the references and dereferencing the children. XNODE_CHILD_KINDS() points to the
+ * array.
+ *
+ * The array of kinds is followed either by element name (XMLNODE_ELEMENT) or by document header
  * (XMLNODE_DOC).
+ *
+ * References to attributes form a separate block at the beginning of the array, 'attributes' says how
+ * long it is. Thus element content can be scanned without dereferencing the attributes and vice versa.
+ * For other node kinds than XMLNODE_ELEMENT 'attributes' is always zero.
  */
 typedef struct XMLCompNodeHdrData
 {
 	XMLNodeCommonData common;
 
+	/* Total number of references, attributes included. */
 	uint16		children;
+	uint16		attributes;
 }	XMLCompNodeHdrData;
 
 typedef XMLCompNodeHdrData *XMLCompNodeHdr;
@@ -119,6 +130,11 @@ typedef struct XMLDeclData *XMLDecl;
 #define XMLNODE_MAX_CHILDREN	0xFFFF
 
 #define XNODE_WHITESPACE(c) (*(c) == 0x9 || *(c) == 0xA || *(c) == 0xD || *(c) == 0x20)
+
+/* http://www.w3.org/TR/xml/#sec-white-space */
+#define XNODE_XML_SPACE				"xml:space"
+#define XNODE_XML_SPACE_PRESERVE	"preserve"
+#define XNODE_XML_SPACE_DEFAULT		"default"
 #define XNODE_VALID_NAME_START(c)	(*(c) == XNODE_CHAR_COLON || *(c) == XNODE_CHAR_UNDERSCORE || \
 		isXMLCharInInterval(c, nameStartCharIntervals, XNODE_NAME_START_CHAR_INTERVALS))
 #define XNODE_VALID_NAME_CHAR(c)	(XNODE_VALID_NAME_START(c) || *(c) == XNODE_CHAR_DASH ||\
@@ -134,17 +150,39 @@ extern char getXMLNodeOffsetByteWidth(XMLNodeOffset o);
 
 #define XNODE_FIRST_REF(cnd) ((char *) (cnd) + sizeof(XMLCompNodeHdrData))
 #define XNODE_LAST_REF(cnd) (XNODE_FIRST_REF(cnd) + ((cnd)->children - 1) * XNODE_GET_REF_BWIDTH(cnd))
+/* The first reference following the attribute block. */
+#define XNODE_FIRST_CONTENT_REF(cnd) (XNODE_FIRST_REF(cnd) + (cnd)->attributes * XNODE_GET_REF_BWIDTH(cnd))
+#define XNODE_CONTENT_CHILDREN(cnd) ((cnd)->children - (cnd)->attributes)
 
 /*
  * Only use this for simple nodes
  */
 #define XNODE_CONTENT(nd) ((char *) ((XMLNodeHdr) (nd) + 1))
 
+/*
+ * If the node has XNODE_STR_POOLED set, 'ptr' (pointing somewhere into the
+ * node) does not contain the string itself but distance to it, see
+ * xmlnode_pool.c. Otherwise 'ptr' is returned.
+ */
+#define XNODE_STRING(nd, ptr) \
+	((((XMLNodeHdr) (nd))->flags & XNODE_STR_POOLED) ? (ptr) - XNODE_READ_REF_4(ptr) : (ptr))
+#define XNODE_POOL_REF_SIZE		4
+
+/* Text of text node. */
+#define XNODE_TEXT(nd)		XNODE_STRING(nd, XNODE_CONTENT(nd))
+/* Attribute value, i.e. the string that follows the name. */
+#define XNODE_ATTR_VALUE(nd) \
+	XNODE_STRING(nd, XNODE_CONTENT(nd) + strlen(XNODE_CONTENT(nd)) + 1)
+
 /*
  * TODO Check if the multiplication needs to be performed in alternative
  * (more efficient) way. The same for XNODE_LAST_REF() above
  */
-#define XNODE_ELEMENT_NAME(el) (XNODE_FIRST_REF(el) + (el)->children * XNODE_GET_REF_BWIDTH(el))
+#define XNODE_CHILD_KINDS(cnd) (XNODE_FIRST_REF(cnd) + (cnd)->children * XNODE_GET_REF_BWIDTH(cnd))
+#define XNODE_ELEMENT_NAME(el) (XNODE_CHILD_KINDS(el) + (el)->children)
+
+/* Storage needed for references and kinds of 'children' nodes. */
+#define XNODE_REFS_SIZE(children, bwidth) ((children) * ((bwidth) + 1))
 
 #define XNODE_NEXT_REF(ptr, cnd) (ptr + XNODE_GET_REF_BWIDTH(cnd))
 #define XNODE_PREV_REF(ptr, cnd) (ptr - XNODE_GET_REF_BWIDTH(cnd))
@@ -165,23 +203,301 @@ typedef xmldoctype *xmldoc;
 
 extern Datum xmldoc_in(PG_FUNCTION_ARGS);
 extern Datum xmldoc_out(PG_FUNCTION_ARGS);
+extern Datum xmldoc_chunk_add(PG_FUNCTION_ARGS);
+extern Datum xmldoc_from_chunks_final(PG_FUNCTION_ARGS);
+extern Datum xmldoc_parse(PG_FUNCTION_ARGS);
+extern Datum xmldoc_parse_lo(PG_FUNCTION_ARGS);
+
+/* Cache of detoasted documents, see xmlnode_cache.c */
+extern int	xnodeDocCacheSize;
+
+/* Auxiliary structures that the cache can keep along with a document. */
+typedef enum XMLDocAuxKind
+{
+	XNODE_DOC_AUX_ID_INDEX = 0,
+	XNODE_DOC_AUX_PARENT_INDEX,
+	XNODE_DOC_AUX_KINDS
+} XMLDocAuxKind;
+
+extern void initXMLDocCache(void);
+extern xmldoc detoastXMLDocCached(Datum value);
+extern void **getXMLDocCacheAux(xmldoc doc, XMLDocAuxKind kind, MemoryContext *context);
+
+/* ID index, see xmlnode_id.c */
+typedef struct XMLIdIndexData *XMLIdIndex;
+
+/*
+ * Where the ID index is kept while XPath expression(s) are evaluated against
+ * a document that is not in the document cache. The index is allocated in
+ * 'context'.
+ */
+typedef struct XMLIdIndexSlotData
+{
+	XMLIdIndex	index;
+	MemoryContext context;
+}	XMLIdIndexSlotData;
+
+typedef struct XMLIdIndexSlotData *XMLIdIndexSlot;
+
+extern void initXMLIdIndexSlot(XMLIdIndexSlot slot);
+extern XMLIdIndex getXMLIdIndex(xmldoc doc, XMLIdIndexSlot slot);
+extern XMLNodeHdr lookupXMLIdIndex(XMLIdIndex index, xmldoc doc, char *value);
+
+/* Document update, see xml_update.c */
+extern int	xnodeNodeFillfactor;
+
+extern void initXMLUpdate(void);
+
+/* String pool, see xmlnode_pool.c */
+extern int	xnodeStringPoolThreshold;
+extern bool xnodeSplitLayout;
+
+extern void initXMLStringPool(void);
+extern xmldoc poolXMLDocStrings(xmldoc doc);
+extern xmldoc unpoolXMLDoc(xmldoc doc);
+
+/* Expanded documents, see xmlnode_expanded.c */
+#if PG_VERSION_NUM >= 90500
+#define XNODE_EXPANDED_DOC
+#endif
+
+/* Servers older than 9.4 only have on-disk external values. */
+#ifndef VARATT_IS_EXTERNAL_ONDISK
+#define VARATT_IS_EXTERNAL_ONDISK(PTR)	VARATT_IS_EXTERNAL(PTR)
+#endif
+
+extern xmldoc getXMLDocForUpdate(Datum value, bool *inPlace);
+extern MemoryContext getXMLDocUpdateContext(void);
+extern Datum getXMLDocUpdateResult(Datum value, bool inPlace, xmldoc doc, MemoryContext context);
+
+#ifdef XNODE_EXPANDED_DOC
+extern xmldoc getExpandedXMLDocData(Datum value);
+#endif
+
+/* How much of a large object xmldoc_parse_lo() reads at a time. */
+#define XNODE_LO_CHUNK_SIZE		65536
 
 extern Datum xmlnode_to_xmldoc(PG_FUNCTION_ARGS);
 extern Datum xmldoc_to_xmlnode(PG_FUNCTION_ARGS);
 
+/*
+ * Node reference ('noderef' type) is position of a node within a tree (node
+ * or document), i.e. offset of the node from VARDATA() of the tree. The tree
+ * is not part of the value: functions accepting a reference receive the tree
+ * as another argument, so any number of references can share a single copy
+ * of it. The position is checked against the tree each time, see
+ * getXMLNodeRefTarget().
+ */
+typedef XMLNodeOffset XMLNodeRef;
+
+#define PG_GETARG_XNODEREF(n)	((XMLNodeRef) PG_GETARG_UINT32(n))
+#define PG_RETURN_XNODEREF(x)	PG_RETURN_UINT32(x)
+#define XNodeRefGetDatum(x)		UInt32GetDatum(x)
+
+extern XMLNodeHdr getXMLNodeRefTarget(xmlnode tree, XMLNodeRef ref, XMLCompNodeHdr *parent,
+					unsigned short *position);
+
+extern Datum xmlnoderef_in(PG_FUNCTION_ARGS);
+extern Datum xmlnoderef_out(PG_FUNCTION_ARGS);
+extern Datum xmlnode_to_ref(PG_FUNCTION_ARGS);
+extern Datum xmlnoderef_deref(PG_FUNCTION_ARGS);
+extern Datum xmlnoderef_children(PG_FUNCTION_ARGS);
+extern Datum xmlnoderef_parent(PG_FUNCTION_ARGS);
+extern Datum xmlnoderef_next_sibling(PG_FUNCTION_ARGS);
+extern Datum xmlnoderef_first_child(PG_FUNCTION_ARGS);
+extern Datum xmlnoderef_descendants(PG_FUNCTION_ARGS);
 
-/* Get a pointer to root node offset from varlena (xmlnode, xmldoc) value. */
+/*
+ * Comparison and hashing (the same functions serve both 'node' and 'doc').
+ */
+extern Datum xmlnode_cmp(PG_FUNCTION_ARGS);
+extern Datum xmlnode_eq(PG_FUNCTION_ARGS);
+extern Datum xmlnode_ne(PG_FUNCTION_ARGS);
+extern Datum xmlnode_lt(PG_FUNCTION_ARGS);
+extern Datum xmlnode_le(PG_FUNCTION_ARGS);
+extern Datum xmlnode_gt(PG_FUNCTION_ARGS);
+extern Datum xmlnode_ge(PG_FUNCTION_ARGS);
+extern Datum xmlnode_hash(PG_FUNCTION_ARGS);
+extern Datum xmlnode_hash64(PG_FUNCTION_ARGS);
+
+
+/*
+ * Version of the binary format. It's stored in the highest bits of the root
+ * node offset (varlena can't exceed 1 GB, so the offset never uses them),
+ * so that values stored by older versions of the extension, which had these
+ * bits zero, are recognized and rejected. Increment it whenever the format
+ * changes incompatibly.
+ */
+#define XNODE_FORMAT_VERSION		1
+#define XNODE_FORMAT_SHIFT			30
+#define XNODE_FORMAT_MASK			(0x3U << XNODE_FORMAT_SHIFT)
+
+/*
+ * Get a pointer to root node offset from varlena (xmlnode, xmldoc) value.
+ * Only XNODE_ROOT_OFFSET() and XNODE_SET_ROOT_OFFSET() should access the
+ * value it points to.
+ */
 #define XNODE_ROOT_OFFSET_PTR(raw)	((XMLNodeOffset *) ((char *) raw + VARSIZE(raw) - sizeof(XMLNodeOffset)))
+
+/* Store root offset, along with the format version. */
+#define XNODE_SET_ROOT_OFFSET(ptr, off) \
+	(*(ptr) = (off) | ((XMLNodeOffset) XNODE_FORMAT_VERSION << XNODE_FORMAT_SHIFT))
+
+static inline XMLNodeOffset
+getXMLRootOffset(XMLNodeOffset *ptr)
+{
+	XMLNodeOffset value = *ptr;
+
+	if ((value >> XNODE_FORMAT_SHIFT) != XNODE_FORMAT_VERSION)
+	{
+		elog(ERROR, "the value is stored in binary format %u, but %u is expected",
+			 value >> XNODE_FORMAT_SHIFT, XNODE_FORMAT_VERSION);
+	}
+	return value & ~XNODE_FORMAT_MASK;
+}
+
 /* ... and the root offset itself */
-#define XNODE_ROOT_OFFSET(raw) (*XNODE_ROOT_OFFSET_PTR(raw))
+#define XNODE_ROOT_OFFSET(raw) getXMLRootOffset(XNODE_ROOT_OFFSET_PTR(raw))
 
 /*
  * Get root node from varlena (xmlnode, xmldoc) value
  */
 #define XNODE_ROOT(raw) ((XMLNodeHdr) ((char *) VARDATA(raw) + XNODE_ROOT_OFFSET(raw)))
 
-extern XMLNodeOffset readXMLNodeOffset(char **input, unsigned char bytes, bool step);
-extern void writeXMLNodeOffset(XMLNodeOffset ref, char **output, unsigned char bytes, bool step);
+/*
+ * Decoders of references for each byte width. The byte order is little-endian
+ * regardless the platform, so compilers can turn each of these into a single
+ * (unaligned) load on little-endian machines.
+ */
+#define XNODE_READ_REF_1(p)	((XMLNodeOffset) ((unsigned char *) (p))[0])
+#define XNODE_READ_REF_2(p)	(XNODE_READ_REF_1(p) | ((XMLNodeOffset) ((unsigned char *) (p))[1] << 8))
+#define XNODE_READ_REF_3(p)	(XNODE_READ_REF_2(p) | ((XMLNodeOffset) ((unsigned char *) (p))[2] << 16))
+#define XNODE_READ_REF_4(p)	(XNODE_READ_REF_3(p) | ((XMLNodeOffset) ((unsigned char *) (p))[3] << 24))
+
+/*
+ * Return node offset value from '*input' char array where value takes 'bytes'
+ * bytes. If 'step' is true then the '*input' value is incremented so that
+ * the next value can be retrieved.
+ *
+ * The function is inlined, so if the byte width is constant within a loop
+ * (it's always the same for all references of a node), the compiler can
+ * resolve the switch outside the loop.
+ */
+static inline XMLNodeOffset
+readXMLNodeOffset(char **input, unsigned char bytes, bool step)
+{
+	char	   *inp = *input;
+	XMLNodeOffset result;
+
+	switch (bytes)
+	{
+		case 1:
+			result = XNODE_READ_REF_1(inp);
+			break;
+		case 2:
+			result = XNODE_READ_REF_2(inp);
+			break;
+		case 3:
+			result = XNODE_READ_REF_3(inp);
+			break;
+		default:
+			Assert(bytes == 4);
+			result = XNODE_READ_REF_4(inp);
+			break;
+	}
+	if (step)
+	{
+		*input = inp + bytes;
+	}
+	return result;
+}
+
+/*
+ * Execute 'body' for each of 'count' references stored at 'refPtr', with the
+ * reference stored in 'ref' and its index in 'i'.
+ *
+ * Unlike a loop calling readXMLNodeOffset(), the byte width is resolved once
+ * per node and the loop is expanded for each width, so that decoding of a
+ * reference is a fixed load. (Compilers don't move the switch out of the
+ * loop at the usual optimization levels.) Use it for loops over all children
+ * of a node.
+ *
+ * 'body' must be a block and it must not contain commas outside parentheses.
+ * 'break' and 'continue' apply to the loop.
+ */
+#define XNODE_FOREACH_REF(refPtr, bwidth, count, i, ref, body) \
+	do \
+	{ \
+		switch (bwidth) \
+		{ \
+			case 1: \
+				for ((i) = 0; (i) < (count); (i)++) \
+				{ \
+					(ref) = XNODE_READ_REF_1((refPtr) + (i)); \
+					body \
+				} \
+				break; \
+			case 2: \
+				for ((i) = 0; (i) < (count); (i)++) \
+				{ \
+					(ref) = XNODE_READ_REF_2((refPtr) + 2 * (i)); \
+					body \
+				} \
+				break; \
+			case 3: \
+				for ((i) = 0; (i) < (count); (i)++) \
+				{ \
+					(ref) = XNODE_READ_REF_3((refPtr) + 3 * (i)); \
+					body \
+				} \
+				break; \
+			default: \
+				Assert((bwidth) == 4); \
+				for ((i) = 0; (i) < (count); (i)++) \
+				{ \
+					(ref) = XNODE_READ_REF_4((refPtr) + 4 * (i)); \
+					body \
+				} \
+				break; \
+		} \
+	} while (0)
+
+/*
+ * Write node offset into a character array. Little-endian byte ordering is
+ * used, regardless the actual platform endianness.
+ *
+ * ref - the value to be written.
+ * outPtr - where pointer to the current position in the output stream is stored.
+ * bytes - how many bytes the value takes. This could be computed for each 'ref' value again,
+ * however all references within a particular node must have the same 'byte width'.
+ * Thus we need to determine this value outside.
+ * step - whether '*outPtr' should be moved so that it's ready for the next write.
+ */
+static inline void
+writeXMLNodeOffset(XMLNodeOffset ref, char **outPtr, unsigned char bytes, bool step)
+{
+	unsigned char *out = (unsigned char *) *outPtr;
+
+	switch (bytes)
+	{
+		case 4:
+			out[3] = (ref >> 24) & 0xFF;
+			/* fall through */
+		case 3:
+			out[2] = (ref >> 16) & 0xFF;
+			/* fall through */
+		case 2:
+			out[1] = (ref >> 8) & 0xFF;
+			/* fall through */
+		default:
+			out[0] = ref & 0xFF;
+			break;
+	}
+	if (step)
+	{
+		*outPtr += bytes;
+	}
+}
 
 #define XNODE_CONTAINER_CHUNK	16
 
@@ -249,6 +565,14 @@ extern bool isXMLCharInInterval(char *c, UTF8Interval * intervals, unsigned shor
  */
 #define XNODE_TEXT_SPEC_CHARS		(1 << 7)
 
+/*
+ * Value of attribute or text node is stored in the document's string pool.
+ * Only used in 'xmldoc' values.
+ */
+#define XNODE_STR_POOLED			(1 << 6)
+/* Set for compound node whose subtree contains any XNODE_STR_POOLED node. */
+#define XNODE_HAS_POOLED			(1 << 5)
+
 /* Bits 0 and 1 indicate maximum byte width of the distance between parent and child */
 #define XNODE_REF_BWIDTH				0x03
 #define XNODE_EMPTY						(1 << 2)
@@ -262,11 +586,43 @@ extern bool isXMLCharInInterval(char *c, UTF8Interval * intervals, unsigned shor
  * number
  */
 #define XNODE_ATTR_NUMBER				(1 << 2)
+/* Set if the DTD declares the attribute to be of type ID. */
+#define XNODE_ATTR_ID					(1 << 3)
 
 #define XNODE_PI_HAS_VALUE			(1 << 0)
 
 #define XNODE_ATTR_IS_NUMBER(node)			(((node)->flags & XNODE_ATTR_NUMBER) != 0)
 
+/* Set if the text node content represents a number. */
+#define XNODE_TEXT_NUMBER				(1 << 2)
+
+/*
+ * Binary value (double) of numeric attribute or text node immediately
+ * follows the string (or the reference to the string pool), so comparisons
+ * with numbers don't have to parse the string again.
+ */
+#define XNODE_IS_NUMBER(node)	(((node)->kind == XMLNODE_ATTRIBUTE && XNODE_ATTR_IS_NUMBER(node)) || \
+		((node)->kind == XMLNODE_TEXT && ((node)->flags & XNODE_TEXT_NUMBER)))
+#define XNODE_NUM_VALUE_SIZE(node)	(XNODE_IS_NUMBER(node) ? sizeof(double) : 0)
+
+static inline double
+getXMLNodeNumValue(XMLNodeHdr node)
+{
+	char	   *c = XNODE_CONTENT(node);
+	double		result;
+
+	Assert(XNODE_IS_NUMBER(node));
+	if (node->kind == XMLNODE_ATTRIBUTE)
+	{
+		c += strlen(c) + 1;
+	}
+	c += (node->flags & XNODE_STR_POOLED) ? XNODE_POOL_REF_SIZE : strlen(c) + 1;
+
+	/* The value is not aligned. */
+	memcpy(&result, c, sizeof(double));
+	return result;
+}
+
 /*
  * Macros to read / write byte width of the maximum child's offset.
  * The value we store is 0-based, i.e. 0 in the 'flags' filed means 1 byte per reference.
@@ -303,5 +659,34 @@ typedef enum XMLNodeAction
  */
 extern Datum xmlnode_children(PG_FUNCTION_ARGS);
 extern Datum xmlelement(PG_FUNCTION_ARGS);
+extern Datum xmlelement_variadic(PG_FUNCTION_ARGS);
+
+/*
+ * Transition state of xml.fragment_agg(). The child subtrees are stored one
+ * after another, each in the usual 'child first' order. Document fragment
+ * header is only added by the final function.
+ */
+typedef struct XMLFragmentAggStateData
+{
+	char	   *data;
+	unsigned int size,
+				sizeMax;
+
+	/* Offset of each child's root node, relative to 'data'. */
+	XMLNodeOffset *roots;
+	unsigned int count,
+				countMax;
+}	XMLFragmentAggStateData;
+
+typedef struct XMLFragmentAggStateData *XMLFragmentAggState;
+
+#define XNODE_FRAG_AGG_INIT_SIZE	1024
+#define XNODE_FRAG_AGG_INIT_COUNT	16
+
+extern Datum xmlnode_fragment_add(PG_FUNCTION_ARGS);
+extern Datum xmlnode_fragment_final(PG_FUNCTION_ARGS);
+extern Datum xmlnode_fragment_combine(PG_FUNCTION_ARGS);
+extern Datum xmlnode_fragment_serialize(PG_FUNCTION_ARGS);
+extern Datum xmlnode_fragment_deserialize(PG_FUNCTION_ARGS);
 
 #endif   /* XMLNODE_H */
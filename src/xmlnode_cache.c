@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2012, Antonin Houska
+ */
+
+/*
+ * Backend-local cache of detoasted documents.
+ *
+ * If a query evaluates multiple functions on the same TOASTed document, each
+ * of them would fetch and decompress the value again. Instead, the detoasted
+ * copy is kept in the cache, keyed by the TOAST pointer, and the least
+ * recently used entries are evicted when the total size exceeds
+ * 'xnode.doc_cache_size'.
+ *
+ * TOAST values are never updated in place, but the value id can be reused
+ * once the value has been deleted and vacuumed. Therefore the whole cache is
+ * discarded at the end of each transaction.
+ *
+ * The cached documents are read-only and callers must not free them. A
+ * caller may use the document until CurrentMemoryContext (at the time of the
+ * call) is reset or deleted, e.g. until the executor proceeds to the next
+ * tuple. Until then the entry is pinned and can't be evicted. Functions that
+ * keep the document across calls (i.e. set returning functions) should call
+ * detoastXMLDocCached() in the multi-call memory context. If all entries are
+ * pinned and there's no room for a new one, the document is not cached.
+ *
+ * Auxiliary structures derived from a document (e.g. ID index) can be stored
+ * in the cache entry too, see getXMLDocCacheAux().
+ */
+
+#include "postgres.h"
+#include "access/tuptoaster.h"
+#include "access/xact.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "xmlnode.h"
+
+typedef struct XMLDocCacheKey
+{
+	Oid			toastrelid;
+	Oid			valueid;
+	int32		rawsize;
+	int32		extsize;
+} XMLDocCacheKey;
+
+typedef struct XMLDocCacheEntryData
+{
+	XMLDocCacheKey key;			/* must be the first */
+	xmldoc		doc;
+	Size		size;
+
+	/*
+	 * Auxiliary structures, allocated in 'auxContext'. The context is only
+	 * created when the first structure is added.
+	 */
+	void	   *aux[XNODE_DOC_AUX_KINDS];
+	MemoryContext auxContext;
+
+	/*
+	 * Number of memory contexts the document has been returned in and that
+	 * haven't been reset yet, see pinXMLDocCacheEntry(). 'pinContext' is the
+	 * context of the last pin, if it's still there.
+	 */
+	unsigned int pins;
+	MemoryContext pinContext;
+
+	/* LRU list, the most recently used entry is the head. */
+	struct XMLDocCacheEntryData *prev;
+	struct XMLDocCacheEntryData *next;
+} XMLDocCacheEntryData;
+
+typedef XMLDocCacheEntryData *XMLDocCacheEntry;
+
+#if PG_VERSION_NUM >= 90500
+typedef struct XMLDocCachePinData
+{
+	MemoryContextCallback callback;
+	XMLDocCacheEntry entry;
+	MemoryContext context;
+
+	/* 'docCacheGeneration' at the time the pin was created. */
+	uint32		generation;
+} XMLDocCachePinData;
+
+typedef XMLDocCachePinData *XMLDocCachePin;
+#endif
+
+/* In kilobytes. */
+int			xnodeDocCacheSize = 16384;
+
+static MemoryContext docCacheContext = NULL;
+static HTAB *docCache = NULL;
+static XMLDocCacheEntry docCacheHead = NULL;
+static XMLDocCacheEntry docCacheTail = NULL;
+static Size docCacheUsed = 0;
+
+/*
+ * Incremented each time the cache is discarded, so that pins created before
+ * are ignored when their memory context gets reset.
+ */
+static uint32 docCacheGeneration = 0;
+
+static void createXMLDocCache(void);
+static void pinXMLDocCacheEntry(XMLDocCacheEntry entry);
+
+#if PG_VERSION_NUM >= 90500
+static void unpinXMLDocCacheEntry(void *arg);
+#endif
+static void removeXMLDocCacheEntry(XMLDocCacheEntry entry);
+static void unlinkXMLDocCacheEntry(XMLDocCacheEntry entry);
+static XMLDocCacheEntry findXMLDocCacheEntry(xmldoc doc);
+static void xmlDocCacheXactCallback(XactEvent event, void *arg);
+
+void
+initXMLDocCache(void)
+{
+	DefineCustomIntVariable("xnode.doc_cache_size",
+							"Maximum memory used to cache detoasted documents.",
+							"Zero disables the cache.",
+							&xnodeDocCacheSize,
+							16384,
+							0,
+							MAX_KILOBYTES,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+	RegisterXactCallback(xmlDocCacheXactCallback, NULL);
+}
+
+/*
+ * Returns detoasted document. If 'value' is stored out of line, the cached
+ * copy is returned if there's one. Otherwise the document is detoasted in the
+ * usual way.
+ */
+xmldoc
+detoastXMLDocCached(Datum value)
+{
+	struct varlena *raw = (struct varlena *) DatumGetPointer(value);
+	struct varatt_external toastPointer;
+	XMLDocCacheKey key;
+	XMLDocCacheEntry entry,
+				victim;
+	MemoryContext oldcontext;
+	xmldoc		doc;
+	Size		sizeMax = (Size) xnodeDocCacheSize * 1024;
+	Size		size;
+	bool		found;
+
+#ifdef XNODE_EXPANDED_DOC
+	if (VARATT_IS_EXTERNAL_EXPANDED(raw))
+	{
+		return getExpandedXMLDocData(value);
+	}
+#endif
+	if (!VARATT_IS_EXTERNAL_ONDISK(raw) || sizeMax == 0)
+	{
+		return (xmldoc) PG_DETOAST_DATUM(value);
+	}
+
+	VARATT_EXTERNAL_GET_POINTER(toastPointer, raw);
+
+	/* 'va_rawsize' includes the varlena header. */
+	size = (Size) toastPointer.va_rawsize + sizeof(XMLDocCacheEntryData);
+	if (size > sizeMax)
+	{
+		return (xmldoc) PG_DETOAST_DATUM(value);
+	}
+
+	MemSet(&key, 0, sizeof(XMLDocCacheKey));
+	key.toastrelid = toastPointer.va_toastrelid;
+	key.valueid = toastPointer.va_valueid;
+	key.rawsize = toastPointer.va_rawsize;
+	key.extsize = toastPointer.va_extsize;
+
+	if (docCache == NULL)
+	{
+		createXMLDocCache();
+	}
+
+	entry = (XMLDocCacheEntry) hash_search(docCache, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		/* Move the entry to the head of the LRU list. */
+		if (entry != docCacheHead)
+		{
+			unlinkXMLDocCacheEntry(entry);
+			entry->next = docCacheHead;
+			docCacheHead->prev = entry;
+			docCacheHead = entry;
+		}
+		pinXMLDocCacheEntry(entry);
+		return entry->doc;
+	}
+
+	/*
+	 * Make room for the new entry. Pinned entries may still be used by the
+	 * caller(s), so only the other ones can be evicted.
+	 */
+	victim = docCacheTail;
+	while (victim != NULL && docCacheUsed + size > sizeMax)
+	{
+		XMLDocCacheEntry prev = victim->prev;
+
+		if (victim->pins == 0)
+		{
+			removeXMLDocCacheEntry(victim);
+		}
+		victim = prev;
+	}
+	if (docCacheUsed + size > sizeMax)
+	{
+		return (xmldoc) PG_DETOAST_DATUM(value);
+	}
+
+	oldcontext = MemoryContextSwitchTo(docCacheContext);
+	doc = (xmldoc) PG_DETOAST_DATUM(value);
+	MemoryContextSwitchTo(oldcontext);
+
+	entry = (XMLDocCacheEntry) hash_search(docCache, &key, HASH_ENTER, &found);
+	Assert(!found);
+	entry->doc = doc;
+	entry->size = size;
+	MemSet(entry->aux, 0, sizeof(entry->aux));
+	entry->auxContext = NULL;
+	entry->pins = 0;
+	entry->pinContext = NULL;
+	entry->prev = NULL;
+	entry->next = docCacheHead;
+	if (docCacheHead != NULL)
+	{
+		docCacheHead->prev = entry;
+	}
+	docCacheHead = entry;
+	if (docCacheTail == NULL)
+	{
+		docCacheTail = entry;
+	}
+	docCacheUsed += entry->size;
+	pinXMLDocCacheEntry(entry);
+	return doc;
+}
+
+/*
+ * If 'doc' has been returned by detoastXMLDocCached() and is still in the
+ * cache, returns pointer to the slot where auxiliary structure of 'kind'
+ * can be stored. In that case '*context' receives the memory context the
+ * structure has to be allocated in, so that it's freed along with the
+ * document.
+ *
+ * NULL is returned if the document is not cached.
+ */
+void	  **
+getXMLDocCacheAux(xmldoc doc, XMLDocAuxKind kind, MemoryContext *context)
+{
+	XMLDocCacheEntry entry = findXMLDocCacheEntry(doc);
+
+	if (entry == NULL)
+	{
+		return NULL;
+	}
+	if (entry->auxContext == NULL)
+	{
+		entry->auxContext = AllocSetContextCreate(docCacheContext, "pg_xnode document cache entry",
+												  ALLOCSET_SMALL_MINSIZE,
+												  ALLOCSET_SMALL_INITSIZE,
+												  ALLOCSET_DEFAULT_MAXSIZE);
+	}
+	*context = entry->auxContext;
+	return &entry->aux[kind];
+}
+
+/*
+ * The cache is small, so the LRU list is searched. The recently used entries
+ * are the most likely to be found.
+ */
+static XMLDocCacheEntry
+findXMLDocCacheEntry(xmldoc doc)
+{
+	XMLDocCacheEntry entry;
+
+	for (entry = docCacheHead; entry != NULL; entry = entry->next)
+	{
+		if (entry->doc == doc)
+		{
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void
+createXMLDocCache(void)
+{
+	HASHCTL		ctl;
+
+	docCacheContext = AllocSetContextCreate(TopMemoryContext, "pg_xnode document cache",
+											ALLOCSET_DEFAULT_MINSIZE,
+											ALLOCSET_DEFAULT_INITSIZE,
+											ALLOCSET_DEFAULT_MAXSIZE);
+
+	MemSet(&ctl, 0, sizeof(HASHCTL));
+	ctl.keysize = sizeof(XMLDocCacheKey);
+	ctl.entrysize = sizeof(XMLDocCacheEntryData);
+	ctl.hash = tag_hash;
+	ctl.hcxt = docCacheContext;
+	docCache = hash_create("pg_xnode document cache", 16, &ctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	docCacheHead = docCacheTail = NULL;
+	docCacheUsed = 0;
+}
+
+/*
+ * Make sure 'entry' is not evicted until CurrentMemoryContext is reset or
+ * deleted.
+ */
+static void
+pinXMLDocCacheEntry(XMLDocCacheEntry entry)
+{
+#if PG_VERSION_NUM >= 90500
+	XMLDocCachePin pin;
+
+	if (entry->pins > 0 && entry->pinContext == CurrentMemoryContext)
+	{
+		/* Typically another function called for the same tuple. */
+		return;
+	}
+	pin = (XMLDocCachePin) palloc(sizeof(XMLDocCachePinData));
+	pin->entry = entry;
+	pin->context = CurrentMemoryContext;
+	pin->generation = docCacheGeneration;
+	pin->callback.func = unpinXMLDocCacheEntry;
+	pin->callback.arg = pin;
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, &pin->callback);
+	entry->pins++;
+	entry->pinContext = CurrentMemoryContext;
+#else
+
+	/*
+	 * Memory context callbacks are not available, so the entry stays pinned
+	 * until the cache is discarded at the end of the transaction.
+	 */
+	entry->pins = 1;
+#endif
+}
+
+#if PG_VERSION_NUM >= 90500
+static void
+unpinXMLDocCacheEntry(void *arg)
+{
+	XMLDocCachePin pin = (XMLDocCachePin) arg;
+
+	/* The entry no longer exists if the cache has been discarded. */
+	if (pin->generation != docCacheGeneration)
+	{
+		return;
+	}
+	Assert(pin->entry->pins > 0);
+	pin->entry->pins--;
+	if (pin->entry->pinContext == pin->context)
+	{
+		pin->entry->pinContext = NULL;
+	}
+}
+#endif
+
+/*
+ * Free the document and auxiliary structures of 'entry', which must not be
+ * pinned, and remove the entry from the cache.
+ */
+static void
+removeXMLDocCacheEntry(XMLDocCacheEntry entry)
+{
+	Assert(entry->pins == 0);
+	unlinkXMLDocCacheEntry(entry);
+	docCacheUsed -= entry->size;
+	pfree(entry->doc);
+	if (entry->auxContext != NULL)
+	{
+		MemoryContextDelete(entry->auxContext);
+	}
+	hash_search(docCache, &entry->key, HASH_REMOVE, NULL);
+}
+
+static void
+unlinkXMLDocCacheEntry(XMLDocCacheEntry entry)
+{
+	if (entry->prev != NULL)
+	{
+		entry->prev->next = entry->next;
+	}
+	else
+	{
+		docCacheHead = entry->next;
+	}
+	if (entry->next != NULL)
+	{
+		entry->next->prev = entry->prev;
+	}
+	else
+	{
+		docCacheTail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+static void
+xmlDocCacheXactCallback(XactEvent event, void *arg)
+{
+	if (docCacheContext != NULL)
+	{
+		/* The hash table lives in the context too. */
+		MemoryContextDelete(docCacheContext);
+		docCacheContext = NULL;
+		docCache = NULL;
+		docCacheHead = docCacheTail = NULL;
+		docCacheUsed = 0;
+		docCacheGeneration++;
+	}
+}
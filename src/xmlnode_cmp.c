@@ -0,0 +1,465 @@
+/*
+ * Copyright (C) 2012, Antonin Houska
+ */
+
+/*
+ * Comparison and hashing of 'node' / 'doc' values.
+ *
+ * Both functions work on the binary tree directly, so no text representation is
+ * ever constructed. Two values are considered equal if they have the same
+ * structure and content. Differences that don't affect the information set are
+ * ignored:
+ *
+ * - order of attributes,
+ * - delimiter of attribute values (XNODE_ATTR_APOSTROPHE) and other flags
+ * derived from the content (XNODE_ATTR_NUMBER, XNODE_TEXT_SPEC_CHARS, ...),
+ * - '<a/>' vs. '<a></a>' (XNODE_EMPTY),
+ * - XML declaration of a document,
+ * - whether a string is stored in the document's string pool.
+ *
+ * The hash is computed so that equal values always get the same hash.
+ */
+
+#include "postgres.h"
+
+#include "xmlnode.h"
+#include "xmlnode_util.h"
+
+#define XNODE_HASH_INIT		UINT64CONST(0xcbf29ce484222325)
+#define XNODE_HASH_PRIME	UINT64CONST(0x100000001b3)
+
+static int	compareXMLNodes(XMLNodeHdr node1, XMLNodeHdr node2);
+static int	compareCompoundNodes(XMLCompNodeHdr node1, XMLCompNodeHdr node2);
+static int	compareAttributes(const void *attr1, const void *attr2);
+static XMLNodeHdr *getSortedAttributes(XMLCompNodeHdr element, unsigned short *count);
+static uint64 hashXMLNode(XMLNodeHdr node);
+static uint64 hashXMLString(char *str, uint64 hash);
+static uint64 mixXMLNodeHash(uint64 hash);
+static int	compareXMLNodeArgs(FunctionCallInfo fcinfo);
+
+/*
+ * Returns negative value, zero or positive value if 'node1' is lower than,
+ * equal to or greater than 'node2' respectively.
+ *
+ * Nodes of different kinds are sorted by the kind.
+ */
+static int
+compareXMLNodes(XMLNodeHdr node1, XMLNodeHdr node2)
+{
+	char	   *cnt1,
+			   *cnt2;
+	int			result;
+
+	if (node1->kind != node2->kind)
+	{
+		return (node1->kind < node2->kind) ? -1 : 1;
+	}
+
+	switch (node1->kind)
+	{
+		case XMLNODE_DOC:
+		case XMLNODE_ELEMENT:
+		case XMLNODE_DOC_FRAGMENT:
+			return compareCompoundNodes((XMLCompNodeHdr) node1, (XMLCompNodeHdr) node2);
+
+		case XMLNODE_ATTRIBUTE:
+			return compareAttributes(&node1, &node2);
+
+		case XMLNODE_PI:
+			cnt1 = XNODE_CONTENT(node1);
+			cnt2 = XNODE_CONTENT(node2);
+			result = strcmp(cnt1, cnt2);
+			if (result != 0)
+			{
+				return result;
+			}
+
+			/* Missing value is considered lower than any (even empty) value. */
+			if ((node1->flags & XNODE_PI_HAS_VALUE) != (node2->flags & XNODE_PI_HAS_VALUE))
+			{
+				return (node1->flags & XNODE_PI_HAS_VALUE) ? 1 : -1;
+			}
+			if (node1->flags & XNODE_PI_HAS_VALUE)
+			{
+				cnt1 += strlen(cnt1) + 1;
+				cnt2 += strlen(cnt2) + 1;
+				return strcmp(cnt1, cnt2);
+			}
+			return 0;
+
+		case XMLNODE_TEXT:
+			return strcmp(XNODE_TEXT(node1), XNODE_TEXT(node2));
+
+		case XMLNODE_DTD:
+		case XMLNODE_COMMENT:
+		case XMLNODE_CDATA:
+			return strcmp(XNODE_CONTENT(node1), XNODE_CONTENT(node2));
+
+		default:
+			elog(ERROR, "unable to compare node of type %u", node1->kind);
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Element name is compared first, then the attributes (regardless their order)
+ * and finally the other children (in the document order).
+ */
+static int
+compareCompoundNodes(XMLCompNodeHdr node1, XMLCompNodeHdr node2)
+{
+	char	   *refPtr1,
+			   *refPtr2;
+	char		bwidth1,
+				bwidth2;
+	unsigned short attrCount1 = 0;
+	unsigned short attrCount2 = 0;
+	unsigned short i;
+	int			result = 0;
+
+	if (node1->common.kind == XMLNODE_ELEMENT)
+	{
+		XMLNodeHdr *attrs1,
+				   *attrs2;
+
+		result = strcmp(XNODE_ELEMENT_NAME(node1), XNODE_ELEMENT_NAME(node2));
+		if (result != 0)
+		{
+			return result;
+		}
+
+		attrs1 = getSortedAttributes(node1, &attrCount1);
+		attrs2 = getSortedAttributes(node2, &attrCount2);
+
+		if (attrCount1 != attrCount2)
+		{
+			result = (attrCount1 < attrCount2) ? -1 : 1;
+		}
+		else
+		{
+			for (i = 0; i < attrCount1; i++)
+			{
+				result = compareAttributes(attrs1 + i, attrs2 + i);
+				if (result != 0)
+				{
+					break;
+				}
+			}
+		}
+
+		if (attrs1 != NULL)
+		{
+			pfree(attrs1);
+		}
+		if (attrs2 != NULL)
+		{
+			pfree(attrs2);
+		}
+		if (result != 0)
+		{
+			return result;
+		}
+	}
+
+	if ((node1->children - attrCount1) != (node2->children - attrCount2))
+	{
+		return ((node1->children - attrCount1) < (node2->children - attrCount2)) ? -1 : 1;
+	}
+
+	bwidth1 = XNODE_GET_REF_BWIDTH(node1);
+	bwidth2 = XNODE_GET_REF_BWIDTH(node2);
+	refPtr1 = XNODE_FIRST_REF(node1) + attrCount1 * bwidth1;
+	refPtr2 = XNODE_FIRST_REF(node2) + attrCount2 * bwidth2;
+
+	for (i = attrCount1; i < node1->children; i++)
+	{
+		XMLNodeHdr	child1 = (XMLNodeHdr) ((char *) node1 - readXMLNodeOffset(&refPtr1, bwidth1, true));
+		XMLNodeHdr	child2 = (XMLNodeHdr) ((char *) node2 - readXMLNodeOffset(&refPtr2, bwidth2, true));
+
+		result = compareXMLNodes(child1, child2);
+		if (result != 0)
+		{
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * qsort() compatible comparator of attribute nodes. Names are compared first,
+ * values then.
+ */
+static int
+compareAttributes(const void *attr1, const void *attr2)
+{
+	XMLNodeHdr	node1 = *((XMLNodeHdr *) attr1);
+	XMLNodeHdr	node2 = *((XMLNodeHdr *) attr2);
+	int			result;
+
+	result = strcmp(XNODE_CONTENT(node1), XNODE_CONTENT(node2));
+	if (result != 0)
+	{
+		return result;
+	}
+	return strcmp(XNODE_ATTR_VALUE(node1), XNODE_ATTR_VALUE(node2));
+}
+
+/*
+ * Returns array of element's attributes, sorted by name, or NULL if the element
+ * has no attributes. '*count' receives the number of attributes.
+ */
+static XMLNodeHdr *
+getSortedAttributes(XMLCompNodeHdr element, unsigned short *count)
+{
+	char	   *refPtr = XNODE_FIRST_REF(element);
+	char		bwidth = XNODE_GET_REF_BWIDTH(element);
+	XMLNodeHdr *result = NULL;
+	unsigned short i;
+	XMLNodeOffset ref;
+
+	*count = element->attributes;
+	if (*count == 0)
+	{
+		return NULL;
+	}
+	result = (XMLNodeHdr *) palloc(*count * sizeof(XMLNodeHdr));
+	XNODE_FOREACH_REF(refPtr, bwidth, *count, i, ref,
+	{
+		result[i] = (XMLNodeHdr) ((char *) element - ref);
+	});
+
+	if (*count > 1)
+	{
+		qsort(result, *count, sizeof(XMLNodeHdr), compareAttributes);
+	}
+	return result;
+}
+
+/*
+ * 64-bit structural hash of a node (subtree).
+ *
+ * Strings are hashed using FNV-1a. Hashes of attributes are combined by
+ * addition so that the result doesn't depend on the attribute order. Other
+ * children are combined in the document order.
+ */
+static uint64
+hashXMLNode(XMLNodeHdr node)
+{
+	uint64		hash = (XNODE_HASH_INIT ^ node->kind) * XNODE_HASH_PRIME;
+
+	switch (node->kind)
+	{
+		case XMLNODE_DOC:
+		case XMLNODE_ELEMENT:
+		case XMLNODE_DOC_FRAGMENT:
+			{
+				XMLCompNodeHdr compNode = (XMLCompNodeHdr) node;
+				char	   *refPtr = XNODE_FIRST_REF(compNode);
+				char		bwidth = XNODE_GET_REF_BWIDTH(compNode);
+				uint64		attrHash = 0;
+				unsigned short i;
+
+				if (node->kind == XMLNODE_ELEMENT)
+				{
+					hash = hashXMLString(XNODE_ELEMENT_NAME(compNode), hash);
+				}
+
+				for (i = 0; i < compNode->attributes; i++)
+				{
+					XMLNodeHdr	attr = (XMLNodeHdr) ((char *) node - readXMLNodeOffset(&refPtr, bwidth, true));
+
+					attrHash += hashXMLNode(attr);
+				}
+				for (; i < compNode->children; i++)
+				{
+					XMLNodeHdr	child = (XMLNodeHdr) ((char *) node - readXMLNodeOffset(&refPtr, bwidth, true));
+
+					hash = (hash ^ hashXMLNode(child)) * XNODE_HASH_PRIME;
+				}
+				hash = (hash ^ mixXMLNodeHash(attrHash)) * XNODE_HASH_PRIME;
+				break;
+			}
+
+		case XMLNODE_ATTRIBUTE:
+		case XMLNODE_PI:
+			{
+				char	   *cnt = XNODE_CONTENT(node);
+
+				hash = hashXMLString(cnt, hash);
+				if (node->kind == XMLNODE_ATTRIBUTE || (node->flags & XNODE_PI_HAS_VALUE))
+				{
+					/* The terminating zero separates name from value. */
+					hash *= XNODE_HASH_PRIME;
+					cnt += strlen(cnt) + 1;
+					if (node->kind == XMLNODE_ATTRIBUTE)
+					{
+						cnt = XNODE_STRING(node, cnt);
+					}
+					hash = hashXMLString(cnt, hash);
+				}
+				break;
+			}
+
+		case XMLNODE_TEXT:
+			hash = hashXMLString(XNODE_TEXT(node), hash);
+			break;
+
+		case XMLNODE_DTD:
+		case XMLNODE_COMMENT:
+		case XMLNODE_CDATA:
+			hash = hashXMLString(XNODE_CONTENT(node), hash);
+			break;
+
+		default:
+			elog(ERROR, "unable to compute hash of node of type %u", node->kind);
+			break;
+	}
+	return mixXMLNodeHash(hash);
+}
+
+static uint64
+hashXMLString(char *str, uint64 hash)
+{
+	unsigned char *c = (unsigned char *) str;
+
+	while (*c != '\0')
+	{
+		hash ^= *c++;
+		hash *= XNODE_HASH_PRIME;
+	}
+	return hash;
+}
+
+/*
+ * Finalization step to spread the bits, so that sum of hashes (see attributes above)
+ * is as good as the hashes themselves.
+ */
+static uint64
+mixXMLNodeHash(uint64 hash)
+{
+	hash ^= hash >> 33;
+	hash *= UINT64CONST(0xff51afd7ed558ccd);
+	hash ^= hash >> 33;
+	hash *= UINT64CONST(0xc4ceb9fe1a85ec53);
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/*
+ * The same functions are used for both 'node' and 'doc' types as both share the
+ * binary format.
+ */
+
+static int
+compareXMLNodeArgs(FunctionCallInfo fcinfo)
+{
+	xmlnode		nodeRaw1 = (xmlnode) PG_GETARG_VARLENA_P(0);
+	xmlnode		nodeRaw2 = (xmlnode) PG_GETARG_VARLENA_P(1);
+	int			result = compareXMLNodes(XNODE_ROOT(nodeRaw1), XNODE_ROOT(nodeRaw2));
+
+	PG_FREE_IF_COPY(nodeRaw1, 0);
+	PG_FREE_IF_COPY(nodeRaw2, 1);
+	return result;
+}
+
+PG_FUNCTION_INFO_V1(xmlnode_cmp);
+
+Datum
+xmlnode_cmp(PG_FUNCTION_ARGS)
+{
+	int			result = compareXMLNodeArgs(fcinfo);
+
+	PG_RETURN_INT32(result);
+}
+
+PG_FUNCTION_INFO_V1(xmlnode_eq);
+
+Datum
+xmlnode_eq(PG_FUNCTION_ARGS)
+{
+	int			result = compareXMLNodeArgs(fcinfo);
+
+	PG_RETURN_BOOL(result == 0);
+}
+
+PG_FUNCTION_INFO_V1(xmlnode_ne);
+
+Datum
+xmlnode_ne(PG_FUNCTION_ARGS)
+{
+	int			result = compareXMLNodeArgs(fcinfo);
+
+	PG_RETURN_BOOL(result != 0);
+}
+
+PG_FUNCTION_INFO_V1(xmlnode_lt);
+
+Datum
+xmlnode_lt(PG_FUNCTION_ARGS)
+{
+	int			result = compareXMLNodeArgs(fcinfo);
+
+	PG_RETURN_BOOL(result < 0);
+}
+
+PG_FUNCTION_INFO_V1(xmlnode_le);
+
+Datum
+xmlnode_le(PG_FUNCTION_ARGS)
+{
+	int			result = compareXMLNodeArgs(fcinfo);
+
+	PG_RETURN_BOOL(result <= 0);
+}
+
+PG_FUNCTION_INFO_V1(xmlnode_gt);
+
+Datum
+xmlnode_gt(PG_FUNCTION_ARGS)
+{
+	int			result = compareXMLNodeArgs(fcinfo);
+
+	PG_RETURN_BOOL(result > 0);
+}
+
+PG_FUNCTION_INFO_V1(xmlnode_ge);
+
+Datum
+xmlnode_ge(PG_FUNCTION_ARGS)
+{
+	int			result = compareXMLNodeArgs(fcinfo);
+
+	PG_RETURN_BOOL(result >= 0);
+}
+
+/*
+ * Hash support function. The hash access method only accepts 32 bits, so the
+ * 64-bit hash is folded.
+ */
+PG_FUNCTION_INFO_V1(xmlnode_hash);
+
+Datum
+xmlnode_hash(PG_FUNCTION_ARGS)
+{
+	xmlnode		nodeRaw = (xmlnode) PG_GETARG_VARLENA_P(0);
+	uint64		hash = hashXMLNode(XNODE_ROOT(nodeRaw));
+
+	PG_FREE_IF_COPY(nodeRaw, 0);
+	PG_RETURN_INT32((int32) (hash ^ (hash >> 32)));
+}
+
+/*
+ * The whole 64-bit hash, e.g. to be used by applications for deduplication.
+ */
+PG_FUNCTION_INFO_V1(xmlnode_hash64);
+
+Datum
+xmlnode_hash64(PG_FUNCTION_ARGS)
+{
+	xmlnode		nodeRaw = (xmlnode) PG_GETARG_VARLENA_P(0);
+	uint64		hash = hashXMLNode(XNODE_ROOT(nodeRaw));
+
+	PG_FREE_IF_COPY(nodeRaw, 0);
+	PG_RETURN_INT64((int64) hash);
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2012, Antonin Houska
+ */
+
+/*
+ * Expanded (in-memory) representation of 'xmldoc'.
+ *
+ * A document modified by xml.add() or xml.remove() is returned as expanded
+ * object, which contains the document w/o the string pool. Thus PL/pgSQL
+ * variable assigned such a value keeps the object as it is, and functions
+ * receiving it can read (or modify) the document w/o detoasting it and w/o
+ * removing the string pool first. The string pool is only built when the
+ * value is flattened, i.e. when it's stored or passed to a function that
+ * needs the flat form.
+ *
+ * The update functions build the document directly in the memory context of
+ * the object, so no copy is needed to create it.
+ *
+ * If an update function receives read-write pointer to the object (i.e. the
+ * argument is result of another function, as in nested xml.add() calls),
+ * the object is modified in place: it's used as the source document, which
+ * the update may overwrite (see appendXMLNodeLocally()) or free once the
+ * new one is built. PL/pgSQL only passes read-only pointers to its
+ * variables, so a variable can't be left invalid if the update fails.
+ *
+ * Expanded objects are only available on PostgreSQL 9.5 and newer. On older
+ * servers the functions of this module return the flat form.
+ */
+
+#include "postgres.h"
+#include "utils/memutils.h"
+
+#include "xmlnode.h"
+
+#ifdef XNODE_EXPANDED_DOC
+#include "utils/expandeddatum.h"
+
+typedef struct ExpandedXMLDocData
+{
+	ExpandedObjectHeader hdr;	/* must be the first */
+	int			magic;
+
+	/* The document w/o the string pool. */
+	xmldoc		doc;
+
+	/* The flat form, built when needed for the first time. */
+	xmldoc		flat;
+} ExpandedXMLDocData;
+
+typedef struct ExpandedXMLDocData *ExpandedXMLDoc;
+
+#define XNODE_EXPANDED_DOC_MAGIC	0x78646f63
+
+static Size getExpandedXMLDocFlatSize(ExpandedObjectHeader *eohptr);
+static void flattenExpandedXMLDoc(ExpandedObjectHeader *eohptr, void *result, Size allocatedSize);
+static ExpandedXMLDoc getExpandedXMLDoc(Datum value);
+
+static const ExpandedObjectMethods expandedXMLDocMethods =
+{
+	getExpandedXMLDocFlatSize,
+	flattenExpandedXMLDoc
+};
+#endif   /* XNODE_EXPANDED_DOC */
+
+/*
+ * Returns the document w/o the string pool, as xml.add() and xml.remove()
+ * need it. '*inPlace' tells whether the update may modify or free the
+ * document. If it's false, the result must not be modified in place.
+ */
+xmldoc
+getXMLDocForUpdate(Datum value, bool *inPlace)
+{
+	*inPlace = false;
+#ifdef XNODE_EXPANDED_DOC
+	if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(value)))
+	{
+		*inPlace = VARATT_IS_EXTERNAL_EXPANDED_RW(DatumGetPointer(value));
+		return getExpandedXMLDoc(value)->doc;
+	}
+#endif
+	return unpoolXMLDoc((xmldoc) PG_DETOAST_DATUM(value));
+}
+
+/*
+ * Returns memory context in which an update function should build its result.
+ * If it's not the current context, it'll become the context of the expanded
+ * object. Temporary allocations of the update can be done there too: they
+ * are small compared to the document.
+ */
+MemoryContext
+getXMLDocUpdateContext(void)
+{
+#ifdef XNODE_EXPANDED_DOC
+	return AllocSetContextCreate(CurrentMemoryContext, "expanded xml.doc",
+								 ALLOCSET_DEFAULT_MINSIZE,
+								 ALLOCSET_DEFAULT_INITSIZE,
+								 ALLOCSET_DEFAULT_MAXSIZE);
+#else
+	return CurrentMemoryContext;
+#endif
+}
+
+/*
+ * Turn document 'doc' (w/o the string pool), created by an update function
+ * in 'context' (see getXMLDocUpdateContext()), into its return value.
+ * 'value' and 'inPlace' are the source document and the flag returned for
+ * it by getXMLDocForUpdate().
+ */
+Datum
+getXMLDocUpdateResult(Datum value, bool inPlace, xmldoc doc, MemoryContext context)
+{
+#ifdef XNODE_EXPANDED_DOC
+	if (inPlace)
+	{
+		ExpandedXMLDoc source = getExpandedXMLDoc(value);
+
+		if (doc == source->doc)
+		{
+			/*
+			 * The document has been modified in place, so the context only
+			 * contains temporary allocations.
+			 */
+			MemoryContextDelete(context);
+			if (source->flat != NULL && source->flat != source->doc)
+			{
+				pfree(source->flat);
+			}
+			source->flat = NULL;
+			return value;
+		}
+
+		/* The update has built a new document, so the source is not needed. */
+		DeleteExpandedObject(value);
+	}
+
+	if (context != CurrentMemoryContext)
+	{
+		ExpandedXMLDoc result;
+
+		result = (ExpandedXMLDoc) MemoryContextAlloc(context, sizeof(ExpandedXMLDocData));
+		EOH_init_header(&result->hdr, &expandedXMLDocMethods, context);
+		result->magic = XNODE_EXPANDED_DOC_MAGIC;
+		result->doc = doc;
+		result->flat = NULL;
+		return EOHPGetRWDatum(&result->hdr);
+	}
+#endif
+	return PointerGetDatum(poolXMLDocStrings(doc));
+}
+
+#ifdef XNODE_EXPANDED_DOC
+
+/*
+ * Unlike detoasting, this does not flatten the object.
+ */
+xmldoc
+getExpandedXMLDocData(Datum value)
+{
+	return getExpandedXMLDoc(value)->doc;
+}
+
+static Size
+getExpandedXMLDocFlatSize(ExpandedObjectHeader *eohptr)
+{
+	ExpandedXMLDoc edoc = (ExpandedXMLDoc) eohptr;
+
+	Assert(edoc->magic == XNODE_EXPANDED_DOC_MAGIC);
+	if (edoc->flat == NULL)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(edoc->hdr.eoh_context);
+
+		edoc->flat = poolXMLDocStrings(edoc->doc);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	return VARSIZE(edoc->flat);
+}
+
+static void
+flattenExpandedXMLDoc(ExpandedObjectHeader *eohptr, void *result, Size allocatedSize)
+{
+	ExpandedXMLDoc edoc = (ExpandedXMLDoc) eohptr;
+
+	Assert(edoc->magic == XNODE_EXPANDED_DOC_MAGIC);
+	Assert(edoc->flat != NULL && allocatedSize == VARSIZE(edoc->flat));
+	memcpy(result, edoc->flat, allocatedSize);
+}
+
+static ExpandedXMLDoc
+getExpandedXMLDoc(Datum value)
+{
+	ExpandedXMLDoc result = (ExpandedXMLDoc) DatumGetEOHP(value);
+
+	if (result->magic != XNODE_EXPANDED_DOC_MAGIC)
+	{
+		elog(ERROR, "expanded object is not a document");
+	}
+	return result;
+}
+
+#endif   /* XNODE_EXPANDED_DOC */
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2012, Antonin Houska
+ */
+
+/*
+ * Index of ID attributes, used by XPath id() function.
+ *
+ * If the DTD declares any attribute of the document to be of type ID (such
+ * attributes have XNODE_ATTR_ID flag set), only these are indexed. Otherwise
+ * attributes named 'id' are considered IDs. The result therefore only
+ * depends on the document.
+ *
+ * The index is a hash table mapping attribute value to offset of the
+ * element. It's built when needed for the first time. If the document is
+ * in the document cache (see xmlnode_cache.c), the index is kept there too.
+ * Otherwise it's kept in the slot the caller passes, for as long as the
+ * caller evaluates expressions against the same document.
+ * If the document contains duplicate IDs, the first element in the document
+ * order wins.
+ */
+
+#include "postgres.h"
+#include "access/hash.h"
+#include "utils/memutils.h"
+
+#include "xmlnode.h"
+#include "xmlnode_util.h"
+
+typedef struct XMLIdIndexEntry
+{
+	uint32		hash;
+	char	   *value;			/* NULL if the entry is not used */
+	XMLNodeOffset element;
+} XMLIdIndexEntry;
+
+typedef struct XMLIdIndexData
+{
+	/* Always power of 2. */
+	unsigned int size;
+	XMLIdIndexEntry *entries;
+} XMLIdIndexData;
+
+/*
+ * ID attributes found during the document traversal: those having the
+ * XNODE_ATTR_ID flag and those named XNODE_ID_ATTR_NAME are collected
+ * separately.
+ */
+typedef struct XMLIdCandidates
+{
+	XMLNodeHdr *attrs;
+	XMLCompNodeHdr *elements;
+	unsigned int count;
+	unsigned int countMax;
+} XMLIdCandidates;
+
+#define XNODE_ID_INDEX_MIN_SIZE		16
+
+/*
+ * Name of ID attributes if the DTD declares none. It's not configurable:
+ * other attributes (e.g. xml:id) must be declared by the DTD.
+ */
+#define XNODE_ID_ATTR_NAME			"id"
+
+static XMLIdIndex buildXMLIdIndex(xmldoc doc);
+static void collectXMLIdAttributes(XMLCompNodeHdr element, XMLIdCandidates *flagged,
+					   XMLIdCandidates *named);
+static void addXMLIdCandidate(XMLIdCandidates *candidates, XMLNodeHdr attr, XMLCompNodeHdr element);
+
+/*
+ * The slot is empty initially and the index will be allocated in the current
+ * memory context.
+ */
+void
+initXMLIdIndexSlot(XMLIdIndexSlot slot)
+{
+	slot->index = NULL;
+	slot->context = CurrentMemoryContext;
+}
+
+/*
+ * Return ID index of 'doc'. If the document is not cached, 'slot' is where
+ * the index is looked for and stored if it has to be built.
+ */
+XMLIdIndex
+getXMLIdIndex(xmldoc doc, XMLIdIndexSlot slot)
+{
+	MemoryContext context;
+	MemoryContext oldcontext;
+	void	  **cacheSlot = getXMLDocCacheAux(doc, XNODE_DOC_AUX_ID_INDEX, &context);
+	XMLIdIndex *indexPtr;
+
+	if (cacheSlot != NULL)
+	{
+		indexPtr = (XMLIdIndex *) cacheSlot;
+	}
+	else
+	{
+		indexPtr = &slot->index;
+		context = slot->context;
+	}
+
+	if (*indexPtr == NULL)
+	{
+		oldcontext = MemoryContextSwitchTo(context);
+		*indexPtr = buildXMLIdIndex(doc);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	return *indexPtr;
+}
+
+/*
+ * Returns element having ID equal to 'value' or NULL if there's no such.
+ */
+XMLNodeHdr
+lookupXMLIdIndex(XMLIdIndex index, xmldoc doc, char *value)
+{
+	uint32		hash = DatumGetUInt32(hash_any((unsigned char *) value, strlen(value)));
+	unsigned int mask = index->size - 1;
+	unsigned int i = hash & mask;
+
+	while (index->entries[i].value != NULL)
+	{
+		XMLIdIndexEntry *entry = index->entries + i;
+
+		if (entry->hash == hash && strcmp(entry->value, value) == 0)
+		{
+			return (XMLNodeHdr) (VARDATA(doc) + entry->element);
+		}
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+static XMLIdIndex
+buildXMLIdIndex(xmldoc doc)
+{
+	XMLCompNodeHdr root = (XMLCompNodeHdr) XNODE_ROOT(doc);
+	XMLIdCandidates flagged,
+				named;
+	XMLIdCandidates *ids;
+	XMLIdIndex	index;
+	unsigned int mask;
+	unsigned int i;
+
+	flagged.count = named.count = 0;
+	flagged.countMax = named.countMax = 0;
+	flagged.attrs = named.attrs = NULL;
+	flagged.elements = named.elements = NULL;
+	collectXMLIdAttributes(root, &flagged, &named);
+	ids = (flagged.count > 0) ? &flagged : &named;
+
+	index = (XMLIdIndex) palloc(sizeof(XMLIdIndexData));
+	index->size = XNODE_ID_INDEX_MIN_SIZE;
+	while (index->size < 2 * ids->count)
+	{
+		index->size *= 2;
+	}
+	index->entries = (XMLIdIndexEntry *) palloc0(index->size * sizeof(XMLIdIndexEntry));
+	mask = index->size - 1;
+
+	for (i = 0; i < ids->count; i++)
+	{
+		char	   *value = XNODE_ATTR_VALUE(ids->attrs[i]);
+		uint32		hash;
+		unsigned int j;
+
+		hash = DatumGetUInt32(hash_any((unsigned char *) value, strlen(value)));
+		j = hash & mask;
+		while (index->entries[j].value != NULL)
+		{
+			if (index->entries[j].hash == hash && strcmp(index->entries[j].value, value) == 0)
+			{
+				break;
+			}
+			j = (j + 1) & mask;
+		}
+		if (index->entries[j].value == NULL)
+		{
+			index->entries[j].hash = hash;
+			index->entries[j].value = value;
+			index->entries[j].element = (char *) ids->elements[i] - VARDATA(doc);
+		}
+	}
+
+	if (flagged.attrs != NULL)
+	{
+		pfree(flagged.attrs);
+		pfree(flagged.elements);
+	}
+	if (named.attrs != NULL)
+	{
+		pfree(named.attrs);
+		pfree(named.elements);
+	}
+	return index;
+}
+
+/*
+ * Elements are visited in the document order, i.e. each one before its
+ * descendants.
+ */
+static void
+collectXMLIdAttributes(XMLCompNodeHdr element, XMLIdCandidates *flagged, XMLIdCandidates *named)
+{
+	char		bwidth = XNODE_GET_REF_BWIDTH(element);
+	char	   *refPtr = XNODE_FIRST_REF(element);
+	char	   *kinds = XNODE_CHILD_KINDS(element);
+	unsigned short i;
+	XMLNodeOffset ref;
+
+	XNODE_FOREACH_REF(refPtr, bwidth, element->attributes, i, ref,
+	{
+		XMLNodeHdr	child = (XMLNodeHdr) ((char *) element - ref);
+
+		if (child->flags & XNODE_ATTR_ID)
+		{
+			addXMLIdCandidate(flagged, child, element);
+		}
+		else if (flagged->count == 0 && strcmp(XNODE_CONTENT(child), XNODE_ID_ATTR_NAME) == 0)
+		{
+			addXMLIdCandidate(named, child, element);
+		}
+	});
+
+	/* Only dereference the child elements. */
+	for (; i < element->children; i++)
+	{
+		if (kinds[i] == XMLNODE_ELEMENT)
+		{
+			char	   *childRef = XNODE_FIRST_REF(element) + i * bwidth;
+			XMLNodeHdr	child = (XMLNodeHdr) ((char *) element - readXMLNodeOffset(&childRef, bwidth, false));
+
+			collectXMLIdAttributes((XMLCompNodeHdr) child, flagged, named);
+		}
+	}
+}
+
+static void
+addXMLIdCandidate(XMLIdCandidates *candidates, XMLNodeHdr attr, XMLCompNodeHdr element)
+{
+	if (candidates->count == candidates->countMax)
+	{
+		if (candidates->attrs == NULL)
+		{
+			candidates->countMax = XNODE_CONTAINER_CHUNK;
+			candidates->attrs = (XMLNodeHdr *) palloc(candidates->countMax * sizeof(XMLNodeHdr));
+			candidates->elements = (XMLCompNodeHdr *) palloc(candidates->countMax * sizeof(XMLCompNodeHdr));
+		}
+		else
+		{
+			candidates->countMax *= 2;
+			candidates->attrs = (XMLNodeHdr *) repalloc(candidates->attrs,
+									   candidates->countMax * sizeof(XMLNodeHdr));
+			candidates->elements = (XMLCompNodeHdr *) repalloc(candidates->elements,
+								   candidates->countMax * sizeof(XMLCompNodeHdr));
+		}
+	}
+	candidates->attrs[candidates->count] = attr;
+	candidates->elements[candidates->count] = element;
+	candidates->count++;
+}
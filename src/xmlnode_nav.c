@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2012, Antonin Houska
+ */
+
+/*
+ * Navigation over node references ('noderef' type).
+ *
+ * The binary format only contains references from parent nodes to their
+ * children. To move upwards or sideways, the parent is found on the way
+ * from the root to the referenced node, see getXMLNodeRefTarget().
+ *
+ * That costs O(depth * log(n)) per call, so walking a large document would
+ * take time quadratic in the depth. Therefore, if the document is in the
+ * document cache (see xmlnode_cache.c), index of the parents is built the
+ * first time it's needed and kept in the cache entry. Smaller documents are
+ * not cached and the descent is used for them.
+ *
+ * Attributes are not considered children or siblings by these functions.
+ */
+
+#include "postgres.h"
+#include "funcapi.h"
+
+#include "xmlnode.h"
+#include "xmlnode_util.h"
+
+typedef struct XMLNodeDescendantsData
+{
+	XMLNodeOffset *offsets;
+	unsigned int count;
+	unsigned int countMax;
+	unsigned int current;
+} XMLNodeDescendantsData;
+
+/*
+ * Parent of each node of the tree except for the root, and position of the
+ * node among the parent's children. Sorted by 'node'.
+ */
+typedef struct XMLNodeParentEntry
+{
+	XMLNodeOffset node;
+	XMLNodeOffset parent;
+	unsigned short position;
+} XMLNodeParentEntry;
+
+typedef struct XMLNodeParentIndexData
+{
+	XMLNodeParentEntry *entries;
+	unsigned int count;
+	unsigned int countMax;
+} XMLNodeParentIndexData;
+
+typedef XMLNodeParentIndexData *XMLNodeParentIndex;
+
+static XMLNodeParentIndex getXMLNodeParentIndex(xmlnode tree);
+static void addXMLNodeParentEntries(XMLCompNodeHdr node, char *data, XMLNodeParentIndex index);
+static void addXMLNodeDescendants(XMLCompNodeHdr node, char *data, XMLNodeDescendantsData *state);
+
+/*
+ * Returns the node 'ref' points to, or raises ERROR if there's no node at
+ * that position of 'tree'.
+ *
+ * If 'parent' is not NULL, the parent of the node is stored there (NULL for
+ * the root) and position of the node among the parent's children is stored
+ * in '*position'.
+ *
+ * Children are stored below their parent and subtree of each child precedes
+ * that of its next sibling. Thus the child whose subtree contains the
+ * position is the first one not stored below it, and it can be found by
+ * binary search at each level of the tree.
+ */
+XMLNodeHdr
+getXMLNodeRefTarget(xmlnode tree, XMLNodeRef ref, XMLCompNodeHdr *parent,
+					unsigned short *position)
+{
+	char	   *data = VARDATA(tree);
+	XMLNodeOffset nodeOff = XNODE_ROOT_OFFSET(tree);
+	XMLNodeParentIndex index;
+
+	if (ref > nodeOff)
+	{
+		elog(ERROR, "invalid node reference: %u", ref);
+	}
+	if (parent != NULL)
+	{
+		*parent = NULL;
+	}
+	if (ref == nodeOff)
+	{
+		return (XMLNodeHdr) (data + ref);
+	}
+
+	index = getXMLNodeParentIndex(tree);
+	if (index != NULL)
+	{
+		unsigned int low = 0;
+		unsigned int high = index->count;
+
+		while (low < high)
+		{
+			unsigned int middle = (low + high) / 2;
+
+			if (index->entries[middle].node < ref)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+		if (low == index->count || index->entries[low].node != ref)
+		{
+			elog(ERROR, "invalid node reference: %u", ref);
+		}
+		if (parent != NULL)
+		{
+			*parent = (XMLCompNodeHdr) (data + index->entries[low].parent);
+			*position = index->entries[low].position;
+		}
+		return (XMLNodeHdr) (data + ref);
+	}
+
+	while (ref != nodeOff)
+	{
+		XMLCompNodeHdr node = (XMLCompNodeHdr) (data + nodeOff);
+		char		bwidth;
+		char	   *refPtr;
+		unsigned short low,
+					high;
+
+		if (node->common.kind != XMLNODE_DOC && node->common.kind != XMLNODE_ELEMENT &&
+			node->common.kind != XMLNODE_DOC_FRAGMENT)
+		{
+			elog(ERROR, "invalid node reference: %u", ref);
+		}
+
+		bwidth = XNODE_GET_REF_BWIDTH(node);
+		low = 0;
+		high = node->children;
+		while (low < high)
+		{
+			unsigned short middle = (low + high) / 2;
+
+			refPtr = XNODE_FIRST_REF(node) + middle * bwidth;
+			if (nodeOff - readXMLNodeOffset(&refPtr, bwidth, false) < ref)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+		if (low == node->children)
+		{
+			elog(ERROR, "invalid node reference: %u", ref);
+		}
+		refPtr = XNODE_FIRST_REF(node) + low * bwidth;
+		nodeOff -= readXMLNodeOffset(&refPtr, bwidth, false);
+		if (parent != NULL)
+		{
+			*parent = node;
+			*position = low;
+		}
+	}
+	return (XMLNodeHdr) (data + nodeOff);
+}
+
+/*
+ * Returns the parent index of 'tree', or NULL if the tree is not in the
+ * document cache.
+ */
+static XMLNodeParentIndex
+getXMLNodeParentIndex(xmlnode tree)
+{
+	MemoryContext context;
+	MemoryContext oldcontext;
+	void	  **cacheSlot = getXMLDocCacheAux((xmldoc) tree, XNODE_DOC_AUX_PARENT_INDEX, &context);
+	XMLNodeParentIndex index;
+
+	if (cacheSlot == NULL)
+	{
+		return NULL;
+	}
+	if (*cacheSlot == NULL)
+	{
+		oldcontext = MemoryContextSwitchTo(context);
+		index = (XMLNodeParentIndex) palloc(sizeof(XMLNodeParentIndexData));
+		index->count = 0;
+		index->countMax = XNODE_CONTAINER_CHUNK;
+		index->entries = (XMLNodeParentEntry *) palloc(index->countMax * sizeof(XMLNodeParentEntry));
+		addXMLNodeParentEntries((XMLCompNodeHdr) XNODE_ROOT(tree), VARDATA(tree), index);
+		MemoryContextSwitchTo(oldcontext);
+		*cacheSlot = index;
+	}
+	return (XMLNodeParentIndex) *cacheSlot;
+}
+
+/*
+ * Descendants of a node are stored below it and subtree of each child
+ * precedes that of its next sibling, so adding the entries in post-order
+ * keeps them sorted.
+ */
+static void
+addXMLNodeParentEntries(XMLCompNodeHdr node, char *data, XMLNodeParentIndex index)
+{
+	char		bwidth = XNODE_GET_REF_BWIDTH(node);
+	char	   *refPtr = XNODE_FIRST_REF(node);
+	unsigned short i;
+	XMLNodeOffset ref;
+
+	XNODE_FOREACH_REF(refPtr, bwidth, node->children, i, ref,
+	{
+		XMLNodeHdr	child = (XMLNodeHdr) ((char *) node - ref);
+		XMLNodeParentEntry *entry;
+
+		if (child->kind == XMLNODE_ELEMENT || child->kind == XMLNODE_DOC_FRAGMENT)
+		{
+			addXMLNodeParentEntries((XMLCompNodeHdr) child, data, index);
+		}
+
+		if (index->count == index->countMax)
+		{
+			index->countMax *= 2;
+			index->entries = (XMLNodeParentEntry *) repalloc(index->entries,
+									  index->countMax * sizeof(XMLNodeParentEntry));
+		}
+		entry = index->entries + index->count++;
+		entry->node = (char *) child - data;
+		entry->parent = (char *) node - data;
+		entry->position = i;
+	});
+}
+
+PG_FUNCTION_INFO_V1(xmlnoderef_parent);
+
+Datum
+xmlnoderef_parent(PG_FUNCTION_ARGS)
+{
+	xmlnode		tree = (xmlnode) detoastXMLDocCached(PG_GETARG_DATUM(0));
+	XMLCompNodeHdr parent;
+	unsigned short position;
+
+	getXMLNodeRefTarget(tree, PG_GETARG_XNODEREF(1), &parent, &position);
+	if (parent == NULL)
+	{
+		PG_RETURN_NULL();
+	}
+	PG_RETURN_XNODEREF((char *) parent - VARDATA(tree));
+}
+
+PG_FUNCTION_INFO_V1(xmlnoderef_next_sibling);
+
+Datum
+xmlnoderef_next_sibling(PG_FUNCTION_ARGS)
+{
+	xmlnode		tree = (xmlnode) detoastXMLDocCached(PG_GETARG_DATUM(0));
+	XMLCompNodeHdr parent;
+	unsigned short position;
+	XMLNodeHdr	node = getXMLNodeRefTarget(tree, PG_GETARG_XNODEREF(1), &parent, &position);
+	char		bwidth;
+	char	   *refPtr;
+
+	if (node->kind == XMLNODE_ATTRIBUTE || parent == NULL || position + 1 >= parent->children)
+	{
+		PG_RETURN_NULL();
+	}
+
+	/*
+	 * Attributes are the leading children, so the next one can't be an
+	 * attribute.
+	 */
+	bwidth = XNODE_GET_REF_BWIDTH(parent);
+	refPtr = XNODE_FIRST_REF(parent) + (position + 1) * bwidth;
+	PG_RETURN_XNODEREF((char *) parent - readXMLNodeOffset(&refPtr, bwidth, false) - VARDATA(tree));
+}
+
+PG_FUNCTION_INFO_V1(xmlnoderef_first_child);
+
+Datum
+xmlnoderef_first_child(PG_FUNCTION_ARGS)
+{
+	xmlnode		tree = (xmlnode) detoastXMLDocCached(PG_GETARG_DATUM(0));
+	XMLNodeRef	ref = PG_GETARG_XNODEREF(1);
+	XMLNodeHdr	node = getXMLNodeRefTarget(tree, ref, NULL, NULL);
+
+	if (node->kind == XMLNODE_DOC || node->kind == XMLNODE_ELEMENT || node->kind == XMLNODE_DOC_FRAGMENT)
+	{
+		XMLCompNodeHdr compNode = (XMLCompNodeHdr) node;
+
+		if (XNODE_CONTENT_CHILDREN(compNode) > 0)
+		{
+			char	   *refPtr = XNODE_FIRST_CONTENT_REF(compNode);
+
+			PG_RETURN_XNODEREF(ref - readXMLNodeOffset(&refPtr, XNODE_GET_REF_BWIDTH(compNode), false));
+		}
+	}
+	PG_RETURN_NULL();
+}
+
+/*
+ * Returns all descendants of the referenced node in document order.
+ *
+ * Only the offsets are collected by the first call, so the tree needn't be
+ * kept for the subsequent calls. It's detoasted in the multi-call context
+ * anyway so that the cache entry stays pinned as long as the function runs.
+ */
+PG_FUNCTION_INFO_V1(xmlnoderef_descendants);
+
+Datum
+xmlnoderef_descendants(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *fctx;
+	XMLNodeDescendantsData *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		xmlnode		tree;
+		XMLNodeHdr	node;
+
+		fctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+		tree = (xmlnode) detoastXMLDocCached(PG_GETARG_DATUM(0));
+		node = getXMLNodeRefTarget(tree, PG_GETARG_XNODEREF(1), NULL, NULL);
+
+		state = (XMLNodeDescendantsData *) palloc(sizeof(XMLNodeDescendantsData));
+		state->count = 0;
+		state->countMax = XNODE_CONTAINER_CHUNK;
+		state->offsets = (XMLNodeOffset *) palloc(state->countMax * sizeof(XMLNodeOffset));
+		state->current = 0;
+
+		if (node->kind == XMLNODE_DOC || node->kind == XMLNODE_ELEMENT || node->kind == XMLNODE_DOC_FRAGMENT)
+		{
+			addXMLNodeDescendants((XMLCompNodeHdr) node, VARDATA(tree), state);
+		}
+		fctx->user_fctx = state;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	fctx = SRF_PERCALL_SETUP();
+	state = (XMLNodeDescendantsData *) fctx->user_fctx;
+
+	if (state->current < state->count)
+	{
+		SRF_RETURN_NEXT(fctx, XNodeRefGetDatum(state->offsets[state->current++]));
+	}
+	SRF_RETURN_DONE(fctx);
+}
+
+/*
+ * Collect offsets of the descendants in pre-order, i.e. in document order.
+ */
+static void
+addXMLNodeDescendants(XMLCompNodeHdr node, char *data, XMLNodeDescendantsData *state)
+{
+	char		bwidth = XNODE_GET_REF_BWIDTH(node);
+	char	   *refPtr = XNODE_FIRST_CONTENT_REF(node);
+	unsigned short i;
+	XMLNodeOffset ref;
+
+	XNODE_FOREACH_REF(refPtr, bwidth, node->children - node->attributes, i, ref,
+	{
+		XMLNodeHdr	child = (XMLNodeHdr) ((char *) node - ref);
+
+		if (state->count == state->countMax)
+		{
+			state->countMax *= 2;
+			state->offsets = (XMLNodeOffset *) repalloc(state->offsets,
+											state->countMax * sizeof(XMLNodeOffset));
+		}
+		state->offsets[state->count++] = (char *) child - data;
+
+		if (child->kind == XMLNODE_ELEMENT || child->kind == XMLNODE_DOC_FRAGMENT)
+		{
+			addXMLNodeDescendants((XMLCompNodeHdr) child, data, state);
+		}
+	});
+}
@@ -0,0 +1,493 @@
+/*
+ * Copyright (C) 2012, Antonin Houska
+ */
+
+/*
+ * String pool of a document.
+ *
+ * Documents often contain the same attribute value or text many times
+ * (currency codes, units, status values, ...). If 'xnode.string_pool_threshold'
+ * is non-zero, each string occurring at least that many times is stored only
+ * once, at the beginning of the document data (i.e. before all nodes). The
+ * attribute or text nodes containing such a string have XNODE_STR_POOLED
+ * flag set and store distance to the string instead of the string itself.
+ * The distance is measured from the position where the string would
+ * otherwise start, so it can be resolved w/o knowing where the document
+ * starts, see XNODE_STRING().
+ *
+ * Compound nodes having pooled strings in their subtree are marked by
+ * XNODE_HAS_POOLED. Nodes copied out of such a subtree (see copyXMLNode())
+ * contain the strings again, so the pool never appears outside 'xmldoc'
+ * values. Functions modifying the document work on a copy without the pool,
+ * and the pool is built again for the result.
+ *
+ * If 'xnode.split_layout' is on, all attribute values and texts (except for
+ * those shorter than the distance) are moved to the pool, regardless the
+ * number of occurrences. The document then consists of two contiguous parts:
+ * the character content followed by the structure (node headers, references,
+ * names). Each part is more homogeneous than the original data, so TOAST
+ * compresses the document better. Scans that don't need the strings don't
+ * have to touch the content part at all.
+ *
+ * The pooled document keeps byte width of each node's references. The
+ * distances between parent and children can only decrease when strings are
+ * moved to the pool, and they get back to the original values when the
+ * strings are copied back.
+ */
+
+#include "postgres.h"
+#include "access/hash.h"
+#include "utils/guc.h"
+
+#include "xmlnode.h"
+#include "xmlnode_util.h"
+
+typedef struct XMLPoolEntry
+{
+	uint32		hash;
+	char	   *value;			/* NULL if the entry is not used */
+	unsigned int count;
+	bool		pooled;
+	bool		written;
+	/* Position of the pooled string, relative to the document data. */
+	XMLNodeOffset offset;
+} XMLPoolEntry;
+
+typedef struct XMLStringPoolData
+{
+	/* Always power of 2. */
+	unsigned int size;
+	XMLPoolEntry *entries;
+} XMLStringPoolData;
+
+typedef struct XMLStringPoolData *XMLStringPool;
+
+/*
+ * Strings that can be pooled, in the order they've been found.
+ */
+typedef struct XMLPoolCandidates
+{
+	char	  **strings;
+	unsigned int count;
+	unsigned int countMax;
+} XMLPoolCandidates;
+
+/* The distance does not take less space than this. */
+#define XNODE_POOL_MIN_STRING		XNODE_POOL_REF_SIZE
+#define XNODE_POOL_MIN_SIZE			16
+
+int			xnodeStringPoolThreshold = 0;
+bool		xnodeSplitLayout = false;
+
+static void collectXMLPoolCandidates(XMLCompNodeHdr node, XMLPoolCandidates *candidates);
+static void addXMLPoolCandidate(XMLPoolCandidates *candidates, char *str);
+static XMLPoolEntry *getXMLPoolEntry(XMLStringPool pool, char *str, bool add);
+static XMLNodeOffset writeXMLNodeTree(XMLNodeHdr node, char *output, char **cursor, XMLStringPool pool);
+
+void
+initXMLStringPool(void)
+{
+	DefineCustomIntVariable("xnode.string_pool_threshold",
+							"Minimum number of occurrences of a string in a document to store it in the string pool.",
+							"Zero disables the pool.",
+							&xnodeStringPoolThreshold,
+							0,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("xnode.split_layout",
+							 "Store attribute values and texts of a document separate from its structure.",
+							 NULL,
+							 &xnodeSplitLayout,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+}
+
+/*
+ * Returns 'doc' with the frequent attribute values and texts (or all of them
+ * if 'xnode.split_layout' is on) moved to the pool, or 'doc' itself if no
+ * string qualifies.
+ */
+xmldoc
+poolXMLDocStrings(xmldoc doc)
+{
+	XMLNodeHdr	root = XNODE_ROOT(doc);
+	XMLPoolCandidates candidates;
+	XMLStringPoolData pool;
+	unsigned int poolSize = 0;
+	unsigned int i;
+	char	   *result,
+			   *data,
+			   *cursor;
+	XMLNodeOffset rootOff;
+	XMLNodeOffset *rootOffPtr;
+
+	if (xnodeStringPoolThreshold == 0 && !xnodeSplitLayout)
+	{
+		return doc;
+	}
+	Assert(root->kind == XMLNODE_DOC && !(root->flags & XNODE_HAS_POOLED));
+
+	candidates.count = candidates.countMax = 0;
+	candidates.strings = NULL;
+	collectXMLPoolCandidates((XMLCompNodeHdr) root, &candidates);
+	if (candidates.count == 0 ||
+		(!xnodeSplitLayout && candidates.count < (unsigned int) xnodeStringPoolThreshold))
+	{
+		if (candidates.strings != NULL)
+		{
+			pfree(candidates.strings);
+		}
+		return doc;
+	}
+
+	pool.size = XNODE_POOL_MIN_SIZE;
+	while (pool.size < 2 * candidates.count)
+	{
+		pool.size *= 2;
+	}
+	pool.entries = (XMLPoolEntry *) palloc0(pool.size * sizeof(XMLPoolEntry));
+	for (i = 0; i < candidates.count; i++)
+	{
+		getXMLPoolEntry(&pool, candidates.strings[i], true)->count++;
+	}
+
+	/*
+	 * Unless the layout is split, only pool the strings for which the
+	 * distances take less space than the occurrences removed.
+	 */
+	for (i = 0; i < pool.size; i++)
+	{
+		XMLPoolEntry *entry = pool.entries + i;
+		unsigned int len;
+
+		if (entry->value == NULL)
+		{
+			continue;
+		}
+		len = strlen(entry->value) + 1;
+		if (xnodeSplitLayout ||
+			(xnodeStringPoolThreshold > 0 && entry->count >= (unsigned int) xnodeStringPoolThreshold &&
+			 entry->count * (len - XNODE_POOL_REF_SIZE) > len))
+		{
+			entry->pooled = true;
+			poolSize += len;
+		}
+	}
+	if (poolSize == 0)
+	{
+		pfree(pool.entries);
+		pfree(candidates.strings);
+		return doc;
+	}
+
+	/*
+	 * Neither the nodes nor the references can grow, see the header comment.
+	 */
+	result = (char *) palloc(VARSIZE(doc) + poolSize);
+	data = VARDATA(result);
+	cursor = data;
+
+	/* The pool itself, in the order of the first occurrences. */
+	for (i = 0; i < candidates.count; i++)
+	{
+		XMLPoolEntry *entry = getXMLPoolEntry(&pool, candidates.strings[i], false);
+
+		if (entry->pooled && !entry->written)
+		{
+			unsigned int len = strlen(entry->value) + 1;
+
+			entry->offset = cursor - data;
+			memcpy(cursor, entry->value, len);
+			cursor += len;
+			entry->written = true;
+		}
+	}
+
+	rootOff = writeXMLNodeTree(root, data, &cursor, &pool);
+	rootOffPtr = (XMLNodeOffset *) cursor;
+	XNODE_SET_ROOT_OFFSET(rootOffPtr, rootOff);
+	cursor += sizeof(XMLNodeOffset);
+	SET_VARSIZE(result, cursor - result);
+
+	pfree(pool.entries);
+	pfree(candidates.strings);
+	return (xmldoc) result;
+}
+
+/*
+ * Returns 'doc' w/o the string pool (possibly 'doc' itself).
+ */
+xmldoc
+unpoolXMLDoc(xmldoc doc)
+{
+	XMLNodeHdr	root = XNODE_ROOT(doc);
+
+	if (!(root->flags & XNODE_HAS_POOLED))
+	{
+		return doc;
+	}
+	return (xmldoc) copyXMLNodeUnpooled(root, NULL, true, NULL);
+}
+
+/*
+ * copyXMLNode() for node that has string(s) in the pool.
+ */
+char *
+copyXMLNodeUnpooled(XMLNodeHdr node, char *target, bool xmlnode, XMLNodeOffset *root)
+{
+	unsigned int size = getXMLNodeSize(node, true);
+	unsigned int resultSize = size;
+	char	   *result,
+			   *data,
+			   *cursor;
+	XMLNodeOffset rootOff;
+
+	if (xmlnode)
+	{
+		resultSize += VARHDRSZ + sizeof(XMLNodeOffset);
+	}
+	result = (target != NULL) ? target : (char *) palloc(resultSize);
+	data = xmlnode ? VARDATA(result) : result;
+	cursor = data;
+	rootOff = writeXMLNodeTree(node, data, &cursor, NULL);
+	Assert(cursor - data == size);
+
+	if (root != NULL)
+	{
+		*root = rootOff;
+	}
+	if (xmlnode)
+	{
+		XMLNodeOffset *offPtr = (XMLNodeOffset *) cursor;
+
+		XNODE_SET_ROOT_OFFSET(offPtr, rootOff);
+		SET_VARSIZE(result, resultSize);
+	}
+	return result;
+}
+
+static void
+collectXMLPoolCandidates(XMLCompNodeHdr node, XMLPoolCandidates *candidates)
+{
+	char		bwidth = XNODE_GET_REF_BWIDTH(node);
+	char	   *refPtr = XNODE_FIRST_REF(node);
+	unsigned short i;
+	XMLNodeOffset ref;
+
+	XNODE_FOREACH_REF(refPtr, bwidth, node->children, i, ref,
+	{
+		XMLNodeHdr	child = (XMLNodeHdr) ((char *) node - ref);
+		char	   *str;
+
+		switch (child->kind)
+		{
+			case XMLNODE_ELEMENT:
+				collectXMLPoolCandidates((XMLCompNodeHdr) child, candidates);
+				break;
+
+			case XMLNODE_ATTRIBUTE:
+				str = XNODE_ATTR_VALUE(child);
+				if (strlen(str) >= XNODE_POOL_MIN_STRING)
+				{
+					addXMLPoolCandidate(candidates, str);
+				}
+				break;
+
+			case XMLNODE_TEXT:
+				str = XNODE_TEXT(child);
+				if (strlen(str) >= XNODE_POOL_MIN_STRING)
+				{
+					addXMLPoolCandidate(candidates, str);
+				}
+				break;
+
+			default:
+				break;
+		}
+	});
+}
+
+static void
+addXMLPoolCandidate(XMLPoolCandidates *candidates, char *str)
+{
+	if (candidates->count == candidates->countMax)
+	{
+		if (candidates->strings == NULL)
+		{
+			candidates->countMax = XNODE_CONTAINER_CHUNK;
+			candidates->strings = (char **) palloc(candidates->countMax * sizeof(char *));
+		}
+		else
+		{
+			candidates->countMax *= 2;
+			candidates->strings = (char **) repalloc(candidates->strings,
+											candidates->countMax * sizeof(char *));
+		}
+	}
+	candidates->strings[candidates->count++] = str;
+}
+
+/*
+ * Returns entry for 'str'. If there's no such and 'add' is true, new entry
+ * is created, otherwise NULL is returned.
+ */
+static XMLPoolEntry *
+getXMLPoolEntry(XMLStringPool pool, char *str, bool add)
+{
+	uint32		hash = DatumGetUInt32(hash_any((unsigned char *) str, strlen(str)));
+	unsigned int mask = pool->size - 1;
+	unsigned int i = hash & mask;
+
+	while (pool->entries[i].value != NULL)
+	{
+		XMLPoolEntry *entry = pool->entries + i;
+
+		if (entry->hash == hash && strcmp(entry->value, str) == 0)
+		{
+			return entry;
+		}
+		i = (i + 1) & mask;
+	}
+	if (!add)
+	{
+		return NULL;
+	}
+	pool->entries[i].hash = hash;
+	pool->entries[i].value = str;
+	return pool->entries + i;
+}
+
+/*
+ * Write 'node' and its descendants at '*cursor' and return position of the
+ * node relative to 'output'. '*cursor' is moved right after the node.
+ *
+ * If 'pool' is NULL, the strings are written into the nodes. Otherwise those
+ * found in the pool are replaced with the distance. In both cases the nodes
+ * are written in the usual order, i.e. each one right after its subtree.
+ */
+static XMLNodeOffset
+writeXMLNodeTree(XMLNodeHdr node, char *output, char **cursor, XMLStringPool pool)
+{
+	XMLNodeOffset result;
+
+	if (node->kind == XMLNODE_DOC || node->kind == XMLNODE_ELEMENT || node->kind == XMLNODE_DOC_FRAGMENT)
+	{
+		XMLCompNodeHdr compNode = (XMLCompNodeHdr) node;
+		XMLCompNodeHdr compNodeNew;
+		char		bwidth = XNODE_GET_REF_BWIDTH(compNode);
+		char	   *refPtr = XNODE_FIRST_REF(compNode);
+		char	   *refPtrNew;
+		XMLNodeOffset *childOffsets = NULL;
+		bool		hasPooled = false;
+		unsigned int tailSize;
+		unsigned short i;
+
+		if (compNode->children > 0)
+		{
+			childOffsets = (XMLNodeOffset *) palloc(compNode->children * sizeof(XMLNodeOffset));
+		}
+		for (i = 0; i < compNode->children; i++)
+		{
+			XMLNodeHdr	child = (XMLNodeHdr) ((char *) compNode - readXMLNodeOffset(&refPtr, bwidth, true));
+			XMLNodeHdr	childNew;
+
+			childOffsets[i] = writeXMLNodeTree(child, output, cursor, pool);
+			childNew = (XMLNodeHdr) (output + childOffsets[i]);
+			if (childNew->flags & (XNODE_STR_POOLED | XNODE_HAS_POOLED))
+			{
+				hasPooled = true;
+			}
+		}
+
+		result = *cursor - output;
+		compNodeNew = (XMLCompNodeHdr) *cursor;
+		memcpy(compNodeNew, compNode, sizeof(XMLCompNodeHdrData));
+		compNodeNew->common.flags &= ~XNODE_HAS_POOLED;
+		if (hasPooled)
+		{
+			compNodeNew->common.flags |= XNODE_HAS_POOLED;
+		}
+
+		refPtrNew = XNODE_FIRST_REF(compNodeNew);
+		for (i = 0; i < compNode->children; i++)
+		{
+			Assert(getXMLNodeOffsetByteWidth(result - childOffsets[i]) <= bwidth);
+			writeXMLNodeOffset(result - childOffsets[i], &refPtrNew, bwidth, true);
+		}
+
+		/* Kinds of the children and element name / XML declaration. */
+		tailSize = (char *) compNode + getXMLNodeSize(node, false) - XNODE_CHILD_KINDS(compNode);
+		memcpy(refPtrNew, XNODE_CHILD_KINDS(compNode), tailSize);
+		*cursor = refPtrNew + tailSize;
+
+		if (childOffsets != NULL)
+		{
+			pfree(childOffsets);
+		}
+	}
+	else if (node->kind == XMLNODE_ATTRIBUTE || node->kind == XMLNODE_TEXT)
+	{
+		XMLNodeHdr	nodeNew = (XMLNodeHdr) *cursor;
+		unsigned int prefixLen = sizeof(XMLNodeHdrData);
+		char	   *str;
+		XMLPoolEntry *entry = NULL;
+
+		if (node->kind == XMLNODE_ATTRIBUTE)
+		{
+			prefixLen += strlen(XNODE_CONTENT(node)) + 1;
+			str = XNODE_ATTR_VALUE(node);
+		}
+		else
+		{
+			str = XNODE_TEXT(node);
+		}
+		if (pool != NULL && strlen(str) >= XNODE_POOL_MIN_STRING)
+		{
+			entry = getXMLPoolEntry(pool, str, false);
+		}
+
+		result = *cursor - output;
+		memcpy(*cursor, node, prefixLen);
+		*cursor += prefixLen;
+		nodeNew->flags &= ~XNODE_STR_POOLED;
+		if (entry != NULL && entry->pooled)
+		{
+			nodeNew->flags |= XNODE_STR_POOLED;
+			writeXMLNodeOffset((*cursor - output) - entry->offset, cursor, XNODE_POOL_REF_SIZE, true);
+		}
+		else
+		{
+			unsigned int len = strlen(str) + 1;
+
+			memcpy(*cursor, str, len);
+			*cursor += len;
+		}
+
+		if (XNODE_IS_NUMBER(node))
+		{
+			double		numValue = getXMLNodeNumValue(node);
+
+			memcpy(*cursor, &numValue, sizeof(double));
+			*cursor += sizeof(double);
+		}
+	}
+	else
+	{
+		unsigned int size = getXMLNodeSize(node, false);
+
+		result = *cursor - output;
+		memcpy(*cursor, node, size);
+		*cursor += size;
+	}
+	return result;
+}
@@ -76,6 +76,10 @@ xmlnodePop(XMLNodeContainer cont)
  * Return binary size of a node.
  *
  * 'node' the node to be examined 'subtree' consider subtree (if exists)?
+ *
+ * Strings stored in the document's string pool are counted as if they were
+ * stored in the node, so the result is the size of the node's copy (see
+ * copyXMLNode()).
  */
 unsigned int
 getXMLNodeSize(XMLNodeHdr node, bool subtree)
@@ -90,23 +94,33 @@ getXMLNodeSize(XMLNodeHdr node, bool subtree)
 		case XMLNODE_ELEMENT:
 		case XMLNODE_DOC_FRAGMENT:
 			{
-				char	   *childOffPtr = XNODE_FIRST_REF((XMLCompNodeHdr) node);
 				unsigned int children = ((XMLCompNodeHdr) node)->children;
 				char		bwidth = XNODE_GET_REF_BWIDTH((XMLCompNodeHdr) node);
-				unsigned int i;
 
 				result = sizeof(XMLCompNodeHdrData);
 				if (subtree)
 				{
-					for (i = 0; i < children; i++)
+					if (node->flags & XNODE_HAS_POOLED)
 					{
-						XMLNodeOffset childOff = readXMLNodeOffset(&childOffPtr, bwidth, true);
-						XMLNodeHdr	childNode = (XMLNodeHdr) ((char *) node - childOff);
-
-						result += getXMLNodeSize(childNode, true);
+						char	   *refPtr = XNODE_FIRST_REF((XMLCompNodeHdr) node);
+						unsigned int i;
+						XMLNodeOffset ref;
+
+						XNODE_FOREACH_REF(refPtr, bwidth, children, i, ref,
+						{
+							result += getXMLNodeSize((XMLNodeHdr) ((char *) node - ref), true);
+						});
+					}
+					else
+					{
+						/*
+						 * The descendants are stored contiguously, right
+						 * before the node. No need to visit each of them.
+						 */
+						result += (char *) node - (char *) getFirstXMLNodeLeaf((XMLCompNodeHdr) node);
 					}
 				}
-				result += children * bwidth;
+				result += XNODE_REFS_SIZE(children, bwidth);
 
 				if (node->kind == XMLNODE_ELEMENT)
 				{
@@ -129,13 +143,14 @@ getXMLNodeSize(XMLNodeHdr node, bool subtree)
 		case XMLNODE_TEXT:
 			result = sizeof(XMLNodeHdrData);
 			content = (char *) node + result;
-			result += strlen(content) + 1;
+			result += strlen(XNODE_STRING(node, content)) + 1;
 
 			if (node->kind == XMLNODE_PI && (node->flags & XNODE_PI_HAS_VALUE))
 			{
 				content += strlen(content) + 1;
 				result += strlen(content) + 1;
 			}
+			result += XNODE_NUM_VALUE_SIZE(node);
 			return result;
 
 		case XMLNODE_ATTRIBUTE:
@@ -144,7 +159,8 @@ getXMLNodeSize(XMLNodeHdr node, bool subtree)
 			attNameLen = strlen(content) + 1;
 			result += attNameLen;
 			content += attNameLen;
-			result += strlen(content) + 1;
+			result += strlen(XNODE_STRING(node, content)) + 1;
+			result += XNODE_NUM_VALUE_SIZE(node);
 			return result;
 
 		default:
@@ -212,6 +228,9 @@ getXMLNodeKindStr(XMLNodeKind k)
  *
  * 'root' - at which position of the returned subtree its root element
  * is located. If 'xmlnode' is true, VARHDRSZ is *not* included in this offset.
+ *
+ * Strings that 'node' has in the document's string pool are copied into the
+ * nodes, so the copy is valid outside the document.
  */
 char *
 copyXMLNode(XMLNodeHdr node, char *target, bool xmlnode, XMLNodeOffset * root)
@@ -226,6 +245,11 @@ copyXMLNode(XMLNodeHdr node, char *target, bool xmlnode, XMLNodeOffset * root)
 				resultLength;
 	XMLNodeOffset *offPtr;
 
+	if (node->flags & (XNODE_STR_POOLED | XNODE_HAS_POOLED))
+	{
+		return copyXMLNodeUnpooled(node, target, xmlnode, root);
+	}
+
 	start = NULL;
 	if (node->kind == XMLNODE_ELEMENT || node->kind == XMLNODE_DOC || node->kind == XMLNODE_DOC_FRAGMENT)
 	{
@@ -297,6 +321,8 @@ copyXMLNode(XMLNodeHdr node, char *target, bool xmlnode, XMLNodeOffset * root)
 		start = (char *) node;
 	}
 
+	cntLen += XNODE_NUM_VALUE_SIZE(node);
+
 	if (root != NULL)
 	{
 		*root = (char *) node - start;
@@ -310,7 +336,7 @@ copyXMLNode(XMLNodeHdr node, char *target, bool xmlnode, XMLNodeOffset * root)
 		result = (target != NULL) ? target : (char *) palloc(resultLength);
 		data = VARDATA(result);
 		offPtr = (XMLNodeOffset *) (result + resultLength - sizeof(XMLNodeOffset));
-		*offPtr = (char *) node - start;
+		XNODE_SET_ROOT_OFFSET(offPtr, (char *) node - start);
 		memcpy(data, start, dataLength - sizeof(XMLNodeOffset));
 		SET_VARSIZE(result, resultLength);
 		return result;
@@ -580,7 +606,7 @@ getElementNodeStr(XMLCompNodeHdr element)
 
 	while ((textNode = getNextXMLNode(&textScan, false)) != NULL)
 	{
-		char	   *cntPart = XNODE_CONTENT(textNode);
+		char	   *cntPart = XNODE_TEXT(textNode);
 
 		appendStringInfoString(&si, cntPart);
 	}
@@ -602,16 +628,13 @@ getNonElementNodeStr(XMLNodeHdr node)
 	switch (node->kind)
 	{
 		case XMLNODE_ATTRIBUTE:
-			{
-				char	   *attName = XNODE_CONTENT(node);
-				char	   *attValue = attName + strlen(attName) + 1;
+			return XNODE_ATTR_VALUE(node);
 
-				return attValue;
-			}
+		case XMLNODE_TEXT:
+			return XNODE_TEXT(node);
 
 		case XMLNODE_COMMENT:
 		case XMLNODE_CDATA:
-		case XMLNODE_TEXT:
 			return XNODE_CONTENT(node);
 
 		case XMLNODE_PI:
@@ -20,6 +20,7 @@ extern XMLNodeOffset xmlnodePop(XMLNodeContainer stack);
 extern unsigned int getXMLNodeSize(XMLNodeHdr node, bool subtree);
 extern char *getXMLNodeKindStr(XMLNodeKind k);
 extern char *copyXMLNode(XMLNodeHdr node, char *target, bool xmlnode, XMLNodeOffset * root);
+extern char *copyXMLNodeUnpooled(XMLNodeHdr node, char *target, bool xmlnode, XMLNodeOffset * root);
 extern char **copyXMLDocFragment(XMLCompNodeHdr fragNode, char **resCursorPtr);
 extern void copyXMLNodeOrDocFragment(XMLNodeHdr newNode, unsigned int newNdSize, char **resCursor,
 						 char **newNdRoot, char ***newNdRoots);
@@ -0,0 +1,675 @@
+-- The binary format of node, doc and pathval values has changed. Values stored
+-- by 0.6.1 can't be converted by SQL and the new library rejects them, so the
+-- upgrade is refused as long as they're stored in any table. Such columns need
+-- to be converted to text before the upgrade and back to the original type
+-- afterwards.
+DO $$
+DECLARE
+	col	record;
+BEGIN
+	SELECT a.attrelid::regclass AS rel, a.attname INTO col
+	FROM pg_attribute a
+	JOIN pg_type t ON t.oid = a.atttypid
+	WHERE NOT a.attisdropped AND a.attnum > 0 AND
+		(t.oid IN ('@extschema@.node'::regtype, '@extschema@.doc'::regtype, '@extschema@.pathval'::regtype) OR
+		t.typelem IN ('@extschema@.node'::regtype, '@extschema@.doc'::regtype, '@extschema@.pathval'::regtype))
+	LIMIT 1;
+	IF FOUND THEN
+		RAISE EXCEPTION 'column "%" of "%" contains values in the binary format of version 0.6.1',
+			col.attname, col.rel
+			USING HINT = 'Convert the column to text before the upgrade.';
+	END IF;
+END
+$$;
+
+-- Parse document stored as binary string or large object. Unlike doc_in(), the
+-- input encoding is taken from the XML declaration.
+CREATE FUNCTION doc_parse(bytea) RETURNS doc
+	as 'MODULE_PATHNAME', 'xmldoc_parse'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION doc_parse_lo(oid) RETURNS doc
+	as 'MODULE_PATHNAME', 'xmldoc_parse_lo'
+	LANGUAGE C
+	VOLATILE
+	STRICT;
+
+-- If the second argument is true, white space that only separates markup is
+-- not stored (unless xml:space="preserve" applies).
+CREATE FUNCTION doc_parse(text, bool) RETURNS doc
+	as 'MODULE_PATHNAME', 'xmldoc_parse_text'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+-- Text representation of a document, indented by the given number of spaces
+-- per level.
+CREATE FUNCTION doc_indent(doc, int4) RETURNS text
+	as 'MODULE_PATHNAME', 'xmldoc_indent'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+
+-- Parse document passed in pieces, e.g. doc_from_chunks(chunk ORDER BY seq).
+CREATE FUNCTION doc_chunk_add(internal, text) RETURNS internal
+	as 'MODULE_PATHNAME', 'xmldoc_chunk_add'
+	LANGUAGE C
+	IMMUTABLE;
+
+CREATE FUNCTION doc_from_chunks_final(internal) RETURNS doc
+	as 'MODULE_PATHNAME', 'xmldoc_from_chunks_final'
+	LANGUAGE C
+	IMMUTABLE;
+
+CREATE AGGREGATE doc_from_chunks(text) (
+	SFUNC = doc_chunk_add,
+	STYPE = internal,
+	FINALFUNC = doc_from_chunks_final
+);
+
+
+-- Comparison and hashing. Attribute order and value delimiters are ignored.
+
+CREATE FUNCTION node_lt(node, node) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_lt'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION node_le(node, node) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_le'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION node_eq(node, node) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_eq'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION node_ne(node, node) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_ne'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION node_ge(node, node) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_ge'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION node_gt(node, node) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_gt'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION node_cmp(node, node) RETURNS int4
+	as 'MODULE_PATHNAME', 'xmlnode_cmp'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION node_hash(node) RETURNS int4
+	as 'MODULE_PATHNAME', 'xmlnode_hash'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION node_hash64(node) RETURNS int8
+	as 'MODULE_PATHNAME', 'xmlnode_hash64'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE OPERATOR < (
+	leftarg = node,
+	rightarg = node,
+	procedure = node_lt,
+	commutator = >,
+	negator = >=,
+	restrict = scalarltsel,
+	join = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+	leftarg = node,
+	rightarg = node,
+	procedure = node_le,
+	commutator = >=,
+	negator = >,
+	restrict = scalarltsel,
+	join = scalarltjoinsel
+);
+
+CREATE OPERATOR = (
+	leftarg = node,
+	rightarg = node,
+	procedure = node_eq,
+	commutator = =,
+	negator = <>,
+	HASHES,
+	MERGES,
+	restrict = eqsel,
+	join = eqjoinsel
+);
+
+CREATE OPERATOR <> (
+	leftarg = node,
+	rightarg = node,
+	procedure = node_ne,
+	commutator = <>,
+	negator = =,
+	restrict = neqsel,
+	join = neqjoinsel
+);
+
+CREATE OPERATOR >= (
+	leftarg = node,
+	rightarg = node,
+	procedure = node_ge,
+	commutator = <=,
+	negator = <,
+	restrict = scalargtsel,
+	join = scalargtjoinsel
+);
+
+CREATE OPERATOR > (
+	leftarg = node,
+	rightarg = node,
+	procedure = node_gt,
+	commutator = <,
+	negator = <=,
+	restrict = scalargtsel,
+	join = scalargtjoinsel
+);
+
+CREATE OPERATOR CLASS node_ops
+	DEFAULT FOR TYPE node USING btree AS
+		OPERATOR	1	<,
+		OPERATOR	2	<=,
+		OPERATOR	3	=,
+		OPERATOR	4	>=,
+		OPERATOR	5	>,
+		FUNCTION	1	node_cmp(node, node);
+
+CREATE OPERATOR CLASS node_hash_ops
+	DEFAULT FOR TYPE node USING hash AS
+		OPERATOR	1	=,
+		FUNCTION	1	node_hash(node);
+
+CREATE FUNCTION doc_lt(doc, doc) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_lt'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION doc_le(doc, doc) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_le'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION doc_eq(doc, doc) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_eq'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION doc_ne(doc, doc) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_ne'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION doc_ge(doc, doc) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_ge'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION doc_gt(doc, doc) RETURNS bool
+	as 'MODULE_PATHNAME', 'xmlnode_gt'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION doc_cmp(doc, doc) RETURNS int4
+	as 'MODULE_PATHNAME', 'xmlnode_cmp'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION doc_hash(doc) RETURNS int4
+	as 'MODULE_PATHNAME', 'xmlnode_hash'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION doc_hash64(doc) RETURNS int8
+	as 'MODULE_PATHNAME', 'xmlnode_hash64'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE OPERATOR < (
+	leftarg = doc,
+	rightarg = doc,
+	procedure = doc_lt,
+	commutator = >,
+	negator = >=,
+	restrict = scalarltsel,
+	join = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+	leftarg = doc,
+	rightarg = doc,
+	procedure = doc_le,
+	commutator = >=,
+	negator = >,
+	restrict = scalarltsel,
+	join = scalarltjoinsel
+);
+
+CREATE OPERATOR = (
+	leftarg = doc,
+	rightarg = doc,
+	procedure = doc_eq,
+	commutator = =,
+	negator = <>,
+	HASHES,
+	MERGES,
+	restrict = eqsel,
+	join = eqjoinsel
+);
+
+CREATE OPERATOR <> (
+	leftarg = doc,
+	rightarg = doc,
+	procedure = doc_ne,
+	commutator = <>,
+	negator = =,
+	restrict = neqsel,
+	join = neqjoinsel
+);
+
+CREATE OPERATOR >= (
+	leftarg = doc,
+	rightarg = doc,
+	procedure = doc_ge,
+	commutator = <=,
+	negator = <,
+	restrict = scalargtsel,
+	join = scalargtjoinsel
+);
+
+CREATE OPERATOR > (
+	leftarg = doc,
+	rightarg = doc,
+	procedure = doc_gt,
+	commutator = <,
+	negator = <=,
+	restrict = scalargtsel,
+	join = scalargtjoinsel
+);
+
+CREATE OPERATOR CLASS doc_ops
+	DEFAULT FOR TYPE doc USING btree AS
+		OPERATOR	1	<,
+		OPERATOR	2	<=,
+		OPERATOR	3	=,
+		OPERATOR	4	>=,
+		OPERATOR	5	>,
+		FUNCTION	1	doc_cmp(doc, doc);
+
+CREATE OPERATOR CLASS doc_hash_ops
+	DEFAULT FOR TYPE doc USING hash AS
+		OPERATOR	1	=,
+		FUNCTION	1	doc_hash(doc);
+
+ALTER FUNCTION path(@extschema@.path, doc) IMMUTABLE;
+
+ALTER FUNCTION @extschema@.path(@extschema@.path, @extschema@.path[], doc) IMMUTABLE;
+
+CREATE FUNCTION @extschema@.table(@extschema@.path, @extschema@.path[], doc)
+	RETURNS SETOF record
+	as 'MODULE_PATHNAME', 'xpath_table'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION paths(@extschema@.path[], doc)
+	RETURNS pathval[]
+	as 'MODULE_PATHNAME', 'xpath_multi'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION path_exists(@extschema@.path, doc)
+	RETURNS bool
+	as 'MODULE_PATHNAME', 'xpath_exists'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION doc_path_exists(doc, @extschema@.path)
+	RETURNS bool
+	as 'MODULE_PATHNAME', 'xmldoc_path_exists'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION path_exists_sel(internal, oid, internal, integer)
+	RETURNS float8
+	as 'MODULE_PATHNAME', 'xpath_exists_sel'
+	LANGUAGE C
+	STABLE
+	STRICT;
+
+CREATE OPERATOR @? (
+	leftarg = doc,
+	rightarg = @extschema@.path,
+	procedure = doc_path_exists,
+	restrict = path_exists_sel,
+	join = contjoinsel
+);
+
+ALTER FUNCTION children(node) IMMUTABLE;
+
+
+-- Reference to a node, i.e. position of the node within containing node /
+-- document. The containing node / document is passed to the functions
+-- separately, so that any number of references can share a single copy of it.
+CREATE FUNCTION noderef_in(cstring) RETURNS noderef
+	as 'MODULE_PATHNAME', 'xmlnoderef_in'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION noderef_out(noderef) RETURNS cstring
+	as 'MODULE_PATHNAME', 'xmlnoderef_out'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE TYPE noderef (
+	internallength = 4,
+	input = noderef_in,
+	output = noderef_out,
+	passedbyvalue,
+	alignment = int4
+);
+
+CREATE FUNCTION ref(node) RETURNS noderef
+	as 'MODULE_PATHNAME', 'xmlnode_to_ref'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION ref(doc) RETURNS noderef
+	as 'MODULE_PATHNAME', 'xmlnode_to_ref'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION deref(node, noderef) RETURNS node
+	as 'MODULE_PATHNAME', 'xmlnoderef_deref'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION deref(doc, noderef) RETURNS node
+	as 'MODULE_PATHNAME', 'xmlnoderef_deref'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION child_refs(node, noderef)
+	RETURNS noderef[]
+	as 'MODULE_PATHNAME', 'xmlnoderef_children'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION child_refs(doc, noderef)
+	RETURNS noderef[]
+	as 'MODULE_PATHNAME', 'xmlnoderef_children'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION parent(node, noderef) RETURNS noderef
+	as 'MODULE_PATHNAME', 'xmlnoderef_parent'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION parent(doc, noderef) RETURNS noderef
+	as 'MODULE_PATHNAME', 'xmlnoderef_parent'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION next_sibling(node, noderef) RETURNS noderef
+	as 'MODULE_PATHNAME', 'xmlnoderef_next_sibling'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION next_sibling(doc, noderef) RETURNS noderef
+	as 'MODULE_PATHNAME', 'xmlnoderef_next_sibling'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION first_child(node, noderef) RETURNS noderef
+	as 'MODULE_PATHNAME', 'xmlnoderef_first_child'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION first_child(doc, noderef) RETURNS noderef
+	as 'MODULE_PATHNAME', 'xmlnoderef_first_child'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION descendants(node, noderef) RETURNS SETOF noderef
+	as 'MODULE_PATHNAME', 'xmlnoderef_descendants'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION descendants(doc, noderef) RETURNS SETOF noderef
+	as 'MODULE_PATHNAME', 'xmlnoderef_descendants'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+-- Like path() but returns references to the nodes found instead of the nodes.
+CREATE FUNCTION path_refs(@extschema@.path, doc)
+	RETURNS noderef[]
+	as 'MODULE_PATHNAME', 'xpath_refs'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+ALTER FUNCTION element(text, text[][2], node) IMMUTABLE;
+
+CREATE FUNCTION element(text, text[][2], VARIADIC node[])
+	RETURNS node
+	as 'MODULE_PATHNAME', 'xmlelement_variadic'
+	LANGUAGE C
+	IMMUTABLE;
+
+CREATE FUNCTION fragment_add(internal, node) RETURNS internal
+	as 'MODULE_PATHNAME', 'xmlnode_fragment_add'
+	LANGUAGE C
+	IMMUTABLE;
+
+CREATE FUNCTION fragment_final(internal) RETURNS node
+	as 'MODULE_PATHNAME', 'xmlnode_fragment_final'
+	LANGUAGE C
+	IMMUTABLE;
+
+CREATE FUNCTION fragment_combine(internal, internal) RETURNS internal
+	as 'MODULE_PATHNAME', 'xmlnode_fragment_combine'
+	LANGUAGE C
+	IMMUTABLE;
+
+CREATE FUNCTION fragment_serialize(internal) RETURNS bytea
+	as 'MODULE_PATHNAME', 'xmlnode_fragment_serialize'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+CREATE FUNCTION fragment_deserialize(bytea, internal) RETURNS internal
+	as 'MODULE_PATHNAME', 'xmlnode_fragment_deserialize'
+	LANGUAGE C
+	IMMUTABLE
+	STRICT;
+
+-- Servers that support parallel aggregation get a different definition, see the end of the
+-- script.
+CREATE AGGREGATE fragment_agg(node) (
+	SFUNC = fragment_add,
+	STYPE = internal,
+	FINALFUNC = fragment_final
+);
+
+ALTER FUNCTION add(doc, @extschema@.path, node, add_mode) IMMUTABLE;
+
+ALTER FUNCTION remove(doc, @extschema@.path) IMMUTABLE;
+
+
+-- Parallel safety. The functions listed are free of side effects. Some of them
+-- depend on backend-local state, but not in a way that would make them unsafe:
+--
+-- * The result of doc_in(), doc_parse(), add(), etc. depends on xnode.* settings
+--   (string pool, split layout, fillfactor). Parallel workers receive all the
+--   settings of the leader when they start and the settings can't be changed
+--   during parallel execution, so the workers produce the same values.
+--
+-- * XPath evaluation and navigation use the document cache. Each worker has its
+--   own cache, the leader never sees its contents, and the result doesn't
+--   depend on whether the document was found in the cache.
+--
+-- doc_parse_lo() is only PARALLEL RESTRICTED since it opens large object,
+-- whose descriptor is local to the backend that opened it. path_exists_sel()
+-- is only called by the planner. PARALLEL clause is not recognized by servers
+-- older than 9.6, hence the conditional ALTER.
+--
+-- A function added to the extension has to be classified here explicitly. This
+-- must stay at the end of the script so that all the functions exist.
+DO $$
+DECLARE
+	f	regprocedure;
+BEGIN
+	IF current_setting('server_version_num')::int >= 90600 THEN
+		FOREACH f IN ARRAY ARRAY[
+			-- Input / output, casts and debugging.
+			'@extschema@.node_in(cstring)',
+			'@extschema@.node_out(node)',
+			'@extschema@.node_kind(node)',
+			'@extschema@.node_debug_print(node)',
+			'@extschema@.doc_in(cstring)',
+			'@extschema@.doc_out(doc)',
+			'@extschema@.path_in(cstring)',
+			'@extschema@.path_out(@extschema@.path)',
+			'@extschema@.path_debug_print(@extschema@.path)',
+			'@extschema@.pathval_in(cstring)',
+			'@extschema@.pathval_out(pathval)',
+			'@extschema@.node_to_doc(node)',
+			'@extschema@.doc_to_node(doc)',
+			'@extschema@.pathval_to_bool(pathval)',
+			'@extschema@.pathval_to_float8(pathval)',
+			'@extschema@.pathval_to_numeric(pathval)',
+			'@extschema@.pathval_to_int4(pathval)',
+			'@extschema@.pathval_to_node(pathval)',
+			'@extschema@.noderef_in(cstring)',
+			'@extschema@.noderef_out(noderef)',
+			-- Parsing and formatting.
+			'@extschema@.doc_parse(bytea)',
+			'@extschema@.doc_parse(text, bool)',
+			'@extschema@.doc_indent(doc, int4)',
+			'@extschema@.doc_chunk_add(internal, text)',
+			'@extschema@.doc_from_chunks_final(internal)',
+			-- Comparison and hashing.
+			'@extschema@.node_lt(node, node)',
+			'@extschema@.node_le(node, node)',
+			'@extschema@.node_eq(node, node)',
+			'@extschema@.node_ne(node, node)',
+			'@extschema@.node_ge(node, node)',
+			'@extschema@.node_gt(node, node)',
+			'@extschema@.node_cmp(node, node)',
+			'@extschema@.node_hash(node)',
+			'@extschema@.node_hash64(node)',
+			'@extschema@.doc_lt(doc, doc)',
+			'@extschema@.doc_le(doc, doc)',
+			'@extschema@.doc_eq(doc, doc)',
+			'@extschema@.doc_ne(doc, doc)',
+			'@extschema@.doc_ge(doc, doc)',
+			'@extschema@.doc_gt(doc, doc)',
+			'@extschema@.doc_cmp(doc, doc)',
+			'@extschema@.doc_hash(doc)',
+			'@extschema@.doc_hash64(doc)',
+			-- XPath evaluation and navigation.
+			'@extschema@.path(@extschema@.path, doc)',
+			'@extschema@.path(@extschema@.path, @extschema@.path[], doc)',
+			'@extschema@.table(@extschema@.path, @extschema@.path[], doc)',
+			'@extschema@.paths(@extschema@.path[], doc)',
+			'@extschema@.path_exists(@extschema@.path, doc)',
+			'@extschema@.doc_path_exists(doc, @extschema@.path)',
+			'@extschema@.path_refs(@extschema@.path, doc)',
+			'@extschema@.children(node)',
+			'@extschema@.ref(node)',
+			'@extschema@.ref(doc)',
+			'@extschema@.deref(node, noderef)',
+			'@extschema@.deref(doc, noderef)',
+			'@extschema@.child_refs(node, noderef)',
+			'@extschema@.child_refs(doc, noderef)',
+			'@extschema@.parent(node, noderef)',
+			'@extschema@.parent(doc, noderef)',
+			'@extschema@.next_sibling(node, noderef)',
+			'@extschema@.next_sibling(doc, noderef)',
+			'@extschema@.first_child(node, noderef)',
+			'@extschema@.first_child(doc, noderef)',
+			'@extschema@.descendants(node, noderef)',
+			'@extschema@.descendants(doc, noderef)',
+			-- Construction and modification.
+			'@extschema@.element(text, text[], node)',
+			'@extschema@.element(text, text[], node[])',
+			'@extschema@.fragment_add(internal, node)',
+			'@extschema@.fragment_final(internal)',
+			'@extschema@.fragment_combine(internal, internal)',
+			'@extschema@.fragment_serialize(internal)',
+			'@extschema@.fragment_deserialize(bytea, internal)',
+			'@extschema@.add(doc, @extschema@.path, node, add_mode)',
+			'@extschema@.remove(doc, @extschema@.path)'
+		]::regprocedure[]
+		LOOP
+			EXECUTE 'ALTER FUNCTION ' || f::text || ' PARALLEL SAFE';
+		END LOOP;
+
+		EXECUTE 'ALTER FUNCTION @extschema@.doc_parse_lo(oid) PARALLEL RESTRICTED';
+
+		-- Aggregate options can't be changed by ALTER AGGREGATE.
+		DROP AGGREGATE @extschema@.fragment_agg(@extschema@.node);
+		CREATE AGGREGATE @extschema@.fragment_agg(@extschema@.node) (
+			SFUNC = @extschema@.fragment_add,
+			STYPE = internal,
+			FINALFUNC = @extschema@.fragment_final,
+			COMBINEFUNC = @extschema@.fragment_combine,
+			SERIALFUNC = @extschema@.fragment_serialize,
+			DESERIALFUNC = @extschema@.fragment_deserialize,
+			PARALLEL = SAFE
+		);
+	END IF;
+END
+$$;
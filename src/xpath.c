@@ -5,10 +5,14 @@
 #include "postgres.h"
 #include "fmgr.h"
 #include "funcapi.h"
+#include "access/htup.h"
+#include "catalog/pg_statistic.h"
 #include "catalog/pg_type.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
+#include "utils/selfuncs.h"
+#include "utils/syscache.h"
 
 #include "xmlnode.h"
 #include "xpath.h"
@@ -17,9 +21,59 @@
 
 static void retrieveColumnPaths(XMLScanContext xScanCtx, ArrayType *pathsColArr, int columns);
 static ArrayType *getResultArray(XMLScanContext ctx, XMLNodeOffset baseNodeOff);
+static HeapTuple getResultTuple(XMLScanContext ctx, XMLNodeOffset baseNodeOff);
+static Datum getColumnValue(XMLScanContext ctx, unsigned short colNr, XPathExprState exprState,
+			   XPathExprOperandValue res, bool *isNull);
+static XMLScanContext initXMLScanContext(xpath xpathBasePtr, ArrayType *pathsColArr, xmldoc doc);
+static void finalizeXMLScanContext(XMLScanContext xScanCtx);
 static xpathval getXPathExprValue(XPathExprState exprState, xmldoc document, bool *notNull,
 				  XPathExprOperandValue res);
 static char *getBoolValueString(bool value);
+static bool xpathExists(xpath xpathIn, xmldoc doc);
+
+/*
+ * Prefix tree of location paths evaluated by xml.paths(). Each node
+ * represents a sequence of element steps shared by one or more paths. The
+ * root node stands for the document node.
+ */
+typedef struct XPathStepTrieData
+{
+	/* Name test of the step leading to this node (NULL for the root). */
+	char	   *name;
+
+	struct XPathStepTrieData *firstChild;
+	struct XPathStepTrieData *nextSibling;
+
+	/*
+	 * Paths whose last step is to be tested on children of the elements this
+	 * node matches.
+	 */
+	unsigned int *paths;
+	unsigned int npaths;
+	unsigned int pathsMax;
+}	XPathStepTrieData;
+
+typedef struct XPathStepTrieData *XPathStepTrie;
+
+/*
+ * Matching nodes collected by the shared scan, one list per path.
+ */
+typedef struct XPathMultiScanData
+{
+	XPath	   *paths;
+	XMLNodeHdr **matches;
+	unsigned int *counts;
+	unsigned int *sizes;
+}	XPathMultiScanData;
+
+typedef struct XPathMultiScanData *XPathMultiScan;
+
+static bool isSharedScanPath(XPath path);
+static void addPathToTrie(XPathStepTrie root, XPath path, unsigned int pathNr);
+static void scanForPaths(XMLCompNodeHdr element, XPathStepTrie trieNode, XPathMultiScan mscan);
+static bool matchLastStep(XPath path, XMLNodeHdr node);
+static xpathval getNodeSetValue(XPathExpression expr, xmldoc doc, XMLNodeHdr * nodes, unsigned int count,
+				bool *notNull);
 
 
 /* The order must follow XPathValueType */
@@ -207,14 +261,23 @@ xpath_debug_print(PG_FUNCTION_ARGS)
 	PG_RETURN_TEXT_P(cstring_to_text(output.data));
 }
 
+/*
+ * Returns location path if 'expr' consists of nothing but a single absolute
+ * location path (possibly enclosed in round brackets). Otherwise ERROR is
+ * raised or, if 'missingOk' is true, NULL is returned.
+ */
 XPath
-getSingleXPath(XPathExpression expr, XPathHeader xpHdr)
+getSingleXPath(XPathExpression expr, XPathHeader xpHdr, bool missingOk)
 {
 	XPathExprOperand operand;
 	XPath		path;
 
 	if (expr->members != 1 || expr->npaths == 0)
 	{
+		if (missingOk)
+		{
+			return NULL;
+		}
 		elog(ERROR, "xpath expression can't be used as a base path");
 	}
 
@@ -231,12 +294,20 @@ getSingleXPath(XPathExpression expr, XPathHeader xpHdr)
 
 	if (operand->type != XPATH_OPERAND_PATH || expr->members != 1)
 	{
+		if (missingOk)
+		{
+			return NULL;
+		}
 		elog(ERROR, "xpath expression can't be used as a base path");
 	}
 	path = XPATH_HDR_GET_PATH(xpHdr, operand->value.v.path);
 
 	if (path->relative)
 	{
+		if (missingOk)
+		{
+			return NULL;
+		}
 		elog(ERROR, "base XPath must be absolute");
 	}
 	return path;
@@ -252,7 +323,7 @@ xpath_single(PG_FUNCTION_ARGS)
 	XPathExpression expr = (XPathExpression) VARDATA(xpathIn);
 	XPathExprState exprState;
 	XPathHeader xpHdr = (XPathHeader) ((char *) expr + expr->size);
-	xmldoc		doc = (xmldoc) PG_GETARG_VARLENA_P(1);
+	xmldoc		doc = detoastXMLDocCached(PG_GETARG_DATUM(1));
 	bool		notNull;
 	xpathval	result;
 	XPathExprOperandValueData resData;
@@ -276,13 +347,351 @@ xpath_single(PG_FUNCTION_ARGS)
 	}
 }
 
+/*
+ * Like xpath_single() but the node-set is returned as array of references
+ * to the nodes (see 'noderef' type), so no subtree has to be copied. The
+ * references point to 'doc' itself.
+ */
+PG_FUNCTION_INFO_V1(xpath_refs);
+
+Datum
+xpath_refs(PG_FUNCTION_ARGS)
+{
+	xpath		xpathIn = (xpath) PG_GETARG_POINTER(0);
+	XPathExpression expr = (XPathExpression) VARDATA(xpathIn);
+	XPathExprState exprState;
+	XPathHeader xpHdr = (XPathHeader) ((char *) expr + expr->size);
+	xmldoc		doc = detoastXMLDocCached(PG_GETARG_DATUM(1));
+	char	   *docData = VARDATA(doc);
+	Oid		   *refType;
+	XPathExprOperandValueData resData;
+	Datum	   *refs = NULL;
+	unsigned int count = 0;
+	ArrayType  *result;
+
+	/* Element type of the result, looked up only once per call site. */
+	refType = (Oid *) fcinfo->flinfo->fn_extra;
+	if (refType == NULL)
+	{
+		refType = (Oid *) MemoryContextAlloc(fcinfo->flinfo->fn_mcxt, sizeof(Oid));
+		*refType = get_element_type(get_func_rettype(fcinfo->flinfo->fn_oid));
+		fcinfo->flinfo->fn_extra = refType;
+	}
+
+	if (!expr->mainExprAbs)
+	{
+		elog(ERROR, "neither relative paths nor attributes expected in main expression");
+	}
+	exprState = prepareXPathExpression(expr, (XMLCompNodeHdr) XNODE_ROOT(doc), doc, xpHdr, NULL);
+	evaluateXPathExpression(exprState, exprState->expr, NULL, (XMLCompNodeHdr) XNODE_ROOT(doc), 0, &resData);
+	if (resData.type != XPATH_VAL_NODESET)
+	{
+		elog(ERROR, "xpath expression must return a node-set");
+	}
+
+	if (!resData.isNull)
+	{
+		if (resData.v.nodeSet.isDocument)
+		{
+			count = 1;
+			refs = (Datum *) palloc(sizeof(Datum));
+			refs[0] = XNodeRefGetDatum(XNODE_ROOT_OFFSET(doc));
+		}
+		else if (resData.v.nodeSet.count == 1)
+		{
+			XMLNodeHdr	node = (XMLNodeHdr) getXPathOperandValue(exprState, resData.v.nodeSet.nodes.nodeId,
+													  XPATH_VAR_NODE_SINGLE);
+
+			count = 1;
+			refs = (Datum *) palloc(sizeof(Datum));
+			refs[0] = XNodeRefGetDatum((char *) node - docData);
+		}
+		else if (resData.v.nodeSet.count > 1)
+		{
+			XMLNodeHdr *nodes = (XMLNodeHdr *) getXPathOperandValue(exprState, resData.v.nodeSet.nodes.arrayId,
+														   XPATH_VAR_NODE_ARRAY);
+			unsigned int i;
+
+			count = resData.v.nodeSet.count;
+			refs = (Datum *) palloc(count * sizeof(Datum));
+			for (i = 0; i < count; i++)
+			{
+				refs[i] = XNodeRefGetDatum((char *) nodes[i] - docData);
+			}
+		}
+	}
+	freeExpressionState(exprState);
+
+	if (count == 0)
+	{
+		PG_RETURN_POINTER(construct_empty_array(*refType));
+	}
+	result = construct_array(refs, count, *refType, sizeof(XMLNodeRef), true, 'i');
+	pfree(refs);
+	PG_RETURN_POINTER(result);
+}
+
+
+/*
+ * Returns true if location path 'xpathIn' points to at least one node of 'doc' or,
+ * for other expressions, if the expression value converts to boolean 'true'.
+ *
+ * As opposed to xpath_single() the result is never materialized and the scan
+ * of a location path stops as soon as the first matching node is found.
+ */
+static bool
+xpathExists(xpath xpathIn, xmldoc doc)
+{
+	XPathExpression expr = (XPathExpression) VARDATA(xpathIn);
+	XPathHeader xpHdr = (XPathHeader) ((char *) expr + expr->size);
+	XMLCompNodeHdr docRoot = (XMLCompNodeHdr) XNODE_ROOT(doc);
+	XPath		path;
+	bool		result;
+
+	if (!expr->mainExprAbs)
+	{
+		elog(ERROR, "neither relative paths nor attributes expected in main expression");
+	}
+
+	path = getSingleXPath(expr, xpHdr, true);
+	if (path != NULL)
+	{
+		if (path->depth == 0)
+		{
+			/* '/' always points to the document node. */
+			result = true;
+		}
+		else
+		{
+			XMLScanData xscan;
+
+			/* Uniqueness of the nodes found doesn't matter here. */
+			initXMLScan(&xscan, NULL, path, xpHdr, docRoot, doc, false);
+			result = (getNextXMLNode(&xscan, false) != NULL);
+			finalizeXMLScan(&xscan);
+		}
+	}
+	else
+	{
+		XPathExprState exprState;
+		XPathExprOperandValueData resData,
+					resBool;
+
+		exprState = prepareXPathExpression(expr, docRoot, doc, xpHdr, NULL);
+		evaluateXPathExpression(exprState, exprState->expr, NULL, docRoot, 0, &resData);
+		castXPathExprOperandToBool(exprState, &resData, &resBool);
+		result = !resBool.isNull && resBool.v.boolean;
+		freeExpressionState(exprState);
+	}
+	return result;
+}
+
+PG_FUNCTION_INFO_V1(xpath_exists);
+
+Datum
+xpath_exists(PG_FUNCTION_ARGS)
+{
+	xpath		xpathIn = (xpath) PG_GETARG_POINTER(0);
+	xmldoc		doc = detoastXMLDocCached(PG_GETARG_DATUM(1));
+
+	PG_RETURN_BOOL(xpathExists(xpathIn, doc));
+}
+
+/*
+ * The same as xpath_exists(), just with the arguments swapped, to implement
+ * 'doc @? path' operator.
+ */
+PG_FUNCTION_INFO_V1(xmldoc_path_exists);
+
+Datum
+xmldoc_path_exists(PG_FUNCTION_ARGS)
+{
+	xmldoc		doc = detoastXMLDocCached(PG_GETARG_DATUM(0));
+	xpath		xpathIn = (xpath) PG_GETARG_POINTER(1);
+
+	PG_RETURN_BOOL(xpathExists(xpathIn, doc));
+}
+
+/*
+ * Restriction selectivity estimator for 'doc @? path' operator.
+ *
+ * If statistics of the 'doc' column are available, the operator is applied
+ * to the most common values and to the histogram entries (as patternsel()
+ * does for pattern matching operators). Otherwise (in particular for
+ * documents too wide for ANALYZE to store in statistics) the default is
+ * used.
+ */
+PG_FUNCTION_INFO_V1(xpath_exists_sel);
+
+Datum
+xpath_exists_sel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+	Oid			operator = PG_GETARG_OID(1);
+	List	   *args = (List *) PG_GETARG_POINTER(2);
+	int			varRelid = PG_GETARG_INT32(3);
+	VariableStatData vardata;
+	Node	   *other;
+	bool		varonleft;
+	Datum		constval;
+	FmgrInfo	opproc;
+	double		mcvSum,
+				mcvSel,
+				histSel,
+				nullFrac = 0.0;
+	int			histSize;
+	float8		result;
+
+	if (!get_restriction_variable(root, args, varRelid, &vardata, &other, &varonleft))
+	{
+		PG_RETURN_FLOAT8(XPATH_EXISTS_DEFAULT_SEL);
+	}
+	if (!varonleft || !IsA(other, Const) || ((Const *) other)->constisnull)
+	{
+		ReleaseVariableStats(vardata);
+		PG_RETURN_FLOAT8(XPATH_EXISTS_DEFAULT_SEL);
+	}
+	constval = ((Const *) other)->constvalue;
+	fmgr_info(get_opcode(operator), &opproc);
+
+	mcvSel = mcv_selectivity(&vardata, &opproc, constval, varonleft, &mcvSum);
+	histSel = histogram_selectivity(&vardata, &opproc, constval, varonleft, 10, 1, &histSize);
+
+	if (histSel < 0)
+	{
+		histSel = XPATH_EXISTS_DEFAULT_SEL;
+	}
+	else if (histSize < 100)
+	{
+		/* Small histogram is not trusted too much. */
+		histSel = (histSel * histSize + XPATH_EXISTS_DEFAULT_SEL * (100 - histSize)) / 100.0;
+	}
+
+	if (HeapTupleIsValid(vardata.statsTuple))
+	{
+		nullFrac = ((Form_pg_statistic) GETSTRUCT(vardata.statsTuple))->stanullfrac;
+	}
+	ReleaseVariableStats(vardata);
+
+	result = mcvSel + histSel * (1.0 - nullFrac - mcvSum);
+	CLAMP_PROBABILITY(result);
+	PG_RETURN_FLOAT8(result);
+}
+
+/*
+ * Initialize context for functions that evaluate column paths relative to
+ * nodes found by base path. The context is allocated in the current memory
+ * context.
+ */
+static XMLScanContext
+initXMLScanContext(xpath xpathBasePtr, ArrayType *pathsColArr, xmldoc doc)
+{
+	int		   *dimv;
+	XMLNodeKind baseTarget;
+	XPath		xpathBase;
+	XPathExpression exprBase = (XPathExpression) VARDATA(xpathBasePtr);
+	XPathHeader xpHdrBase = (XPathHeader) ((char *) exprBase + exprBase->size);
+	XMLCompNodeHdr docRoot = (XMLCompNodeHdr) XNODE_ROOT(doc);
+	XMLScanContext xScanCtx;
+	unsigned int i;
+
+	xpathBase = getSingleXPath(exprBase, xpHdrBase, false);
+
+	if (ARR_NDIM(pathsColArr) != 1)
+	{
+		elog(ERROR, " 1-dimensional array must be used to pass column xpaths");
+	}
+	dimv = ARR_DIMS(pathsColArr);
+
+	/*
+	 * First dimension is the only one and as such it's length of the array
+	 */
+	if (*dimv > XMLNODE_SET_MAX_COLS)
+	{
+		elog(ERROR, "maximum number of xpath columns is %u", XMLNODE_SET_MAX_COLS);
+	}
+
+	xScanCtx = (XMLScanContext) palloc(sizeof(XMLScanContextData));
+	xScanCtx->baseScan = (XMLScan) palloc(sizeof(XMLScanData));
+	initXMLScan(xScanCtx->baseScan, NULL, xpathBase, xpHdrBase, docRoot, doc, xpathBase->descendants > 0);
+
+	baseTarget = xScanCtx->baseScan->xpath->targNdKind;
+	if (baseTarget != XMLNODE_DOC && baseTarget != XMLNODE_ELEMENT)
+	{
+		elog(ERROR, "base path must point to element or document");
+	}
+
+	xScanCtx->columns = *dimv;
+	xScanCtx->colPaths = (xpath *) palloc(xScanCtx->columns * sizeof(xpath));
+	xScanCtx->colResults = NULL;
+	xScanCtx->colResNulls = NULL;
+	xScanCtx->outArrayType = InvalidOid;
+
+	/*
+	 * Output element OID to be identified later - first time a not null value
+	 * is found for any column xpath.
+	 */
+	xScanCtx->outElmType = InvalidOid;
+	xScanCtx->attInMeta = NULL;
+	xScanCtx->nodeType = InvalidOid;
+	xScanCtx->docType = InvalidOid;
+
+	retrieveColumnPaths(xScanCtx, pathsColArr, *dimv);
+
+	/*
+	 * The column paths are evaluated for each base node, so the expression
+	 * states are only created here and reset later before each evaluation.
+	 */
+	xScanCtx->colExprStates = (XPathExprState *) palloc(xScanCtx->columns * sizeof(XPathExprState));
+	for (i = 0; i < xScanCtx->columns; i++)
+	{
+		XPathExpression colExpr = (XPathExpression) VARDATA(xScanCtx->colPaths[i]);
+
+		xScanCtx->colExprStates[i] = createXPathExpressionState(colExpr);
+	}
+	return xScanCtx;
+}
+
+static void
+finalizeXMLScanContext(XMLScanContext xScanCtx)
+{
+	unsigned int i;
+
+	finalizeXMLScan(xScanCtx->baseScan);
+	pfree(xScanCtx->baseScan);
+
+	for (i = 0; i < xScanCtx->columns; i++)
+	{
+		XPathExprState exprState = xScanCtx->colExprStates[i];
+
+		/*
+		 * Node-sets of the last evaluation are not ours to free (see
+		 * resetXPathExpressionState()).
+		 */
+		resetXPathExpressionState(exprState, (XPathExpression) VARDATA(xScanCtx->colPaths[i]));
+		pfree(exprState->expr);
+		freeExpressionState(exprState);
+	}
+	pfree(xScanCtx->colExprStates);
+
+	pfree(xScanCtx->colPaths);
+	if (xScanCtx->colResults != NULL)
+	{
+		pfree(xScanCtx->colResults);
+	}
+	if (xScanCtx->colResNulls != NULL)
+	{
+		pfree(xScanCtx->colResNulls);
+	}
+	pfree(xScanCtx);
+}
 
 PG_FUNCTION_INFO_V1(xpath_array);
 
 /*
- * TODO Check if it's safe to store pointers to elements of
- * PG_GETARG_POINTER(2) across calls or if the parameter should be copied to
- * the 'fctx';
+ * The arguments are detoasted in the multi-call memory context: both the
+ * document and the column paths are referenced from the scan context across
+ * calls.
  */
 Datum
 xpath_array(PG_FUNCTION_ARGS)
@@ -294,22 +703,12 @@ xpath_array(PG_FUNCTION_ARGS)
 
 	if (SRF_IS_FIRSTCALL())
 	{
-		int		   *dimv;
-		XMLNodeKind baseTarget;
 		Oid			resultType;
-
-		xpath		xpathBasePtr = (xpath) PG_GETARG_POINTER(0);
-		XPath		xpathBase;
-		XPathExpression exprBase = (XPathExpression) VARDATA(xpathBasePtr);
-		XPathHeader xpHdrBase = (XPathHeader) ((char *) exprBase + exprBase->size);
-
-		ArrayType  *pathsColArr = PG_GETARG_ARRAYTYPE_P(1);
-		xmldoc		doc = (xmldoc) PG_GETARG_VARLENA_P(2);
-		XMLCompNodeHdr docRoot = (XMLCompNodeHdr) XNODE_ROOT(doc);
+		xpath		xpathBasePtr;
+		ArrayType  *pathsColArr;
+		xmldoc		doc;
 		MemoryContext oldcontext;
 
-		xpathBase = getSingleXPath(exprBase, xpHdrBase);
-
 		fctx = SRF_FIRSTCALL_INIT();
 		if (get_call_result_type(fcinfo, &resultType, NULL) != TYPEFUNC_SCALAR)
 		{
@@ -317,43 +716,13 @@ xpath_array(PG_FUNCTION_ARGS)
 		}
 		oldcontext = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
 
-		if (ARR_NDIM(pathsColArr) != 1)
-		{
-			elog(ERROR, " 1-dimensional array must be used to pass column xpaths");
-		}
-		dimv = ARR_DIMS(pathsColArr);
+		xpathBasePtr = (xpath) PG_GETARG_VARLENA_P(0);
+		pathsColArr = PG_GETARG_ARRAYTYPE_P(1);
+		doc = (xmldoc) PG_GETARG_VARLENA_P(2);
 
-		/*
-		 * First dimension is the only one and as such it's length of the
-		 * array
-		 */
-		if (*dimv > XMLNODE_SET_MAX_COLS)
-		{
-			elog(ERROR, "maximum number of xpath columns is %u", XMLNODE_SET_MAX_COLS);
-		}
-
-		xScanCtx = (XMLScanContext) palloc(sizeof(XMLScanContextData));
-		xScanCtx->baseScan = (XMLScan) palloc(sizeof(XMLScanData));
-		initXMLScan(xScanCtx->baseScan, NULL, xpathBase, xpHdrBase, docRoot, doc, xpathBase->descendants > 0);
-
-		baseTarget = xScanCtx->baseScan->xpath->targNdKind;
-		if (baseTarget != XMLNODE_DOC && baseTarget != XMLNODE_ELEMENT)
-		{
-			elog(ERROR, "base path must point to element or document");
-		}
-
-		xScanCtx->columns = *dimv;
-		xScanCtx->colPaths = (xpath *) palloc(xScanCtx->columns * sizeof(xpath));
+		xScanCtx = initXMLScanContext(xpathBasePtr, pathsColArr, doc);
 		xScanCtx->outArrayType = resultType;
 
-		/*
-		 * Output element OID to be identified later - first time a not null
-		 * value is found for any column xpath.
-		 */
-		xScanCtx->outElmType = InvalidOid;
-
-		retrieveColumnPaths(xScanCtx, pathsColArr, *dimv);
-
 		fctx->user_fctx = xScanCtx;
 		MemoryContextSwitchTo(oldcontext);
 	}
@@ -399,24 +768,453 @@ xpath_array(PG_FUNCTION_ARGS)
 	}
 	if (baseScan->done)
 	{
-		finalizeXMLScan(baseScan);
-		pfree(baseScan);
+		finalizeXMLScanContext(xScanCtx);
+		SRF_RETURN_DONE(fctx);
+	}
+	SRF_RETURN_DONE(fctx);
+}
+
+PG_FUNCTION_INFO_V1(xpath_table);
+
+/*
+ * Like xpath_array(), but each column path produces a column of the type
+ * specified by the caller (column definition list). No intermediate 'pathval'
+ * values or arrays are constructed. Unlike xpath_array(), a row is returned
+ * for each base node, even if all the column values are null.
+ */
+Datum
+xpath_table(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *fctx;
+	XMLScan		baseScan;
+	XMLScanContext xScanCtx;
+	XMLNodeOffset baseNdOff = 0;
+	bool		found = false;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		xpath		xpathBasePtr;
+		ArrayType  *pathsColArr;
+		xmldoc		doc;
+		TupleDesc	tupDesc;
+		MemoryContext oldcontext;
 
-		pfree(xScanCtx->colPaths);
-		if (xScanCtx->colResults != NULL)
+		fctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+
+		xpathBasePtr = (xpath) PG_GETARG_VARLENA_P(0);
+		pathsColArr = PG_GETARG_ARRAYTYPE_P(1);
+		doc = (xmldoc) PG_GETARG_VARLENA_P(2);
+
+		if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
 		{
-			pfree(xScanCtx->colResults);
+			elog(ERROR, "function returning record called in context that cannot accept type record");
 		}
-		if (xScanCtx->colResNulls != NULL)
+
+		xScanCtx = initXMLScanContext(xpathBasePtr, pathsColArr, doc);
+		if (tupDesc->natts != xScanCtx->columns)
 		{
-			pfree(xScanCtx->colResNulls);
+			elog(ERROR, "number of column paths (%u) does not match the number of columns (%u)",
+				 xScanCtx->columns, tupDesc->natts);
 		}
-		pfree(xScanCtx);
-		SRF_RETURN_DONE(fctx);
+		xScanCtx->attInMeta = TupleDescGetAttInMetadata(tupDesc);
+		xScanCtx->docType = get_fn_expr_argtype(fcinfo->flinfo, 2);
+		xScanCtx->nodeType = GetSysCacheOid2(TYPENAMENSP, CStringGetDatum("node"),
+						  ObjectIdGetDatum(get_func_namespace(fcinfo->flinfo->fn_oid)));
+		xScanCtx->colResults = (Datum *) palloc(xScanCtx->columns * sizeof(Datum));
+		xScanCtx->colResNulls = (bool *) palloc(xScanCtx->columns * sizeof(bool));
+
+		fctx->user_fctx = xScanCtx;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	fctx = SRF_PERCALL_SETUP();
+	xScanCtx = (XMLScanContext) fctx->user_fctx;
+	baseScan = xScanCtx->baseScan;
+
+	if (!baseScan->done)
+	{
+		if (baseScan->xpath->targNdKind == XMLNODE_DOC)
+		{
+			baseNdOff = XNODE_ROOT_OFFSET(baseScan->document);
+			found = true;
+			baseScan->done = true;
+		}
+		else
+		{
+			MemoryContext oldcontext = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+			XMLNodeHdr	baseNode = getNextXMLNode(baseScan, false);
+
+			MemoryContextSwitchTo(oldcontext);
+			if (baseNode != NULL)
+			{
+				baseNdOff = (char *) baseNode - VARDATA(baseScan->document);
+				found = true;
+			}
+			else
+			{
+				baseScan->done = true;
+			}
+		}
+	}
+
+	if (found)
+	{
+		HeapTuple	tuple = getResultTuple(xScanCtx, baseNdOff);
+
+		SRF_RETURN_NEXT(fctx, HeapTupleGetDatum(tuple));
 	}
+
+	finalizeXMLScanContext(xScanCtx);
 	SRF_RETURN_DONE(fctx);
 }
 
+PG_FUNCTION_INFO_V1(xpath_multi);
+
+/*
+ * Evaluate each path of the array against 'doc' and return array of the
+ * results.
+ *
+ * Paths that consist of nothing but element steps without predicates
+ * (optionally followed by attribute / text / comment / pi / node test) are
+ * merged into a prefix tree and evaluated in a single traversal of the
+ * document. The remaining paths are evaluated separately, the same way
+ * xml.path(path, doc) does.
+ */
+Datum
+xpath_multi(PG_FUNCTION_ARGS)
+{
+	ArrayType  *pathsArr = PG_GETARG_ARRAYTYPE_P(0);
+	xmldoc		doc = detoastXMLDocCached(PG_GETARG_DATUM(1));
+	XMLCompNodeHdr docRoot = (XMLCompNodeHdr) XNODE_ROOT(doc);
+	Oid			resultType,
+				elTypOid,
+				outElmType;
+	int16		elTypLen,
+				outElmLen;
+	bool		elByVal,
+				outElmByVal;
+	char		elTypAlign,
+				outElmAlign;
+	Datum	   *pathDatums;
+	bool	   *pathNulls;
+	int			npaths,
+				i;
+	Datum	   *results;
+	bool	   *resNulls;
+	XPathStepTrieData trieRoot;
+	XPathMultiScanData mscan;
+	bool		sharedScan = false;
+	int			dims[1];
+	int			lbs[1];
+
+	if (get_call_result_type(fcinfo, &resultType, NULL) != TYPEFUNC_SCALAR)
+	{
+		elog(ERROR, "function called in a context that doesn't accept scalar.");
+	}
+
+	if (ARR_NDIM(pathsArr) > 1)
+	{
+		elog(ERROR, "1-dimensional array must be used to pass xpaths");
+	}
+	elTypOid = ARR_ELEMTYPE(pathsArr);
+	get_typlenbyvalalign(elTypOid, &elTypLen, &elByVal, &elTypAlign);
+	deconstruct_array(pathsArr, elTypOid, elTypLen, elByVal, elTypAlign, &pathDatums, &pathNulls, &npaths);
+
+	outElmType = get_element_type(resultType);
+	Assert(outElmType != InvalidOid);
+	get_typlenbyvalalign(outElmType, &outElmLen, &outElmByVal, &outElmAlign);
+
+	if (npaths == 0)
+	{
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(outElmType));
+	}
+
+	results = (Datum *) palloc(npaths * sizeof(Datum));
+	resNulls = (bool *) palloc(npaths * sizeof(bool));
+
+	memset(&trieRoot, 0, sizeof(XPathStepTrieData));
+	mscan.paths = (XPath *) palloc0(npaths * sizeof(XPath));
+	mscan.matches = (XMLNodeHdr **) palloc0(npaths * sizeof(XMLNodeHdr *));
+	mscan.counts = (unsigned int *) palloc0(npaths * sizeof(unsigned int));
+	mscan.sizes = (unsigned int *) palloc0(npaths * sizeof(unsigned int));
+
+	/*
+	 * Build the prefix tree out of the paths that can share the scan.
+	 */
+	for (i = 0; i < npaths; i++)
+	{
+		xpath		xpathPtr;
+		XPathExpression expr;
+		XPathHeader xpHdr;
+		XPath		path;
+
+		if (pathNulls[i])
+		{
+			elog(ERROR, "XPath must not be null");
+		}
+		xpathPtr = (xpath) PG_DETOAST_DATUM(pathDatums[i]);
+		pathDatums[i] = PointerGetDatum(xpathPtr);
+		expr = (XPathExpression) VARDATA(xpathPtr);
+		xpHdr = (XPathHeader) ((char *) expr + expr->size);
+
+		if (!expr->mainExprAbs)
+		{
+			elog(ERROR, "neither relative paths nor attributes expected in main expression");
+		}
+
+		path = getSingleXPath(expr, xpHdr, true);
+		if (path != NULL && isSharedScanPath(path))
+		{
+			mscan.paths[i] = path;
+			addPathToTrie(&trieRoot, path, i);
+			sharedScan = true;
+		}
+	}
+
+	if (sharedScan)
+	{
+		scanForPaths(docRoot, &trieRoot, &mscan);
+	}
+
+	for (i = 0; i < npaths; i++)
+	{
+		xpath		xpathPtr = (xpath) DatumGetPointer(pathDatums[i]);
+		XPathExpression expr = (XPathExpression) VARDATA(xpathPtr);
+		xpathval	value;
+		bool		notNull;
+
+		if (mscan.paths[i] != NULL)
+		{
+			value = getNodeSetValue(expr, doc, mscan.matches[i], mscan.counts[i], &notNull);
+		}
+		else
+		{
+			XPathHeader xpHdr = (XPathHeader) ((char *) expr + expr->size);
+			XPathExprState exprState;
+			XPathExprOperandValueData resData;
+
+			exprState = prepareXPathExpression(expr, docRoot, doc, xpHdr, NULL);
+			evaluateXPathExpression(exprState, exprState->expr, NULL, docRoot, 0, &resData);
+			value = getXPathExprValue(exprState, doc, &notNull, &resData);
+			freeExpressionState(exprState);
+		}
+		results[i] = PointerGetDatum(value);
+		resNulls[i] = !notNull;
+	}
+
+	dims[0] = npaths;
+	lbs[0] = 1;
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(results, resNulls, 1, dims, lbs, outElmType, outElmLen,
+											 outElmByVal, outElmAlign));
+}
+
+/*
+ * Can 'path' be evaluated by scanForPaths()?
+ *
+ * Predicates would need the context position and size, and the descendant
+ * axis would make the same node reachable through multiple prefixes. Such
+ * paths are evaluated separately.
+ */
+static bool
+isSharedScanPath(XPath path)
+{
+	unsigned short i;
+
+	if (path->relative || path->depth == 0 || path->descendants > 0)
+	{
+		return false;
+	}
+
+	for (i = 0; i < path->depth; i++)
+	{
+		XPathElement xpEl = (XPathElement) ((char *) path + path->elements[i]);
+
+		if (xpEl->hasPredicate)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+addPathToTrie(XPathStepTrie root, XPath path, unsigned int pathNr)
+{
+	XPathStepTrie trieNode = root;
+	unsigned short i;
+
+	/* All steps but the last one are element name tests. */
+	for (i = 0; i < path->depth - 1; i++)
+	{
+		XPathElement xpEl = (XPathElement) ((char *) path + path->elements[i]);
+		XPathStepTrie child = trieNode->firstChild;
+
+		while (child != NULL && strcmp(child->name, xpEl->name) != 0)
+		{
+			child = child->nextSibling;
+		}
+
+		if (child == NULL)
+		{
+			child = (XPathStepTrie) palloc0(sizeof(XPathStepTrieData));
+			child->name = xpEl->name;
+			child->nextSibling = trieNode->firstChild;
+			trieNode->firstChild = child;
+		}
+		trieNode = child;
+	}
+
+	if (trieNode->npaths == trieNode->pathsMax)
+	{
+		if (trieNode->pathsMax == 0)
+		{
+			trieNode->pathsMax = 4;
+			trieNode->paths = (unsigned int *) palloc(trieNode->pathsMax * sizeof(unsigned int));
+		}
+		else
+		{
+			trieNode->pathsMax <<= 1;
+			trieNode->paths = (unsigned int *) repalloc(trieNode->paths,
+										  trieNode->pathsMax * sizeof(unsigned int));
+		}
+	}
+	trieNode->paths[trieNode->npaths++] = pathNr;
+}
+
+/*
+ * Test children of 'element' against the last step of each path ending at
+ * 'trieNode' and descend into those child elements that advance any path
+ * further.
+ */
+static void
+scanForPaths(XMLCompNodeHdr element, XPathStepTrie trieNode, XPathMultiScan mscan)
+{
+	char	   *childRef = XNODE_FIRST_REF(element);
+	char		bwidth = XNODE_GET_REF_BWIDTH(element);
+	unsigned short i;
+	XMLNodeOffset ref;
+
+	XNODE_FOREACH_REF(childRef, bwidth, element->children, i, ref,
+	{
+		XMLNodeHdr	child = (XMLNodeHdr) ((char *) element - ref);
+		unsigned int j;
+
+		for (j = 0; j < trieNode->npaths; j++)
+		{
+			unsigned int pathNr = trieNode->paths[j];
+
+			if (matchLastStep(mscan->paths[pathNr], child))
+			{
+				unsigned int count = mscan->counts[pathNr];
+
+				if (count == mscan->sizes[pathNr])
+				{
+					if (count == 0)
+					{
+						mscan->sizes[pathNr] = 4;
+						mscan->matches[pathNr] = (XMLNodeHdr *) palloc(mscan->sizes[pathNr] * sizeof(XMLNodeHdr));
+					}
+					else
+					{
+						mscan->sizes[pathNr] = count + (count >> 1) + 1;
+						mscan->matches[pathNr] = (XMLNodeHdr *) repalloc(mscan->matches[pathNr],
+										  mscan->sizes[pathNr] * sizeof(XMLNodeHdr));
+					}
+				}
+				mscan->matches[pathNr][count] = child;
+				mscan->counts[pathNr]++;
+			}
+		}
+
+		if (child->kind == XMLNODE_ELEMENT && trieNode->firstChild != NULL)
+		{
+			XMLCompNodeHdr childElement = (XMLCompNodeHdr) child;
+			char	   *name = XNODE_ELEMENT_NAME(childElement);
+			XPathStepTrie trieChild = trieNode->firstChild;
+
+			while (trieChild != NULL && strcmp(trieChild->name, name) != 0)
+			{
+				trieChild = trieChild->nextSibling;
+			}
+
+			if (trieChild != NULL)
+			{
+				scanForPaths(childElement, trieChild, mscan);
+			}
+		}
+	});
+}
+
+/*
+ * The same tests that getNextXMLNode() applies at the last level of the
+ * location path.
+ */
+static bool
+matchLastStep(XPath path, XMLNodeHdr node)
+{
+	XPathElement xpEl = (XPathElement) ((char *) path + path->elements[path->depth - 1]);
+
+	switch (path->targNdKind)
+	{
+		case XMLNODE_ELEMENT:
+			return node->kind == XMLNODE_ELEMENT &&
+				strcmp(XNODE_ELEMENT_NAME((XMLCompNodeHdr) node), xpEl->name) == 0;
+
+		case XMLNODE_NODE:
+			return node->kind != XMLNODE_ATTRIBUTE;
+
+		case XMLNODE_TEXT:
+		case XMLNODE_COMMENT:
+			return node->kind == path->targNdKind;
+
+		case XMLNODE_PI:
+			return node->kind == XMLNODE_PI &&
+				(!path->piTestValue || strcmp((char *) (node + 1), xpEl->name) == 0);
+
+		case XMLNODE_ATTRIBUTE:
+			return node->kind == XMLNODE_ATTRIBUTE &&
+				(path->allAttributes || strcmp((char *) node + sizeof(XMLNodeHdrData), xpEl->name) == 0);
+
+		default:
+			return false;
+	}
+}
+
+/*
+ * Convert nodes found by scanForPaths() to 'pathval', the same way the result
+ * of expression evaluation is converted.
+ */
+static xpathval
+getNodeSetValue(XPathExpression expr, xmldoc doc, XMLNodeHdr * nodes, unsigned int count, bool *notNull)
+{
+	XPathExprState exprState = createXPathExpressionState(expr);
+	XPathExprOperandValueData resData;
+	xpathval	result;
+
+	resData.type = XPATH_VAL_NODESET;
+	resData.negative = false;
+	resData.isNull = (count == 0);
+	resData.castToNumber = false;
+	resData.v.nodeSet.isDocument = false;
+	resData.v.nodeSet.count = count;
+
+	if (count == 1)
+	{
+		resData.v.nodeSet.nodes.nodeId = getXPathOperandId(exprState, nodes[0], XPATH_VAR_NODE_SINGLE);
+	}
+	else if (count > 1)
+	{
+		resData.v.nodeSet.nodes.arrayId = getXPathOperandId(exprState, nodes, XPATH_VAR_NODE_ARRAY);
+	}
+
+	result = getXPathExprValue(exprState, doc, notNull, &resData);
+
+	/* Also frees 'nodes' if it was registered as node array. */
+	freeExpressionState(exprState);
+	return result;
+}
+
 /*
  * Functions to cast operand value.
  * A separate instance is used for the target value in order to preserve the original value.
@@ -664,6 +1462,11 @@ castXPathValToNum(XPathValue src)
 					elog(ERROR, "document can't be cast to number");
 				}
 
+				if (XNODE_IS_NUMBER(node))
+				{
+					return getXMLNodeNumValue(node);
+				}
+
 				if (node->kind == XMLNODE_ELEMENT)
 				{
 					nodeStr = getElementNodeStr((XMLCompNodeHdr) node);
@@ -843,13 +1646,14 @@ getResultArray(XMLScanContext ctx, XMLNodeOffset baseNodeOff)
 		XPathHeader xpHdr = (XPathHeader) ((char *) expr + expr->size);
 		bool		colNotNull = false;
 		XMLCompNodeHdr baseNode = (XMLCompNodeHdr) ((char *) VARDATA(doc) + baseNodeOff);
-		XPathExprState exprState = prepareXPathExpression(expr, baseNode, doc, xpHdr, ctx->baseScan);
+		XPathExprState exprState = ctx->colExprStates[i];
 		XPathExprOperandValueData resData;
 
+		resetXPathExpressionState(exprState, expr);
+		substituteXPathExpressionVars(exprState, baseNode, doc, xpHdr, ctx->baseScan);
 		evaluateXPathExpression(exprState, exprState->expr, XMLSCAN_CURRENT_LEVEL(ctx->baseScan),
-		(XMLCompNodeHdr) ((char *) VARDATA(doc) + baseNodeOff), 0, &resData);
+								baseNode, 0, &resData);
 		colValue = getXPathExprValue(exprState, doc, &colNotNull, &resData);
-		freeExpressionState(exprState);
 
 		ctx->colResults[i] = PointerGetDatum(colValue);
 		ctx->colResNulls[i] = !colNotNull;
@@ -875,6 +1679,110 @@ getResultArray(XMLScanContext ctx, XMLNodeOffset baseNodeOff)
 	return result;
 }
 
+/*
+ * Returns tuple where i-th attribute is result of 'ctx->colPaths[i]' evaluated
+ * for node at 'baseNodeOff', converted to type of that attribute.
+ */
+static HeapTuple
+getResultTuple(XMLScanContext ctx, XMLNodeOffset baseNodeOff)
+{
+	unsigned short int i;
+	xmldoc		doc = ctx->baseScan->document;
+	XMLCompNodeHdr baseNode = (XMLCompNodeHdr) ((char *) VARDATA(doc) + baseNodeOff);
+
+	for (i = 0; i < ctx->columns; i++)
+	{
+		xpath		xpathPtr = ctx->colPaths[i];
+		XPathExpression expr = (XPathExpression) VARDATA(xpathPtr);
+		XPathHeader xpHdr = (XPathHeader) ((char *) expr + expr->size);
+		XPathExprState exprState = ctx->colExprStates[i];
+		XPathExprOperandValueData resData;
+
+		resetXPathExpressionState(exprState, expr);
+		substituteXPathExpressionVars(exprState, baseNode, doc, xpHdr, ctx->baseScan);
+		evaluateXPathExpression(exprState, exprState->expr, XMLSCAN_CURRENT_LEVEL(ctx->baseScan), baseNode, 0,
+								&resData);
+		ctx->colResults[i] = getColumnValue(ctx, i, exprState, &resData, &ctx->colResNulls[i]);
+	}
+	return heap_form_tuple(ctx->attInMeta->tupdesc, ctx->colResults, ctx->colResNulls);
+}
+
+/*
+ * Convert result of column path to the type of the column.
+ *
+ * Node-set is passed as a node if the column type is 'node' or 'doc'. For
+ * boolean column the XPath rules for conversion to boolean are applied. In
+ * other cases XPath string value of the result is passed to the input
+ * function of the column type.
+ *
+ * Empty node-set yields null.
+ */
+static Datum
+getColumnValue(XMLScanContext ctx, unsigned short colNr, XPathExprState exprState, XPathExprOperandValue res,
+			   bool *isNull)
+{
+	Oid			colType = ctx->attInMeta->tupdesc->attrs[colNr]->atttypid;
+	XPathExprOperandValueData resCast;
+	char	   *resStr;
+
+	*isNull = true;
+
+	/*
+	 * XPath conversion to boolean is defined for all values, including empty
+	 * node-set.
+	 */
+	if (colType == BOOLOID)
+	{
+		castXPathExprOperandToBool(exprState, res, &resCast);
+		*isNull = false;
+		return BoolGetDatum(resCast.v.boolean);
+	}
+
+	if (res->isNull)
+	{
+		return (Datum) 0;
+	}
+	if (res->type == XPATH_VAL_NODESET && !res->v.nodeSet.isDocument && res->v.nodeSet.count == 0)
+	{
+		return (Datum) 0;
+	}
+
+	if (colType == ctx->nodeType || colType == ctx->docType)
+	{
+		xpathval	value;
+		bool		notNull;
+		Datum		result;
+
+		if (res->type != XPATH_VAL_NODESET)
+		{
+			elog(ERROR, "%s can't be cast to node", xpathValueTypes[res->type]);
+		}
+		value = getXPathExprValue(exprState, ctx->baseScan->document, &notNull, res);
+		if (!notNull)
+		{
+			return (Datum) 0;
+		}
+		result = DirectFunctionCall1(xpathval_to_xmlnode, PointerGetDatum(value));
+		pfree(value);
+		if (colType == ctx->docType)
+		{
+			result = DirectFunctionCall1(xmlnode_to_xmldoc, result);
+		}
+		*isNull = false;
+		return result;
+	}
+
+	castXPathExprOperandToStr(exprState, res, &resCast);
+	if (resCast.isNull)
+	{
+		return (Datum) 0;
+	}
+	resStr = (char *) getXPathOperandValue(exprState, resCast.v.stringId, XPATH_VAR_STRING);
+	*isNull = false;
+	return InputFunctionCall(&ctx->attInMeta->attinfuncs[colNr], resStr, ctx->attInMeta->attioparams[colNr],
+							 ctx->attInMeta->atttypmods[colNr]);
+}
+
 static xpathval
 getXPathExprValue(XPathExprState exprState, xmldoc document, bool *notNull, XPathExprOperandValue res)
 {
@@ -906,6 +1814,8 @@ getXPathExprValue(XPathExprState exprState, xmldoc document, bool *notNull, XPat
 			char	   *output,
 					   *targ;
 
+			/* The string pool must not appear in the node. */
+			document = unpoolXMLDoc(document);
 			rootOffOrig = XNODE_ROOT_OFFSET(document);
 			rootOrig = (XMLCompNodeHdr) XNODE_ROOT(document);
 			sizeOrig = VARSIZE(document);
@@ -962,7 +1872,8 @@ getXPathExprValue(XPathExprState exprState, xmldoc document, bool *notNull, XPat
 					unsigned int k;
 					unsigned int nodeSizeTotal = 0;
 					char		bwidth;
-					char	   *refTarget;
+					char	   *refTarget,
+							   *kinds;
 					XMLNodeHdr	node;
 					unsigned int *nodeSizes;
 					XMLCompNodeHdr fragmentHdr;
@@ -990,12 +1901,18 @@ getXPathExprValue(XPathExprState exprState, xmldoc document, bool *notNull, XPat
 					 */
 					bwidth = getXMLNodeOffsetByteWidth(nodeSizeTotal);
 					resSize = VARHDRSZ + sizeof(XPathValueData) + nodeSizeTotal + sizeof(XMLCompNodeHdrData) +
-						bwidth * j;
+						XNODE_REFS_SIZE(j, bwidth);
 					output = (char *) palloc(resSize);
 					xpval = (XPathValue) VARDATA(output);
 					outTmp = (char *) xpval + sizeof(XPathValueData);
 					fragmentHdr = (XMLCompNodeHdr) (outTmp + nodeSizeTotal);
-					refTarget = (char *) fragmentHdr + sizeof(XMLCompNodeHdrData);
+					fragmentHdr->common.kind = XMLNODE_DOC_FRAGMENT;
+					fragmentHdr->common.flags = 0;
+					XNODE_SET_REF_BWIDTH(fragmentHdr, bwidth);
+					fragmentHdr->children = j;
+					fragmentHdr->attributes = 0;
+					refTarget = XNODE_FIRST_REF(fragmentHdr);
+					kinds = XNODE_CHILD_KINDS(fragmentHdr);
 					targetPos = 0;
 
 					for (k = 0; k < j; k++)
@@ -1021,15 +1938,11 @@ getXPathExprValue(XPathExprState exprState, xmldoc document, bool *notNull, XPat
 						copyXMLNode(node, ndTarget, false, &root);
 						dist = nodeSizeTotal - (targetPos + root);
 						writeXMLNodeOffset(dist, &refTarget, bwidth, true);
+						kinds[k] = node->kind;
 						targetPos += nodeSizes[k];
 					}
 					pfree(nodeSizes);
 
-					fragmentHdr->common.kind = XMLNODE_DOC_FRAGMENT;
-					fragmentHdr->common.flags = 0;
-					XNODE_SET_REF_BWIDTH(fragmentHdr, bwidth);
-					fragmentHdr->children = j;
-
 					xpval->type = XPATH_VAL_NODESET;
 					xpval->v.nodeSetRoot = sizeof(XPathValueData) + nodeSizeTotal;
 				}
@@ -1194,7 +2107,7 @@ xpathval_to_xmlnode(PG_FUNCTION_ARGS)
 		XMLNodeOffset *rootOffPtr = (XMLNodeOffset *) (result + sizeNew);
 
 		memcpy(dst, src, sizeNew - VARHDRSZ);
-		*rootOffPtr = xp->v.nodeSetRoot - sizeof(XPathValueData);
+		XNODE_SET_ROOT_OFFSET(rootOffPtr, xp->v.nodeSetRoot - sizeof(XPathValueData));
 		SET_VARSIZE(result, resSize);
 		PG_RETURN_POINTER(result);
 	}
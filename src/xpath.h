@@ -6,6 +6,7 @@
 #define XPATH_H_
 
 #include "postgres.h"
+#include "funcapi.h"
 #include "lib/stringinfo.h"
 
 #include "xmlnode.h"
@@ -20,10 +21,22 @@ extern Datum xpath_out(PG_FUNCTION_ARGS);
 extern Datum xpath_debug_print(PG_FUNCTION_ARGS);
 
 extern Datum xpath_single(PG_FUNCTION_ARGS);
+extern Datum xpath_refs(PG_FUNCTION_ARGS);
+extern Datum xpath_exists(PG_FUNCTION_ARGS);
+extern Datum xmldoc_path_exists(PG_FUNCTION_ARGS);
+extern Datum xpath_exists_sel(PG_FUNCTION_ARGS);
+
+/*
+ * Selectivity of 'doc @? path' if there are no statistics to derive it from.
+ * The same as DEFAULT_MATCH_SEL used for pattern matching operators.
+ */
+#define XPATH_EXISTS_DEFAULT_SEL	0.005
 
 #define XMLNODE_SET_MAX_COLS	16
 
 extern Datum xpath_array(PG_FUNCTION_ARGS);
+extern Datum xpath_table(PG_FUNCTION_ARGS);
+extern Datum xpath_multi(PG_FUNCTION_ARGS);
 
 /*
  * The first is minimum amount of memory allocated for binary XPath and also
@@ -235,7 +248,8 @@ typedef enum XPathFunctionId
 	XPATH_FUNC_STARTS_WITH,
 
 	XPATH_FUNC_COUNT,
-	XPATH_FUNC_CONCAT
+	XPATH_FUNC_CONCAT,
+	XPATH_FUNC_ID
 }	XPathFunctionId;
 
 
@@ -418,7 +432,7 @@ extern void dumpXPathExpression(XPathExpression expr, XPathHeader xpathHdr, Stri
 					bool debug);
 extern void dumpLocationPath(XPathHeader xpathHdr, StringInfo output, bool debug, unsigned short pathNr);;
 
-extern XPath getSingleXPath(XPathExpression expr, XPathHeader xpHdr);
+extern XPath getSingleXPath(XPathExpression expr, XPathHeader xpHdr, bool missingOk);
 
 typedef struct XPathElementData
 {
@@ -498,6 +512,14 @@ typedef struct XMLScanOneLevelData
 
 typedef struct XMLScanOneLevelData *XMLScanOneLevel;
 
+/*
+ * Index of the node the scan level is at, among all children of the parent.
+ * (The level only iterates through attributes or only through the other
+ * children if possible, so 'siblingsLeft' can't be used to get it.)
+ */
+#define XMLSCAN_LEVEL_NODE_INDEX(level) ((unsigned short) (((level)->nodeRefPtr - \
+		XNODE_FIRST_REF((level)->parent)) / XNODE_GET_REF_BWIDTH((level)->parent)))
+
 typedef struct XMLScanData
 {
 	XPath		xpath;
@@ -546,6 +568,14 @@ typedef struct XMLScanData
 	 */
 	XMLNodeContainer ignoreList;
 
+	/*
+	 * ID index of the document, for id() function in predicates. Sub-scans
+	 * and the predicate expressions use the slot of the top-level scan, so
+	 * the index is built at most once per scan.
+	 */
+	XMLIdIndexSlotData idIndexData;
+	XMLIdIndexSlot idIndex;
+
 	/* Direct child in the scan hierarchy. */
 	struct XMLScanData *subScan;
 
@@ -562,6 +592,12 @@ typedef struct XMLScanContextData
 	XMLScan		baseScan;
 	unsigned int columns;
 	xpath	   *colPaths;
+
+	/*
+	 * Evaluation state for each column path. Allocated once per scan and
+	 * only reset for each base node.
+	 */
+	struct XPathExprStateData **colExprStates;
 	Datum	   *colResults;
 	bool	   *colResNulls;
 	Oid			outArrayType,
@@ -569,6 +605,14 @@ typedef struct XMLScanContextData
 	int16		outElmLen;
 	bool		outElmByVal;
 	char		outElmalign;
+
+	/*
+	 * Only used by xml.table(): description of the output columns and OIDs
+	 * of the types that receive nodes instead of string values.
+	 */
+	AttInMetadata *attInMeta;
+	Oid			nodeType,
+				docType;
 }	XMLScanContextData;
 
 typedef struct XMLScanContextData *XMLScanContext;
@@ -579,6 +623,7 @@ extern void finalizeXMLScan(XMLScan xscan);
 
 extern void initScanForTextNodes(XMLScan xscan, XMLCompNodeHdr root);
 extern void finalizeScanForTextNodes(XMLScan xscan);
+extern int	nodePtrComparator(const void *arg1, const void *arg2);
 
 /*
  * Expression evaluation state.
@@ -587,6 +632,16 @@ typedef struct XPathExprStateData
 {
 	XPathExpression expr;
 
+	/* Document the expression is evaluated against. */
+	xmldoc		document;
+
+	/*
+	 * ID index of 'document'. 'idIndex' points to the slot of the scan that
+	 * evaluates the expression (predicate) or to 'idIndexData'.
+	 */
+	XMLIdIndexSlotData idIndexData;
+	XMLIdIndexSlot idIndex;
+
 	unsigned short count[3];
 	unsigned short countMax[3];
 
@@ -653,7 +708,7 @@ typedef struct XPathFunctionData
 typedef struct XPathFunctionData *XPathFunction;
 
 /* Total number of XPath functions the parser can recognize. */
-#define XPATH_FUNCTIONS			11
+#define XPATH_FUNCTIONS			12
 
 XPathFunctionData xpathFunctions[XPATH_FUNCTIONS];
 
@@ -684,5 +739,7 @@ extern void xpathContains(XPathExprState exprState, unsigned short nargs, XPathE
 			  XPathExprOperandValue result);
 extern void xpathConcat(XPathExprState exprState, unsigned short nargs, XPathExprOperandValue args,
 			XPathExprOperandValue result);
+extern void xpathId(XPathExprState exprState, unsigned short nargs, XPathExprOperandValue args,
+		XPathExprOperandValue result);
 
 #endif   /* XPATH_H_ */
@@ -5,6 +5,26 @@
 #include "postgres.h"
 
 #include "xpath.h"
+#include "xmlnode_util.h"
+
+/*
+ * Element found by id(), along with the start of its subtree.
+ */
+typedef struct XPathIdMatch
+{
+	XMLNodeHdr	node;
+	char	   *start;
+} XPathIdMatch;
+
+typedef struct XPathIdMatches
+{
+	XPathIdMatch *items;
+	unsigned int count;
+	unsigned int countMax;
+} XPathIdMatches;
+
+static void addXPathIdMatches(XMLIdIndex index, xmldoc doc, char *ids, XPathIdMatches *matches);
+static int	idMatchComparator(const void *arg1, const void *arg2);
 
 XPathFunctionData xpathFunctions[] = {
 	{
@@ -83,6 +103,13 @@ XPathFunctionData xpathFunctions[] = {
 		{XPATH_VAL_STRING, XPATH_VAL_STRING, 0, 0}, true,
 		{.args = xpathConcat},
 		XPATH_VAL_STRING, false
+	},
+	{
+		XPATH_FUNC_ID,
+		"id", 1,
+		{XPATH_VAL_OBJECT, 0, 0, 0}, false,
+		{.args = xpathId},
+		XPATH_VAL_NODESET, false
 	}
 };
 
@@ -324,3 +351,217 @@ xpathConcat(XPathExprState exprState, unsigned short nargs, XPathExprOperandValu
 	result->isNull = false;
 	result->v.stringId = getXPathOperandId(exprState, out.data, XPATH_VAR_STRING);
 }
+
+/*
+ * The argument is a whitespace-separated list of IDs. If it's a node-set,
+ * string value of each node is such a list. Each ID is looked up in the ID
+ * index of the document (see xmlnode_id.c), so the function doesn't have to
+ * scan the document. The index is only built once per evaluation, see
+ * 'idIndex' of XPathExprStateData.
+ *
+ * The elements found are returned in the document order. Unlike getUnion(),
+ * sorting by address is not sufficient here: an element is stored after its
+ * descendants, but it precedes them in the document.
+ */
+void
+xpathId(XPathExprState exprState, unsigned short nargs, XPathExprOperandValue args,
+		XPathExprOperandValue result)
+{
+	XMLIdIndex	index;
+	XPathIdMatches matches;
+
+	result->type = XPATH_VAL_NODESET;
+	result->isNull = true;
+	result->v.nodeSet.count = 0;
+	result->v.nodeSet.isDocument = false;
+
+	if (args->isNull || exprState->document == NULL)
+	{
+		return;
+	}
+
+	index = getXMLIdIndex(exprState->document, exprState->idIndex);
+	matches.count = 0;
+	matches.countMax = XNODE_CONTAINER_CHUNK;
+	matches.items = (XPathIdMatch *) palloc(matches.countMax * sizeof(XPathIdMatch));
+
+	if (args->type == XPATH_VAL_NODESET)
+	{
+		XPathNodeSet nodeSet = &args->v.nodeSet;
+
+		/*
+		 * castXPathExprOperandToStr() considers string value of the document
+		 * node empty, so there's nothing to look up in that case.
+		 */
+		if (!nodeSet->isDocument && nodeSet->count > 0)
+		{
+			XMLNodeHdr	single;
+			XMLNodeHdr *nodes;
+			unsigned int i;
+
+			if (nodeSet->count == 1)
+			{
+				single = (XMLNodeHdr) getXPathOperandValue(exprState, nodeSet->nodes.nodeId,
+														   XPATH_VAR_NODE_SINGLE);
+				nodes = &single;
+			}
+			else
+			{
+				nodes = (XMLNodeHdr *) getXPathOperandValue(exprState, nodeSet->nodes.arrayId,
+															XPATH_VAR_NODE_ARRAY);
+			}
+
+			for (i = 0; i < nodeSet->count; i++)
+			{
+				XMLNodeHdr	node = nodes[i];
+				char	   *nodeStr;
+
+				if (node->kind == XMLNODE_ELEMENT)
+				{
+					nodeStr = getElementNodeStr((XMLCompNodeHdr) node);
+				}
+				else
+				{
+					nodeStr = getNonElementNodeStr(node);
+					if (nodeStr == NULL)
+					{
+						continue;
+					}
+					nodeStr = pstrdup(nodeStr);
+				}
+				addXPathIdMatches(index, exprState->document, nodeStr, &matches);
+				pfree(nodeStr);
+			}
+		}
+	}
+	else
+	{
+		XPathExprOperandValueData argStr;
+
+		castXPathExprOperandToStr(exprState, args, &argStr);
+		if (!argStr.isNull)
+		{
+			/* The tokens are terminated in place, so work on a copy. */
+			char	   *ids = pstrdup((char *) getXPathOperandValue(exprState, argStr.v.stringId,
+																	 XPATH_VAR_STRING));
+
+			addXPathIdMatches(index, exprState->document, ids, &matches);
+			pfree(ids);
+		}
+	}
+
+	if (matches.count > 1)
+	{
+		unsigned int i,
+					j;
+
+		/* The same element can be referenced by multiple tokens. */
+		qsort(matches.items, matches.count, sizeof(XPathIdMatch), idMatchComparator);
+		j = 1;
+		for (i = 1; i < matches.count; i++)
+		{
+			if (matches.items[i].node != matches.items[j - 1].node)
+			{
+				matches.items[j++] = matches.items[i];
+			}
+		}
+		matches.count = j;
+	}
+
+	result->v.nodeSet.count = matches.count;
+	if (matches.count == 1)
+	{
+		result->v.nodeSet.nodes.nodeId = getXPathOperandId(exprState, matches.items[0].node,
+														   XPATH_VAR_NODE_SINGLE);
+	}
+	else if (matches.count > 1)
+	{
+		XMLNodeHdr *nodes = (XMLNodeHdr *) palloc(matches.count * sizeof(XMLNodeHdr));
+		unsigned int i;
+
+		for (i = 0; i < matches.count; i++)
+		{
+			nodes[i] = matches.items[i].node;
+		}
+		result->v.nodeSet.nodes.arrayId = getXPathOperandId(exprState, nodes, XPATH_VAR_NODE_ARRAY);
+	}
+	pfree(matches.items);
+	result->isNull = (matches.count == 0);
+}
+
+/*
+ * Look up each ID of the whitespace-separated list 'ids' and add the
+ * elements found to 'matches'. 'ids' gets modified.
+ */
+static void
+addXPathIdMatches(XMLIdIndex index, xmldoc doc, char *ids, XPathIdMatches *matches)
+{
+	char	   *c = ids;
+
+	while (*c != '\0')
+	{
+		char	   *token;
+		XMLNodeHdr	node;
+
+		while (XNODE_WHITESPACE(c))
+		{
+			c++;
+		}
+		if (*c == '\0')
+		{
+			break;
+		}
+		token = c;
+		while (*c != '\0' && !XNODE_WHITESPACE(c))
+		{
+			c++;
+		}
+		if (*c != '\0')
+		{
+			*c++ = '\0';
+		}
+
+		node = lookupXMLIdIndex(index, doc, token);
+		if (node != NULL)
+		{
+			XPathIdMatch *match;
+
+			if (matches->count == matches->countMax)
+			{
+				matches->countMax *= 2;
+				matches->items = (XPathIdMatch *) repalloc(matches->items,
+										matches->countMax * sizeof(XPathIdMatch));
+			}
+			match = matches->items + matches->count++;
+			match->node = node;
+
+			/*
+			 * The subtree of an element starts at its first leaf. Subtrees of
+			 * elements not being each other's descendants don't overlap, so
+			 * the start determines the document order of them.
+			 */
+			match->start = (char *) getFirstXMLNodeLeaf((XMLCompNodeHdr) node);
+		}
+	}
+}
+
+/*
+ * Document order of ID matches. If one subtree starts where the other one
+ * does, the element stored at the higher address is the ancestor.
+ */
+static int
+idMatchComparator(const void *arg1, const void *arg2)
+{
+	XPathIdMatch *match1 = (XPathIdMatch *) arg1;
+	XPathIdMatch *match2 = (XPathIdMatch *) arg2;
+
+	if (match1->start != match2->start)
+	{
+		return (match1->start < match2->start) ? -1 : 1;
+	}
+	if (match1->node != match2->node)
+	{
+		return ((char *) match1->node > (char *) match2->node) ? -1 : 1;
+	}
+	return 0;
+}
@@ -0,0 +1,52 @@
+SET search_path TO xml;
+
+-- Force parallel execution of the queries (debug_parallel_query used to be
+-- called force_parallel_mode, min_parallel_table_scan_size used to be
+-- min_parallel_relation_size).
+DO $$
+BEGIN
+	IF current_setting('server_version_num')::int >= 160000 THEN
+		PERFORM set_config('debug_parallel_query', 'on', false);
+	ELSE
+		PERFORM set_config('force_parallel_mode', 'on', false);
+	END IF;
+	IF current_setting('server_version_num')::int >= 100000 THEN
+		PERFORM set_config('min_parallel_table_scan_size', '0', false);
+	ELSE
+		PERFORM set_config('min_parallel_relation_size', '0', false);
+	END IF;
+END
+$$;
+set parallel_setup_cost = 0;
+set parallel_tuple_cost = 0;
+
+create table par_docs (id int, data doc);
+insert into par_docs
+select i, ('<a><b i="' || i || '">' || i % 7 || '</b><c/></a>')::doc
+from generate_series(1, 1000) i;
+analyze par_docs;
+
+-- Functions not marked PARALLEL SAFE
+select p.proname, p.proparallel
+from pg_proc p
+join pg_namespace n on n.oid = p.pronamespace
+where n.nspname = 'xml' and p.proparallel <> 's'
+order by p.proname;
+
+-- XPath evaluation
+select count(*) from par_docs where data @? '/a/b[@i > 500]';
+select sum(path('count(/a/*)', data)::int) from par_docs;
+select path('/a/b', data) from par_docs where id = 7;
+select sum(array_length(path_refs('/a/*', data), 1)) from par_docs;
+
+-- Navigation
+select sum(array_length(child_refs(data, first_child(data, ref(data))), 1)) from par_docs;
+
+-- Modification
+select count(*) from par_docs where path_exists('/a/c/d', add(data, '/a/c', '<d/>', 'i'));
+select count(*) from par_docs where remove(data, '/a/b') = '<a><c/></a>'::doc;
+
+-- Aggregation
+select array_length(children(fragment_agg(path('/a/c', data)::node)), 1) from par_docs where id <= 100;
+
+drop table par_docs;
@@ -556,9 +556,196 @@ select xml.element('root', '{{"i", "x"}, {"j", 1}}', '<x k="u"><y l="v"/></x>');
 select xml.element('root', NULL, '<x k="u"><y l="v"/></x>');
 select xml.element('root', '{{"i", "x"}, {"j", 1}}', NULL);
 
+-- Comparison and hashing
+select '<a i="1" j="2"><b/>x</a>'::node = '<a j=''2'' i="1"><b></b>x</a>'::node;
+select '<a i="1"/>'::node = '<a i="2"/>'::node;
+select '<a><b/><c/></a>'::doc <> '<a><c/><b/></a>'::doc;
+select node_hash('<a i="1" j="2"/>') = node_hash('<a j=''2'' i="1"/>');
+select count(distinct n) from (values ('<a i="1" j="2"/>'::node), ('<a j="2" i="1"/>'), ('<b/>')) v(n);
+select n from (values ('<b/>'::node), ('<a k="1"/>'), ('<a/>')) v(n) order by n;
+
+-- Existence test
+select path_exists('/a/b', '<a><c/><b/><b/></a>');
+select path_exists('/a/d', '<a><c/><b/><b/></a>');
+select path_exists('/a//@i', '<a><c><b i="1"/></c></a>');
+select path_exists('count(/a/b) = 2', '<a><c/><b/><b/></a>');
+select id from states where data @? '/state/region[@name="Tirol"]' order by id;
+
+-- Volatility: the functions must not modify their input
+select p.proname, p.provolatile
+from pg_proc p
+join pg_namespace n on n.oid = p.pronamespace
+where n.nspname = 'xml' and p.proname in ('path', 'children', 'element', 'add', 'remove')
+order by p.proname, p.provolatile;
+with d(data) as (values ('<a><b/></a>'::doc))
+select data, add(data, '/a/b', '<c/>', 'i'), remove(data, '/a/b'), data
+from d;
+
+-- Shredding into typed columns
+select *
+from xml.table('/root/item', '{"@id", "name", "price", "@id=2"}',
+'<root><item id="1"><name>pen</name><price>1.5</price></item><item id="2"><name>ink</name></item></root>')
+as t(id int, name text, price numeric, second bool);
+select *
+from xml.table('/root', '{"item[@id=1]", "count(item)"}',
+'<root><item id="1"><name>pen</name><price>1.5</price></item><item id="2"><name>ink</name></item></root>')
+as t(item node, items int);
+select *
+from xml.table('/root/item', '{"name", "price"}',
+'<root><item id="1"><name>pen</name><price>1.5</price></item><item id="2"><name>ink</name></item></root>')
+as t(name text, has_price bool);
+
+-- Multiple paths evaluated at once
+select xml.paths('{"/a/b", "/a/c/text()", "/a/d", "count(/a/b)", "/a/b[2]"}', '<a><b>1</b><c>t</c><b>2</b></a>');
+
+-- Document passed in pieces
+select xml.doc_from_chunks(c order by i)
+from (values (2, '<b>text</b>'), (1, '<a x="1">'), (3, '</a>')) v(i, c);
+
+-- Parsing binary input in the declared encoding
+select xml.doc_parse(convert_to('<?xml version="1.0" encoding="ISO-8859-1"?><a>Grüße</a>', 'LATIN1'));
+select xml.doc_parse(convert_to('<a>Grüße</a>', 'UTF8'));
+
+-- Aggregation of nodes into a fragment
+select xml.fragment_agg(n order by i)
+from (values (3, '<c/>'::xml.node), (1, '<a x="1">t</a>'), (2, null), (4, 'text'), (5, '<d/><!--e-->')) v(i, n);
+select xml.node_kind(xml.fragment_agg(n)), xml.fragment_agg(n)
+from (values ('<a/>'::xml.node)) v(n);
+
+-- Element with multiple children
+select xml.element('tr', NULL, xml.element('td', NULL, 'a'), NULL, xml.element('td', NULL, 'b'));
+select xml.element('root', '{{"i", "x"}}', '<x/><y/>', 'text', '<z/>');
+
+-- Node references
+select xml.deref(t, unnest(xml.child_refs(t, xml.ref(t)))) from (values ('<a><b><c/></b>x</a>'::xml.node)) v(t);
+select xml.node_kind(xml.deref(t, r)), xml.deref(t, r)
+from (select t, unnest(xml.child_refs(t, (xml.child_refs(t, xml.ref(t)))[1])) r
+	from (values ('<a><b/><!--c--></a>'::xml.doc)) v(t)) s;
+select xml.deref(t, xml.ref(t)) from (values ('<a>x</a>'::xml.doc)) v(t);
+select xml.deref(t, unnest(xml.path_refs('/a/b', t))) from (values ('<a><b i="1"/><c/><b>x</b></a>'::xml.doc)) v(t);
+select xml.path_refs('/a/x', '<a><b/></a>');
+
+-- Navigation
+select xml.deref(t, xml.parent(t, xml.first_child(t, xml.first_child(t, xml.first_child(t, xml.ref(t))))))
+from (values ('<a><b i="1"><c/></b><d/></a>'::xml.doc)) v(t);
+select xml.deref(t, xml.next_sibling(t, xml.parent(t, xml.first_child(t, xml.first_child(t, xml.first_child(t, xml.ref(t)))))))
+from (values ('<a><b i="1"><c/></b><d/></a>'::xml.doc)) v(t);
+select xml.next_sibling(t, xml.first_child(t, xml.ref(t))) is null, xml.parent(t, xml.ref(t)) is null
+from (values ('<a><b/></a>'::xml.node)) v(t);
+select xml.deref(t, xml.parent(t, r)), xml.next_sibling(t, r) is null
+from (select t, (xml.child_refs(t, xml.ref(t)))[1] r from (values ('<a i="1"><b/></a>'::xml.node)) v(t)) s;
+select xml.deref(t, xml.descendants(t, xml.ref(t))) from (values ('<a i="1"><b><c/></b>x<!--y--></a>'::xml.node)) v(t);
+
+-- Document cache
+show xnode.doc_cache_size;
+
+-- ID index
+select xml.path('id("b")', '<a><x id="a"/><y id="b"/></a>'::xml.doc);
+select xml.path('id(" b a b ")', '<a><x id="a"/><y id="b"/></a>'::xml.doc);
+select xml.path('id("k")', '<!DOCTYPE a [<!ATTLIST y key ID #IMPLIED>]><a><y key="k"/></a>'::xml.doc);
+select xml.path('/a/ref[id(@to)]', '<a><x id="a"/><y id="b"/><ref to="a"/><ref to="c"/><ref to="c b"/></a>'::xml.doc);
+select xml.path('id("c p")', '<a><p id="p"><c id="c"/></p></a>'::xml.doc);
+select xml.path('id(/a/ref/@to)', '<a><x id="a"/><y id="b"/><ref to="b"/><ref to="a"/></a>'::xml.doc);
+
+-- Attributes vs. content children
+select xml.add('<a i="1"/>'::xml.doc, '/a', '<b/>', 'i');
+select xml.remove('<a i="1" j="2"><b k="3"/></a>'::xml.doc, '/a/@i');
+
+-- Mixed content
+select xml.path('/a/b', '<a>x<!--c--><b>1</b>y<b>2</b>z</a>'::xml.doc);
+select xml.remove('<a>x<b/>y<c>z</c></a>'::xml.doc, '/a/text()');
+
+-- String pool
+create table doc_sizes (doc int, layout text, size int);
+insert into doc_sizes select 1, 'plain', pg_column_size('<a><b s="shipped">shipped</b><c s="shipped"/><b s="shipped">shipped</b><b>shipped</b></a>'::xml.doc);
+set xnode.string_pool_threshold = 3;
+insert into doc_sizes select 1, 'pooled', pg_column_size('<a><b s="shipped">shipped</b><c s="shipped"/><b s="shipped">shipped</b><b>shipped</b></a>'::xml.doc);
+select '<a><b s="shipped">shipped</b><c s="shipped"/><b s="shipped">shipped</b><b>shipped</b></a>'::xml.doc;
+select xml.path('/a/b[@s="shipped"]', '<a><b s="shipped">shipped</b><c s="shipped"/><b s="shipped">shipped</b><b>shipped</b></a>'::xml.doc);
+select xml.remove('<a><b s="shipped">shipped</b><c s="shipped"/><b s="shipped">shipped</b><b>shipped</b></a>'::xml.doc, '/a/c');
+reset xnode.string_pool_threshold;
+-- Each of the 6 occurrences is replaced by 4-byte distance, the 8-byte string is stored once.
+select p.size - s.size as saved
+from doc_sizes p, doc_sizes s
+where p.doc = 1 and p.layout = 'plain' and s.doc = 1 and s.layout = 'pooled';
+
+-- Binary values of numeric attributes / text nodes
+select xml.path('/a/b[@p > 100]', '<a><b p="50"/><b p=" 150 "/><b p="x"/></a>'::xml.doc);
+select xml.path('/a[b > 1]/c', '<a><b>2.5</b><c/></a>'::xml.doc);
+select xml.path('/a[b = 10]/b', '<a><b>1&#48;</b></a>'::xml.doc);
+set xnode.string_pool_threshold = 2;
+select xml.path('/a/b[@p = 1234567890]', '<a><b p="1234567890"/><b p="1234567890"/><b p="123456789"/></a>'::xml.doc);
+reset xnode.string_pool_threshold;
+
+-- Split layout
+insert into doc_sizes select 2, 'plain', pg_column_size('<a lang="en"><b id="item-1">first item</b><b id="item-2">2</b><!--note--></a>'::xml.doc);
+set xnode.split_layout = on;
+insert into doc_sizes select 2, 'split', pg_column_size('<a lang="en"><b id="item-1">first item</b><b id="item-2">2</b><!--note--></a>'::xml.doc);
+select '<a lang="en"><b id="item-1">first item</b><b id="item-2">2</b><!--note--></a>'::xml.doc;
+select xml.path('/a/b[@id="item-2"]', '<a lang="en"><b id="item-1">first item</b><b id="item-2">2</b><!--note--></a>'::xml.doc);
+select xml.add('<a lang="en"><b id="item-1">first item</b><b id="item-2">2</b><!--note--></a>'::xml.doc, '/a/b[1]', '<c>inserted text</c>', 'a');
+reset xnode.split_layout;
+-- The 3 strings not shorter than the distance are in the pool, the nodes only point to them.
+select s.size - p.size as pool_refs
+from doc_sizes p, doc_sizes s
+where p.doc = 2 and p.layout = 'plain' and s.doc = 2 and s.layout = 'split';
+
+-- White space stripping and indentation
+select xml.doc_parse(E'<a>\n  <b> </b>\n  <c xml:space="preserve"> <d/> </c>\n</a>', true);
+select xml.doc_parse(E'<a>\n\t<b>1</b>\n\t<b>2</b>\n</a>', true);
+select xml.doc_parse('<p>a <b>x</b> <i>y</i></p>', true);
+select xml.doc_parse('<a> <b/> <![CDATA[c]]> <d/> </a>', true);
+select d, xml.path('/a/d/@x', d), xml.path('count(/a/node())', d)
+from xml.doc_parse('<a> <b> <c/> </b> <d x="1"> <e/> </d> </a>', true) d;
+select xml.doc_parse('<a> <b> <c/> </b> x <d> <e/> </d> </a>', true);
+select xml.doc_indent('<a><b x="1"><c/></b><p>mixed <i>text</i></p><!--c--></a>', 2);
+select xml.doc_indent(E'<a xml:space="preserve">\n<b/><c xml:space="default"><d/>  </c></a>', 1);
+
+-- Repeated modification in PL/pgSQL
+create function build_log(n int) returns xml.doc as $$
+declare
+	d	xml.doc := '<log/>';
+begin
+	for i in 1..n loop
+		d := xml.add(d, '/log', ('<e n="' || i || '"/>')::xml.node, 'i');
+	end loop;
+	d := xml.remove(d, '/log/e[@n=2]');
+	return xml.add(d, '/log/e[@n=3]', '<e n="2.5"/>', 'b');
+end
+$$ language plpgsql;
+select build_log(4);
+select xml.path('count(/log/e)', build_log(4));
+-- Result of an update is modified in place by the next one.
+select xml.remove(xml.add(xml.add('<a><b/></a>'::xml.doc, '/a', '<c/>', 'i'), '/a/b', '<d/>', 'i'), '/a/c');
+select xml.remove(xml.add('<a><b/></a>'::xml.doc, '/a', '<c/>', 'i'), '/a/x');
+
+-- Free space reserved for appends
+set xnode.node_fillfactor to 50;
+select xml.add(xml.add(xml.add('<log><h/></log>'::xml.doc, '/log', '<e n="1"/>', 'i'), '/log', '<e n="2"/>', 'i'), '/log/h', '<t/>', 'i');
+select xml.add(xml.add('<a><b/><c/></a>'::xml.doc, '/a/b', '<x/>', 'i'), '/a/b', '<y>z</y>', 'i');
+select xml.remove(xml.add('<a><b/><c/></a>'::xml.doc, '/a/b', '<x/>', 'i'), '/a/c');
+select xml.add(xml.add('<a><b/><c/></a>'::xml.doc, '/a/b', '<x/>', 'i'), '/a/c', '<d/>', 'b');
+select xml.path('count(/log/e)', d), xml.path('/log/e[last()]', d), xml.path('/log/e[2]', d)
+from build_log(50) d;
+-- The second append only uses the free space reserved by the first one.
+select pg_column_size(d1) - pg_column_size(d0) as growth
+from xml.add('<log/>'::xml.doc, '/log', '<e n="1"/>', 'i') d0, xml.add(d0, '/log', '<e n="2"/>', 'i') d1;
+reset xnode.node_fillfactor;
+select pg_column_size(d1) > pg_column_size(d0) as growth
+from xml.add('<log/>'::xml.doc, '/log', '<e n="1"/>', 'i') d0, xml.add(d0, '/log', '<e n="2"/>', 'i') d1;
+drop function build_log(int);
+
+-- Reference width changes
+select xml.path('count(/a/b/c/x)', d), xml.path('/a/d', d), xml.remove(d, '/a/b/c/x')
+from xml.add('<a><b><c/></b><d/></a>'::xml.doc, '/a/b/c', ('<x>' || repeat('y', 300) || '</x>')::xml.node, 'i') d;
+select xml.path('count(/a/*)', xml.add('<a><b/><d/></a>'::xml.doc, '/a/d', ('<x>' || repeat('y', 70000) || '</x>')::xml.node, 'b'));
+select xml.path('/a/x', d), xml.path('count(/a/b)', d), xml.remove(d, '/a/b')
+from xml.add(('<a><b>' || repeat('y', 300) || '</b></a>')::xml.doc, '/a/b', '<x/>'::xml.node, 'b') d;
+
 -- Cleanup
 
 drop table states;
 drop table paths;
 drop table docs_other;
+drop table doc_sizes;
 